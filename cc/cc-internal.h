@@ -12,17 +12,29 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include "libut.h"
+#include "uthash.h"
 #include "cc.h"
 
 #include <jansson.h>
 
 #define adim(a) (sizeof(a)/sizeof(*a))
 
-struct cc {
+/* a parsed cast. it's immutable once parsed, so every cc opened
+ * on the same cast text shares one, from a process-wide cache */
+struct cc_schema {
   UT_vector /* of UT_string */ names;
   UT_vector /* of int       */ output_types; /* enum (CC_i16 CC_i32) etc */
   UT_vector /* of UT_string */ defaults;     /* pack w/o map uses this default */
+  char *text;                                /* cast text (cache key) */
+  size_t len;
+  int refcnt;                                /* under the cache lock */
+  UT_hash_handle hh;
+};
+
+struct cc {
+  struct cc_schema *schema;                  /* shared, read-only */
   UT_vector /* of void* */     caller_addrs; /* caller pointer to copy data from */
   UT_vector /* of int       */ caller_types; /* caller pointer type i16 i32 etc */
   UT_vector /* struct cc_map */dissect_map;  /* fulfills cc_dissect */
@@ -156,10 +156,13 @@ static int is_empty_line(char *line, size_t len, char **nl) {
  *  < 0 error
  *
  */
-static int parse_cc(struct cc *cc, char *buf, size_t sz) {
+static int parse_cc(struct cc_schema *cs, char *buf, size_t sz) {
 	char *line, *name, *type, *defult, *b;
   size_t len1, len2, len3, left;
-  int lno=1, type_i;
+  int lno=1, type_i, rc = -1;
+  UT_string tmp;
+
+  utstring_init(&tmp);
 
   line = buf;
   while (line < buf+sz) {
@@ -178,26 +181,21 @@ static int parse_cc(struct cc *cc, char *buf, size_t sz) {
 
     if ((type_i == -1) || (name == NULL)) {
       fprintf(stderr, "parse_cc: syntax error on line %d\n", lno);
-      return -1;
+      goto done;
     }
 
     /* type */
-    utvector_push(&cc->output_types, &type_i);
+    utvector_push(&cs->output_types, &type_i);
 
     /* name */
-    utstring_clear(&cc->tmp);
-    utstring_bincpy(&cc->tmp, name, len2);
-    utvector_push(&cc->names, &cc->tmp);
+    utstring_clear(&tmp);
+    utstring_bincpy(&tmp, name, len2);
+    utvector_push(&cs->names, &tmp);
 
     /* default */
-    utstring_clear(&cc->tmp);
-    if (defult) utstring_bincpy(&cc->tmp, defult, len3);
-    utvector_push(&cc->defaults, &cc->tmp);
-
-    /* maps */
-    utvector_extend(&cc->caller_addrs);
-    utvector_extend(&cc->caller_types);
-    utvector_extend(&cc->dissect_map);
+    utstring_clear(&tmp);
+    if (defult) utstring_bincpy(&tmp, defult, len3);
+    utvector_push(&cs->defaults, &tmp);
 
     /* advance to next line */
     b = defult ? (defult+len3) : (name+len2);
@@ -207,12 +205,144 @@ static int parse_cc(struct cc *cc, char *buf, size_t sz) {
     lno++;
   }
 
-  return 0;
+  rc = 0;
+
+ done:
+  utstring_done(&tmp);
+  return rc;
+}
+
+/*
+ * schema cache
+ *
+ * parsed casts are kept for the life of the process, keyed by
+ * the cast text, so that opening another cc on a known cast costs
+ * a hash lookup and a reference rather than a parse. entries hold
+ * one reference of their own; cc_cache_flush drops unused ones.
+ *
+ */
+static struct cc_schema *schema_cache;
+static pthread_mutex_t schema_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void schema_free(struct cc_schema *cs) {
+  utvector_fini(&cs->names);
+  utvector_fini(&cs->output_types);
+  utvector_fini(&cs->defaults);
+  free(cs->text);
+  free(cs);
+}
+
+static struct cc_schema *schema_parse(char *text, size_t len) {
+  struct cc_schema *cs;
+
+  cs = calloc(1, sizeof(*cs));
+  if (cs == NULL) goto oom;
+  utvector_init(&cs->names,        utstring_mm);
+  utvector_init(&cs->output_types, utmm_int);
+  utvector_init(&cs->defaults,     utstring_mm);
+
+  cs->text = malloc(len);
+  if (cs->text == NULL) goto oom;
+  memcpy(cs->text, text, len);
+  cs->len = len;
+
+  if (parse_cc(cs, text, len) < 0) {
+    schema_free(cs);
+    return NULL;
+  }
+  return cs;
+
+ oom:
+  fprintf(stderr,"cc_open: out of memory\n");
+  if (cs) schema_free(cs);
+  return NULL;
+}
+
+/* get a reference to the parsed cast of text, parsing if not cached */
+static struct cc_schema *schema_get(char *text, size_t len) {
+  struct cc_schema *cs, *found;
+
+  pthread_mutex_lock(&schema_lock);
+  HASH_FIND(hh, schema_cache, text, len, found);
+  if (found) found->refcnt++;
+  pthread_mutex_unlock(&schema_lock);
+  if (found) return found;
+
+  /* parse outside the lock */
+  cs = schema_parse(text, len);
+  if (cs == NULL) return NULL;
+
+  /* another thread may have cached it meanwhile */
+  pthread_mutex_lock(&schema_lock);
+  HASH_FIND(hh, schema_cache, text, len, found);
+  if (found) found->refcnt++;
+  else {
+    cs->refcnt = 2; /* the cache's and the caller's */
+    HASH_ADD_KEYPTR(hh, schema_cache, cs->text, cs->len, cs);
+  }
+  pthread_mutex_unlock(&schema_lock);
+
+  if (found) {
+    schema_free(cs);
+    cs = found;
+  }
+  return cs;
+}
+
+static void schema_hold(struct cc_schema *cs) {
+  pthread_mutex_lock(&schema_lock);
+  cs->refcnt++;
+  pthread_mutex_unlock(&schema_lock);
+}
+
+static void schema_release(struct cc_schema *cs) {
+  pthread_mutex_lock(&schema_lock);
+  cs->refcnt--;
+  pthread_mutex_unlock(&schema_lock);
+}
+
+/*
+ * cc_cache_flush
+ *
+ * free the cached casts that no open cc is using
+ *
+ */
+void cc_cache_flush(void) {
+  struct cc_schema *cs, *tmp;
+
+  pthread_mutex_lock(&schema_lock);
+  HASH_ITER(hh, schema_cache, cs, tmp) {
+    if (cs->refcnt > 1) continue;
+    HASH_DEL(schema_cache, cs);
+    schema_free(cs);
+  }
+  pthread_mutex_unlock(&schema_lock);
+}
+
+/* attach a cc to its schema, sizing the per-field mapping state */
+static void cc_bind(struct cc *cc, struct cc_schema *cs) {
+  int n;
+
+  cc->schema = cs;
+  for(n = 0; n < utvector_len(&cs->names); n++) {
+    utvector_extend(&cc->caller_addrs);
+    utvector_extend(&cc->caller_types);
+    utvector_extend(&cc->dissect_map);
+  }
+}
+
+static void cc_mapv_clear(struct cc *cc)
+{
+  void **mp = NULL;
+  while ( (mp = utvector_next(&cc->caller_addrs, mp))) {
+    *mp = NULL;
+  }
 }
 
 /* open the cc file describing the buffer format */
 struct cc * cc_open( char *file_or_text, int flags, ...) {
-  int rc = -1, need_free=0, sc;
+  int rc = -1, need_free=0;
+  struct cc_schema *cs;
   char *text=NULL, *file;
   struct cc *cc = NULL;
   size_t len=0;
@@ -245,8 +375,9 @@ struct cc * cc_open( char *file_or_text, int flags, ...) {
   }
 
   assert(len > 0);
-  sc = parse_cc(cc, text, len);
-  if (sc < 0) goto done;
+  cs = schema_get(text, len);
+  if (cs == NULL) goto done;
+  cc_bind(cc, cs);
 
   rc = 0;
 
@@ -263,7 +394,35 @@ struct cc * cc_open( char *file_or_text, int flags, ...) {
   return cc;
 }
 
+/*
+ * cc_dup
+ *
+ * open another cc on the cast already parsed into cc.
+ * the duplicate shares the parsed cast, but has its own buffers
+ * and no caller mappings, so it can be used from another thread.
+ *
+ * returns
+ *   new cc (caller must cc_close it), or NULL on error
+ *
+ */
+struct cc * cc_dup(struct cc *cc) {
+  struct cc *dup;
+
+  dup = calloc(1, sizeof(*dup));
+  if (dup == NULL) {
+    fprintf(stderr,"cc_dup: out of memory\n");
+    return NULL;
+  }
+
+  utmm_init(&cc_mm,dup,1);
+  utmm_copy(&cc_mm,dup,cc,1);
+  schema_hold(dup->schema);
+  cc_mapv_clear(dup);
+  return dup;
+}
+
 int cc_close(struct cc *cc) {
+  schema_release(cc->schema);
   utmm_fini(&cc_mm,cc,1);
   free(cc);
   return 0;
@@ -273,21 +432,13 @@ int cc_close(struct cc *cc) {
 static int get_index(struct cc *cc, char *name) {
   int i=0;
   UT_string *s = NULL;
-  while ( (s = utvector_next(&cc->names, s))) {
+  while ( (s = utvector_next(&cc->schema->names, s))) {
     if (strcmp(name, utstring_body(s)) == 0) break;
     i++;
   }
   return s ? i : -1;
 }
 
-static void cc_mapv_clear(struct cc *cc)
-{
-  void **mp = NULL;
-  while ( (mp = utvector_next(&cc->caller_addrs, mp))) {
-    *mp = NULL;
-  }
-}
-
 /* associate pointers into caller memory with cc fields */
 int cc_mapv(struct cc *cc, struct cc_map *map, int count) {
   int rc=-1, i, n, nmapped=0;
@@ -308,7 +459,7 @@ int cc_mapv(struct cc *cc, struct cc_map *map, int count) {
     }
 
     mp = utvector_elt(&cc->caller_addrs, i);
-    ot = utvector_elt(&cc->output_types, i);
+    ot = utvector_elt(&cc->schema->output_types, i);
     ct = utvector_elt(&cc->caller_types, i);
 
     *ct = m->type;
@@ -357,12 +508,12 @@ int cc_capture(struct cc *cc, char **out, size_t *len) {
   *len = 0;
 
   fn = NULL;
-  while( (fn = utvector_next(&cc->names, fn))) {
+  while( (fn = utvector_next(&cc->schema->names, fn))) {
 
     mp = utvector_elt(&cc->caller_addrs, i);
-    ot = utvector_elt(&cc->output_types, i);
+    ot = utvector_elt(&cc->schema->output_types, i);
     ct = utvector_elt(&cc->caller_types, i);
-    df = utvector_elt(&cc->defaults, i);
+    df = utvector_elt(&cc->schema->defaults, i);
     i++;
 
     def = utstring_body(df);
@@ -445,9 +596,9 @@ int cc_to_json(struct cc *cc, char **out, size_t *out_len,
   fn = NULL;
   json_object_clear(cc->json);
 
-  while ( (fn = utvector_next(&cc->names, fn))) {
+  while ( (fn = utvector_next(&cc->schema->names, fn))) {
     key = utstring_body(fn);
-    ot = utvector_elt(&cc->output_types, i);
+    ot = utvector_elt(&cc->schema->output_types, i);
     u = slot_to_json(*ot,f,l,&j);
     if (u < 0) goto done;
     if (json_object_set_new(cc->json, key, j) < 0) goto done;
@@ -646,8 +797,8 @@ int cc_dissect(struct cc *cc, struct cc_map **map, int *count,
 
   for(i = 0; i < *count; i++) {
 
-    fn = utvector_elt(&cc->names, i);
-    ot = utvector_elt(&cc->output_types, i);
+    fn = utvector_elt(&cc->schema->names, i);
+    ot = utvector_elt(&cc->schema->output_types, i);
 
     dm[i].name = utstring_body(fn);
     dm[i].type = *ot;
@@ -705,8 +856,35 @@ int cc_dissect(struct cc *cc, struct cc_map **map, int *count,
 int cc_count(struct cc *cc) {
   int c;
 
-  c = utvector_len(&cc->names);
+  c = utvector_len(&cc->schema->names);
   return c;
 }
 
+/*
+ * cc_field
+ *
+ * get the name and type of field i of the cast,
+ * as cc_dissect would give them, without a buffer
+ *
+ * the name is internal to the cc structure; it
+ * remains valid until cc_close
+ *
+ * returns
+ *  0 success
+ * -1 no such field
+ *
+ */
+int cc_field(struct cc *cc, int i, char **name, cc_type *type) {
+  UT_string *fn;
+  cc_type *ot;
+
+  if ((i < 0) || (i >= cc_count(cc))) return -1;
+
+  fn = utvector_elt(&cc->schema->names, i);
+  ot = utvector_elt(&cc->schema->output_types, i);
+  *name = utstring_body(fn);
+  *type = *ot;
+  return 0;
+}
+
 
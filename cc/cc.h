@@ -48,9 +48,18 @@ struct cc_map {
 struct cc * cc_open(char *file_or_text, int flags, ...);
 int cc_close(struct cc *cc);
 
+/* open another cc on an already-parsed cast */
+struct cc * cc_dup(struct cc *cc);
+
+/* free cached casts no longer used by any cc */
+void cc_cache_flush(void);
+
 /* get the number of fields in cc */
 int cc_count(struct cc *cc);
 
+/* get the name and type of a field, by its position */
+int cc_field(struct cc *cc, int i, char **name, cc_type *type);
+
 /* associate fields with caller memory locations */
 int cc_mapv(struct cc *cc, struct cc_map *map, int count);
 
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "cc.h"
+
+char *conf = __FILE__ "fg";   /* test1.c becomes test1.cfg */
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+/* two cc on one (cached) cast keep independent mappings */
+int main() {
+  char *flat, *json;
+  size_t len, jlen;
+  int rc=-1, sc;
+  int32_t id1 = 1, id2 = 2;
+  char *n1 = "first", *n2 = "second", *h = "shared";
+
+  struct cc_map map1[] = {
+    { "id",     CC_i32, &id1 },
+    { "name",   CC_str, &n1 },
+    { "handle", CC_str, &h },
+  };
+  struct cc_map map2[] = {
+    { "id",     CC_i32, &id2 },
+    { "name",   CC_str, &n2 },
+    { "handle", CC_str, &h },
+  };
+
+  struct cc *cc1, *cc2, *cc3;
+  cc1 = cc_open(conf, CC_FILE);
+  if (cc1 == NULL) goto done;
+  cc2 = cc_open(conf, CC_FILE);
+  if (cc2 == NULL) goto done;
+  cc3 = cc_dup(cc1);
+  if (cc3 == NULL) goto done;
+  printf("fields %d %d %d\n", cc_count(cc1), cc_count(cc2), cc_count(cc3));
+
+  if (cc_mapv(cc1, map1, adim(map1)) < 0) goto done;
+  if (cc_mapv(cc2, map2, adim(map2)) < 0) goto done;
+
+  sc = cc_capture(cc1, &flat, &len);
+  if (sc < 0) goto done;
+  sc = cc_to_json(cc2, &json, &jlen, flat, len, 0);
+  if (sc < 0) goto done;
+  printf("%.*s\n", (int)jlen, json);
+
+  sc = cc_capture(cc2, &flat, &len);
+  if (sc < 0) goto done;
+  sc = cc_to_json(cc3, &json, &jlen, flat, len, 0);
+  if (sc < 0) goto done;
+  printf("%.*s\n", (int)jlen, json);
+
+  /* the dup has no mappings of its own */
+  sc = cc_capture(cc3, &flat, &len);
+  printf("unmapped capture: %s\n", (sc < 0) ? "error" : "ok");
+
+  cc_close(cc1);
+  cc_close(cc2);
+  cc_close(cc3);
+  cc_cache_flush();
+  rc = 0;
+
+ done:
+  return rc;
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include "cc.h"
+
+char *conf = __FILE__ "fg";   /* test1.c becomes test1.cfg */
+
+/* the fields of a cast, by position, without a buffer */
+int main() {
+  int rc=-1, i;
+  cc_type type;
+  char *name;
+
+  struct cc *cc;
+  cc = cc_open(conf, CC_FILE);
+  if (cc == NULL) goto done;
+
+  for(i = 0; i <= cc_count(cc); i++) {
+    if (cc_field(cc, i, &name, &type) < 0) {
+      printf("field %d: none\n", i);
+      continue;
+    }
+    printf("field %d: %s %s\n", i, cc_types[type], name);
+  }
+
+  cc_close(cc);
+  rc = 0;
+
+ done:
+  return rc;
+}
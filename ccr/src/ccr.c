@@ -1,5 +1,8 @@
+#define _GNU_SOURCE /* asprintf */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
@@ -7,17 +10,58 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 #include "libut.h"
 #include "ccr.h"
 
+/* a CCR_SHARED writer batches frames until either limit is reached,
+ * then takes the ring lock once to write the whole batch */
+#define MP_BATCH_BYTES  (64 * 1024)
+#define MP_BATCH_FRAMES 1024
+
+/* default CCR_SPIN budget, before a reader blocks */
+#define SPIN_DEFAULT_US 50
+
+/* writers keep frame statistics in a file beside the ring,
+ * named by appending this suffix to the ring file name */
+#define STAT_SUFFIX ".stat"
+#define STAT_MAGIC  0x63637273 /* ccrs */
+#define STAT_LEN    4096
+
+/* layout of the statistics file; its fields are updated atomically */
+struct ring_stat {
+  uint32_t magic;
+  uint32_t pad;
+  struct ccr_stat s;
+};
+
+/* state common to a CCR_SHARED handle and its per-thread handles */
+struct ccr_mp {
+  pthread_mutex_t lock;  /* serializes use of the shared shr */
+  int refcnt;            /* handles using the shr; under lock */
+};
+
 struct ccr {
   struct shr *shr;
   struct cc *cc;
   UT_string *tmp;
   int flags;
   struct cc_map *dissect_map;
+  /* CCR_SHARED writers */
+  struct ccr_mp *mp;
+  UT_string *batch;      /* captured frames, not yet written */
+  UT_vector *batch_iov;  /* frame offsets (iov_base) and lengths */
+  /* CCR_SPIN readers */
+  long spin_ns;          /* time to poll an empty ring before blocking */
+  /* frame statistics file, mapped; NULL if unavailable */
+  struct ring_stat *stat;
 };
 
+static const UT_mm iov_mm = { .sz = sizeof(struct iovec) };
+
 static int slurp(char *file, char **text, size_t *len) {
   int fd=-1, rc=-1;
   struct stat s;
@@ -103,7 +147,8 @@ static int validate_text(char *text, size_t len) {
   struct cc *cc;
   int rc = -1;
 
-  /* invoke cc to parse the text to validate it */
+  /* invoke cc to parse the text to validate it. cc caches the
+   * parsed cast, so a ccr_open of the new ring won't parse again */
   cc = cc_open(text, CC_BUFFER, len);
   if (cc == NULL) goto done;
 
@@ -114,6 +159,223 @@ static int validate_text(char *text, size_t len) {
   return rc;
 }
 
+/*
+ * populate
+ *
+ * fault in the pages of a mapping now, rather than on first use;
+ * asking for transparent huge pages first if hugepage is set.
+ * writable mappings are faulted for write, so that the first
+ * write to each page doesn't take a second (write-protect) fault.
+ *
+ */
+static void populate(char *addr, size_t len, int writable, int hugepage) {
+  long pagesz = sysconf(_SC_PAGESIZE);
+  volatile char *p;
+  size_t off;
+  int sc = -1;
+
+#ifdef MADV_HUGEPAGE
+  if (hugepage && (madvise(addr, len, MADV_HUGEPAGE) < 0))
+    fprintf(stderr, "madvise: %s\n", strerror(errno));
+#endif
+
+#if defined(MADV_POPULATE_WRITE) && defined(MADV_POPULATE_READ)
+  sc = madvise(addr, len, writable ? MADV_POPULATE_WRITE : MADV_POPULATE_READ);
+#endif
+  if (sc == 0) return;
+
+  /* older kernel; touch each page. an atomic add of zero
+   * is a write fault that leaves concurrent writers' data
+   * intact. */
+  for(off = 0; off < len; off += pagesz) {
+    p = addr + off;
+    if (writable) __atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+    else (void)*p;
+  }
+}
+
+/*
+ * prefault_open
+ *
+ * apply CCR_HUGEPAGE/CCR_PREFAULT to the mappings of the ring
+ * that the shr handle has just made in this process. shr does
+ * not expose them, so we locate them in /proc/self/maps by the
+ * ring file device and inode.
+ *
+ * returns
+ *   0 success (including, no mapping found)
+ *  -1 error
+ */
+static int prefault_open(char *ring, int flags) {
+  unsigned long start, end, inode, maj, min;
+  char line[1024], perms[5];
+  FILE *maps = NULL;
+  struct stat s;
+  int rc = -1;
+
+  if (stat(ring, &s) < 0) {
+    fprintf(stderr,"can't stat %s: %s\n", ring, strerror(errno));
+    goto done;
+  }
+
+  maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) {
+    fprintf(stderr,"can't open /proc/self/maps: %s\n", strerror(errno));
+    goto done;
+  }
+
+  while (fgets(line, sizeof(line), maps)) {
+    if (sscanf(line, "%lx-%lx %4s %*x %lx:%lx %lu",
+               &start, &end, perms, &maj, &min, &inode) != 6) continue;
+    if ((inode != s.st_ino) ||
+        (maj != major(s.st_dev)) ||
+        (min != minor(s.st_dev))) continue;
+    populate((char*)start, end - start, (perms[1] == 'w') ? 1 : 0,
+             (flags & CCR_HUGEPAGE) ? 1 : 0);
+  }
+
+  rc = 0;
+
+ done:
+  if (maps) fclose(maps);
+  return rc;
+}
+
+/*
+ * prefault_init
+ *
+ * apply CCR_HUGEPAGE/CCR_PREFAULT to a newly created ring, so its
+ * backing pages (e.g. tmpfs) are allocated up front, and allocated
+ * as huge pages where the kernel allows shmem huge pages on advice.
+ * a ring file on hugetlbfs gets huge pages regardless.
+ *
+ * returns
+ *   0 success
+ *  -1 error
+ */
+static int prefault_init(char *ring, int flags) {
+  int fd = -1, rc = -1, sc;
+  char *addr = MAP_FAILED;
+  struct stat s;
+
+  fd = open(ring, O_RDWR);
+  if (fd == -1) {
+    fprintf(stderr,"can't open %s: %s\n", ring, strerror(errno));
+    goto done;
+  }
+
+  if (fstat(fd, &s) < 0) {
+    fprintf(stderr,"can't stat %s: %s\n", ring, strerror(errno));
+    goto done;
+  }
+
+  addr = mmap(NULL, s.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    goto done;
+  }
+
+  populate(addr, s.st_size, 1, (flags & CCR_HUGEPAGE) ? 1 : 0);
+
+  /* allocate anything left, without faulting it in */
+  sc = posix_fallocate(fd, 0, s.st_size);
+  if (sc && (sc != EOPNOTSUPP) && (sc != EINVAL)) {
+    fprintf(stderr, "posix_fallocate: %s\n", strerror(sc));
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (addr != MAP_FAILED) munmap(addr, s.st_size);
+  if (fd != -1) close(fd);
+  return rc;
+}
+
+/*
+ * stat_open
+ *
+ * map the frame statistics file of the ring. writers create it
+ * if needed. readers of a ring that has none get NULL, as does
+ * any writer that cannot create it, e.g. in a read-only directory;
+ * the statistics are advisory.
+ *
+ */
+static struct ring_stat *stat_open(char *ring, int writer) {
+  struct ring_stat *rs = NULL;
+  char *file = NULL;
+  int fd = -1, fl;
+  void *addr;
+  struct stat s;
+
+  if (asprintf(&file, "%s%s", ring, STAT_SUFFIX) < 0) {
+    file = NULL;
+    goto done;
+  }
+
+  fl = writer ? (O_RDWR|O_CREAT) : O_RDONLY;
+  fd = open(file, fl, 0644);
+  if (fd == -1) goto done;
+
+  if (fstat(fd, &s) < 0) goto done;
+  if ((s.st_size < STAT_LEN) && writer && (ftruncate(fd, STAT_LEN) < 0))
+    goto done;
+  if ((s.st_size < STAT_LEN) && !writer) goto done;
+
+  fl = writer ? (PROT_READ|PROT_WRITE) : PROT_READ;
+  addr = mmap(NULL, STAT_LEN, fl, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) goto done;
+  rs = addr;
+
+  /* a new file is all zero; stamp it */
+  if (writer) {
+    uint32_t zero = 0;
+    __atomic_compare_exchange_n(&rs->magic, &zero, STAT_MAGIC, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+
+  if (rs->magic != STAT_MAGIC) {
+    munmap(rs, STAT_LEN);
+    rs = NULL;
+  }
+
+ done:
+  if (fd != -1) close(fd);
+  if (file) free(file);
+  return rs;
+}
+
+/* account for frames written, of total length bytes, largest max */
+static void stat_update(struct ring_stat *rs, size_t frames,
+                        size_t bytes, size_t max) {
+  uint64_t old, now, zero = 0;
+  struct timespec ts;
+
+  if (rs == NULL) return;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  __atomic_fetch_add(&rs->s.frames, frames, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&rs->s.bytes, bytes, __ATOMIC_RELAXED);
+  old = __atomic_load_n(&rs->s.max_frame, __ATOMIC_RELAXED);
+  while ((max > old) &&
+         !__atomic_compare_exchange_n(&rs->s.max_frame, &old, max, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+  __atomic_compare_exchange_n(&rs->s.first_ns, &zero, now, 0,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  __atomic_store_n(&rs->s.last_ns, now, __ATOMIC_RELAXED);
+}
+
+/* remove the statistics file of a ring being (re)created */
+static void stat_reset(char *ring) {
+  char *file;
+
+  if (asprintf(&file, "%s%s", ring, STAT_SUFFIX) < 0) return;
+  unlink(file);
+  free(file);
+}
+
 int ccr_init(char *ring, size_t sz, int flags, ...) {
   int shr_flags, rc = -1, sc, need_free=0, nmodes=0;
   char *file, *text = NULL;
@@ -160,6 +422,9 @@ int ccr_init(char *ring, size_t sz, int flags, ...) {
   assert(text && len);
   if (validate_text(text, len) < 0) goto done;
   rc = shr_init(ring, sz, shr_flags, text, len);
+  if ((rc == 0) && ((flags & CCR_KEEPEXIST) == 0)) stat_reset(ring);
+  if ((rc == 0) && (flags & (CCR_HUGEPAGE|CCR_PREFAULT)))
+    rc = prefault_init(ring, flags);
 
  done:
   if (text && need_free) free(text);
@@ -167,12 +432,41 @@ int ccr_init(char *ring, size_t sz, int flags, ...) {
   return rc;
 }
 
+/*
+ * ccr_open
+ *
+ * open a ring for reading (CCR_RDONLY) or writing (CCR_WRONLY)
+ *
+ * flags                    description
+ * -----                    -----------------------------------------
+ * CCR_NONBLOCK             reads return 0 rather than block when empty
+ * CCR_BUFFER               buffer writes until ccr_flush (CCR_WRONLY)
+ * CCR_SHARED               the handle is a parent for per-thread handles
+ *                          made by ccr_open_thread (CCR_WRONLY)
+ * CCR_SPIN                 poll an empty ring before blocking (CCR_RDONLY)
+ * CCR_PREFAULT             fault in the ring mapping now, not on first use
+ * CCR_HUGEPAGE             ask for transparent huge pages on the mapping
+ *
+ * CCR_SPIN takes an unsigned vararg: the spin budget in microseconds
+ * (0 means the default). A read of an empty ring polls it with cpu
+ * pause for the first half of the budget and sched_yield for the
+ * rest, then blocks; or returns 0 in CCR_NONBLOCK mode. This trades
+ * a core for avoiding the wakeup cost of blocking on every frame.
+ *
+ * returns
+ *   ccr handle, or NULL on error
+ *
+ */
 struct ccr *ccr_open(char *ring, int flags, ...) {
   int sc, rc=-1, shr_mode=0;
   struct ccr *ccr=NULL;
+  unsigned spin_us=0;
   char *text=NULL;
   size_t len;
 
+  va_list ap;
+  va_start(ap, flags);
+
   /* must be least R or W, and not both */
   if (((flags & CCR_RDONLY) ^ (flags & CCR_WRONLY)) == 0) {
     fprintf(stderr,"ccr_open: invalid mode\n");
@@ -184,6 +478,16 @@ struct ccr *ccr_open(char *ring, int flags, ...) {
   if (flags & CCR_WRONLY)   shr_mode |= SHR_WRONLY;
   if (flags & CCR_BUFFER)   shr_mode |= SHR_BUFFERED;
 
+  if (flags & CCR_SPIN) {
+    if ((flags & CCR_RDONLY) == 0) {
+      fprintf(stderr,"ccr_open: CCR_SPIN requires CCR_RDONLY\n");
+      goto done;
+    }
+    spin_us = va_arg(ap, unsigned);
+    if (spin_us == 0) spin_us = SPIN_DEFAULT_US;
+    shr_mode |= SHR_NONBLOCK; /* we poll, and block ourselves */
+  }
+
   ccr = calloc(1, sizeof(*ccr));
   if (ccr == NULL) {
     fprintf(stderr,"ccr_open: out of memory\n");
@@ -193,18 +497,47 @@ struct ccr *ccr_open(char *ring, int flags, ...) {
   ccr->shr = shr_open(ring, shr_mode);
   if (ccr->shr == NULL) goto done;
 
+  if ((flags & (CCR_HUGEPAGE|CCR_PREFAULT)) &&
+      (prefault_open(ring, flags) < 0)) goto done;
+
   sc = shr_appdata(ccr->shr, (void**)&text, NULL, &len);
   if (sc < 0) {
     fprintf(stderr,"ccr_open: text not found\n");
     goto done;
   }
 
+  /* a cast already opened in this process is not parsed again */
   assert(text && len);
   ccr->cc = cc_open(text, CC_BUFFER, len);
   if (ccr->cc == NULL) goto done;
 
   utstring_new(ccr->tmp);
   ccr->flags = flags;
+  ccr->spin_ns = spin_us * 1000L;
+
+  /* readers start with a buffer that fits the largest frame so far,
+   * rather than learn it by failed reads in ccr_getnext */
+  ccr->stat = stat_open(ring, (flags & CCR_WRONLY) ? 1 : 0);
+  if (ccr->stat && (flags & CCR_RDONLY)) {
+    utstring_reserve(ccr->tmp, ccr->stat->s.max_frame + sizeof(uint32_t));
+  }
+
+  if (flags & CCR_SHARED) {
+    if ((flags & CCR_WRONLY) == 0) {
+      fprintf(stderr,"ccr_open: CCR_SHARED requires CCR_WRONLY\n");
+      goto done;
+    }
+    ccr->mp = calloc(1, sizeof(struct ccr_mp));
+    if (ccr->mp == NULL) {
+      fprintf(stderr,"ccr_open: out of memory\n");
+      goto done;
+    }
+    pthread_mutex_init(&ccr->mp->lock, NULL);
+    ccr->mp->refcnt = 1;
+    utstring_new(ccr->batch);
+    ccr->batch_iov = utvector_new(&iov_mm);
+  }
+
   rc = 0;
 
  done:
@@ -212,19 +545,154 @@ struct ccr *ccr_open(char *ring, int flags, ...) {
     if (ccr && ccr->cc) cc_close(ccr->cc);
     if (ccr && ccr->shr) shr_close(ccr->shr);
     if (ccr && ccr->tmp) utstring_free(ccr->tmp);
+    if (ccr && ccr->mp) free(ccr->mp);
+    if (ccr && ccr->batch) utstring_free(ccr->batch);
+    if (ccr && ccr->batch_iov) utvector_free(ccr->batch_iov);
+    if (ccr && ccr->stat) munmap(ccr->stat, STAT_LEN);
     if (ccr) free(ccr);
     ccr = NULL;
   }
   if (text) free(text);
+  va_end(ap);
+  return ccr;
+}
+
+/*
+ * ccr_open_thread
+ *
+ * make a per-thread writer handle from a CCR_SHARED handle.
+ *
+ * the new handle shares the ring mapping and parsed cast of the
+ * parent, but has its own cc (so its own ccr_mapv and capture
+ * buffer). each thread should use only its own handle. captures
+ * accumulate in a per-handle batch that is written to the ring,
+ * under the shared lock, once it fills; ccr_flush writes it early.
+ *
+ * the per-thread handles and the parent may be closed in any order.
+ *
+ * returns
+ *   ccr handle, or NULL on error
+ *
+ */
+struct ccr *ccr_open_thread(struct ccr *parent) {
+  struct ccr *ccr = NULL;
+  int rc = -1;
+
+  if (parent->mp == NULL) {
+    fprintf(stderr,"ccr_open_thread: parent lacks CCR_SHARED\n");
+    goto done;
+  }
+
+  ccr = calloc(1, sizeof(*ccr));
+  if (ccr == NULL) {
+    fprintf(stderr,"ccr_open_thread: out of memory\n");
+    goto done;
+  }
+
+  ccr->cc = cc_dup(parent->cc);
+  if (ccr->cc == NULL) goto done;
+
+  utstring_new(ccr->tmp);
+  utstring_new(ccr->batch);
+  ccr->batch_iov = utvector_new(&iov_mm);
+  ccr->flags = parent->flags;
+  ccr->shr = parent->shr;
+  ccr->mp = parent->mp;
+  ccr->stat = parent->stat;
+
+  pthread_mutex_lock(&ccr->mp->lock);
+  ccr->mp->refcnt++;
+  pthread_mutex_unlock(&ccr->mp->lock);
+
+  rc = 0;
+
+ done:
+  if ((rc < 0) && ccr) {
+    if (ccr->cc) cc_close(ccr->cc);
+    free(ccr);
+    ccr = NULL;
+  }
   return ccr;
 }
 
+/*
+ * write the batch of a CCR_SHARED handle to the ring.
+ * the shared lock is taken once for the whole batch.
+ *
+ * returns
+ *  >= 0 bytes written
+ *   < 0 error
+ */
+static ssize_t flush_batch(struct ccr *ccr) {
+  size_t n, i, max = 0;
+  struct iovec *iov;
+  ssize_t wc = 0;
+
+  n = utvector_len(ccr->batch_iov);
+  if (n == 0) goto done;
+
+  /* offsets become pointers now that the batch has stopped growing */
+  iov = (struct iovec*)utvector_head(ccr->batch_iov);
+  for(i=0; i < n; i++) {
+    iov[i].iov_base = utstring_body(ccr->batch) + (size_t)iov[i].iov_base;
+    if (iov[i].iov_len > max) max = iov[i].iov_len;
+  }
+
+  pthread_mutex_lock(&ccr->mp->lock);
+  wc = shr_writev(ccr->shr, iov, n);
+  pthread_mutex_unlock(&ccr->mp->lock);
+
+  if (wc < 0) fprintf(stderr, "shr_writev: error %zd\n", wc);
+
+  /* ring full in CCR_NONBLOCK mode; keep the batch for next time */
+  if (wc == 0) {
+    for(i=0; i < n; i++) {
+      iov[i].iov_base = (char*)((char*)iov[i].iov_base - utstring_body(ccr->batch));
+    }
+    goto done;
+  }
+
+  if (wc > 0) stat_update(ccr->stat, n, utstring_len(ccr->batch), max);
+  utstring_clear(ccr->batch);
+  utvector_clear(ccr->batch_iov);
+
+ done:
+  return wc;
+}
+
+/*
+ * close the handle. a CCR_SHARED handle writes its batch first.
+ * in CCR_NONBLOCK mode the ring may be too full to take it; then,
+ * or if the write fails, the batch is lost and this returns -1
+ */
 int ccr_close(struct ccr *ccr) {
+  int rc = 0, last = 1;
+  size_t n;
+
+  if (ccr->mp) {
+    n = utvector_len(ccr->batch_iov);
+    if (n && (flush_batch(ccr) <= 0)) {
+      fprintf(stderr, "ccr_close: %zu buffered frames not written\n", n);
+      rc = -1;
+    }
+    pthread_mutex_lock(&ccr->mp->lock);
+    last = (--ccr->mp->refcnt == 0) ? 1 : 0;
+    pthread_mutex_unlock(&ccr->mp->lock);
+    if (last) {
+      pthread_mutex_destroy(&ccr->mp->lock);
+      free(ccr->mp);
+    }
+    if (!last) ccr->stat = NULL; /* still mapped for the others */
+    utstring_free(ccr->batch);
+    utvector_free(ccr->batch_iov);
+  }
+
   cc_close(ccr->cc);
-  shr_close(ccr->shr);
+  if (last) shr_close(ccr->shr);
+  if (ccr->stat) munmap(ccr->stat, STAT_LEN);
   utstring_free(ccr->tmp);
   free(ccr);
-  return 0;
+  return rc;
 }
 
 int ccr_mapv(struct ccr *ccr, struct cc_map *map, int count) {
@@ -242,8 +710,23 @@ int ccr_capture(struct ccr *ccr) {
   sc = cc_capture(ccr->cc, &out, &len);
   if (sc < 0) goto done;
 
+  if (ccr->mp) {
+    struct iovec io = { .iov_base = (char*)utstring_len(ccr->batch), /* offset! */
+                        .iov_len  = len };
+    utstring_bincpy(ccr->batch, out, len);
+    utvector_push(ccr->batch_iov, &io);
+    if ((utstring_len(ccr->batch) >= MP_BATCH_BYTES) ||
+        (utvector_len(ccr->batch_iov) >= MP_BATCH_FRAMES)) {
+      wc = flush_batch(ccr);
+      if (wc < 0) goto done;
+    }
+    rc = 0;
+    goto done;
+  }
+
   wc = shr_write(ccr->shr, out, len);
   if (wc < 0) goto done;
+  if (wc > 0) stat_update(ccr->stat, 1, len, len);
 
   rc = 0;
 
@@ -251,11 +734,84 @@ int ccr_capture(struct ccr *ccr) {
   return rc;
 }
 
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static long elapsed_ns(struct timespec *t0) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec - t0->tv_sec) * 1000000000L + (t.tv_nsec - t0->tv_nsec);
+}
+
+/*
+ * ring_read
+ *
+ * shr_read (iov NULL) or shr_readv, polling the ring first in CCR_SPIN
+ * mode. the backoff goes from cpu pause, to sched_yield, to blocking on
+ * the ring descriptor; each wakeup restarts the spin budget.
+ *
+ * returns as shr_read/shr_readv
+ */
+static ssize_t ring_read(struct ccr *ccr, char *buf, size_t len,
+                         struct iovec *iov, size_t *niov) {
+  struct timespec t0;
+  struct pollfd pfd;
+  size_t want = 0;
+  ssize_t nr;
+  long ns;
+  int i;
+
+  if ((ccr->flags & CCR_SPIN) == 0)
+    return iov ? shr_readv(ccr->shr, buf, len, iov, niov) :
+                 shr_read(ccr->shr, buf, len);
+
+  if (iov) want = *niov;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  for(;;) {
+    if (iov) *niov = want;
+    nr = iov ? shr_readv(ccr->shr, buf, len, iov, niov) :
+               shr_read(ccr->shr, buf, len);
+    if (nr != 0) break;
+
+    ns = elapsed_ns(&t0);
+    if (ns < ccr->spin_ns / 2) {
+      for(i=0; i < 64; i++) cpu_relax();
+      continue;
+    }
+    if (ns < ccr->spin_ns) {
+      sched_yield();
+      continue;
+    }
+
+    /* budget exhausted */
+    if (ccr->flags & CCR_NONBLOCK) break;
+
+    pfd.fd = shr_get_selectable_fd(ccr->shr);
+    pfd.events = POLLIN;
+    if (pfd.fd < 0) { nr = -1; break; }
+    if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      nr = -1;
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+  }
+
+  return nr;
+}
+
 /*
  * ccr_readv
  *
  * Read several frames from the ring in bulk.
  * Block if ring empty, or return immediately in CCR_NONBLOCK mode.
+ * In CCR_SPIN mode an empty ring is polled for the spin budget first.
  *
  * flags                    varags                   description
  * -----                    -----------------------  ---------------------
@@ -278,7 +834,7 @@ ssize_t ccr_readv(struct ccr *ccr, int flags,
                   struct iovec *iov, size_t *niov) {
   ssize_t nr;
 
-  nr = shr_readv(ccr->shr, buf, len, iov, niov);
+  nr = ring_read(ccr, buf, len, iov, niov);
   return nr;
 }
 
@@ -287,6 +843,7 @@ ssize_t ccr_readv(struct ccr *ccr, int flags,
  *
  * Read one frame from the ring.
  * Block if ring empty, or return immediately in CCR_NONBLOCK mode.
+ * In CCR_SPIN mode an empty ring is polled for the spin budget first.
  *
  * flags                    varags                   description
  * -----                    -----------------------  ---------------------
@@ -331,7 +888,7 @@ ssize_t ccr_getnext(struct ccr *ccr, int flags, ...) {
   assert(ccr->tmp->n > sizeof(uint32_t));
   buf = ccr->tmp->d + sizeof(uint32_t);
   avail = ccr->tmp->n - sizeof(uint32_t);
-  nr = shr_read(ccr->shr, buf, avail);
+  nr = ring_read(ccr, buf, avail, NULL, NULL);
 
   /* double if need more room in recv buffer */
   if (nr == -2) {
@@ -394,7 +951,7 @@ int ccr_get_selectable_fd(struct ccr *ccr) {
   int rc = -1, fd;
 
   if ((ccr->flags & CCR_RDONLY) == 0) goto done;
-  if ((ccr->flags & CCR_NONBLOCK) == 0) goto done;
+  if ((ccr->flags & (CCR_NONBLOCK|CCR_SPIN)) == 0) goto done;
   fd = shr_get_selectable_fd(ccr->shr);
   if (fd < 0) goto done;
 
@@ -407,7 +964,8 @@ int ccr_get_selectable_fd(struct ccr *ccr) {
 /*
  * ccr_flush
  *
- * flush buffered data (in CCR_WRONLY|CCR_BUFFER mode)
+ * flush buffered data (in CCR_WRONLY|CCR_BUFFER mode), or
+ * the pending batch of a CCR_SHARED or per-thread handle
  *
  * NOTE
  *  for a ccr ring in CCR_NONBLOCK mode, this may return 0
@@ -424,6 +982,15 @@ int ccr_get_selectable_fd(struct ccr *ccr) {
 ssize_t ccr_flush(struct ccr *ccr, int wait) {
   ssize_t nr;
 
+  if (ccr->mp) {
+    nr = flush_batch(ccr);
+    if ((nr < 0) || ((ccr->flags & CCR_BUFFER) == 0)) return nr;
+    pthread_mutex_lock(&ccr->mp->lock);
+    nr = shr_flush(ccr->shr, wait);
+    pthread_mutex_unlock(&ccr->mp->lock);
+    return nr;
+  }
+
   nr = shr_flush(ccr->shr, wait);
   return nr;
 }
@@ -461,3 +1028,85 @@ int ccr_dissect(struct ccr *ccr, struct cc_map **map, int *count,
 struct cc *ccr_get_cc(struct ccr *ccr) {
   return ccr->cc;
 }
+
+/*
+ * ccr_stat
+ *
+ * get the frame statistics that writers keep for the ring
+ *
+ *   frames     frames written since the ring was created
+ *   bytes      bytes written in those frames
+ *   max_frame  largest frame written
+ *   first_ns   CLOCK_REALTIME of the first write, in nanoseconds
+ *   last_ns    CLOCK_REALTIME of the latest write
+ *
+ * returns
+ *   0 success
+ *  -1 no statistics (the ring has no statistics file)
+ *
+ */
+int ccr_stat(struct ccr *ccr, struct ccr_stat *stat) {
+  struct ring_stat *rs = ccr->stat;
+
+  memset(stat, 0, sizeof(*stat));
+  if (rs == NULL) return -1;
+
+  stat->frames    = __atomic_load_n(&rs->s.frames,    __ATOMIC_RELAXED);
+  stat->bytes     = __atomic_load_n(&rs->s.bytes,     __ATOMIC_RELAXED);
+  stat->max_frame = __atomic_load_n(&rs->s.max_frame, __ATOMIC_RELAXED);
+  stat->first_ns  = __atomic_load_n(&rs->s.first_ns,  __ATOMIC_RELAXED);
+  stat->last_ns   = __atomic_load_n(&rs->s.last_ns,   __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * ccr_stat_note
+ *
+ * account in the ring's statistics for frames written to it
+ * other than by ccr_capture, e.g. by shr_writev on the ring:
+ * frames of total length bytes, the largest max bytes. needs
+ * a CCR_WRONLY handle, which maps the statistics for writing
+ *
+ * returns
+ *   0 success
+ *  -1 no statistics (not a writer, or no statistics file)
+ *
+ */
+int ccr_stat_note(struct ccr *ccr, size_t frames, size_t bytes,
+                  size_t max) {
+  if ((ccr->flags & CCR_WRONLY) == 0) return -1;
+  if (ccr->stat == NULL) return -1;
+  stat_update(ccr->stat, frames, bytes, max);
+  return 0;
+}
+
+/*
+ * ccr_readv_hint
+ *
+ * recommend a buffer length and iovec count for ccr_readv,
+ * to take in about batch_ms milliseconds of frames per call
+ * at the average frame rate and size seen by the ring so far.
+ * the buffer is never smaller than the largest frame.
+ *
+ * returns
+ *   0 success
+ *  -1 no statistics yet (caller should use its own defaults)
+ *
+ */
+int ccr_readv_hint(struct ccr *ccr, unsigned batch_ms,
+                   size_t *len, size_t *niov) {
+  struct ccr_stat st;
+  double secs, n;
+
+  if (ccr_stat(ccr, &st) < 0) return -1;
+  if (st.frames == 0) return -1;
+
+  secs = (st.last_ns - st.first_ns) / 1e9;
+  n = (secs > 0) ? (st.frames / secs) * batch_ms / 1000.0 : st.frames;
+  if (n < 1) n = 1;
+
+  *niov = (size_t)n;
+  *len = *niov * ((st.bytes + st.frames - 1) / st.frames);
+  if (*len < st.max_frame) *len = st.max_frame;
+  return 0;
+}
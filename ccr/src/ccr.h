@@ -21,13 +21,31 @@
 #define CCR_NEWLINE   (1U << 15)
 #define CCR_LEN4FIRST (1U << 16)
 #define CCR_RESTORE   (1U << 17)
+#define CCR_SHARED    (1U << 18)
+#define CCR_SPIN      (1U << 19)
+#define CCR_HUGEPAGE  (1U << 20)
+#define CCR_PREFAULT  (1U << 21)
 
 struct ccr; /* defined internally */
 
+/* frame statistics kept by writers; see ccr_stat */
+struct ccr_stat {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t max_frame;
+  uint64_t first_ns;
+  uint64_t last_ns;
+};
+
 int ccr_init(char *ring, size_t sz, int flags, ...);
-int ccr_stat(struct ccr *ccr);
+int ccr_stat(struct ccr *ccr, struct ccr_stat *stat);
+int ccr_stat_note(struct ccr *ccr, size_t frames, size_t bytes,
+                  size_t max);
+int ccr_readv_hint(struct ccr *ccr, unsigned batch_ms,
+                   size_t *len, size_t *niov);
 
 struct ccr *ccr_open(char *ring, int flags, ...);
+struct ccr *ccr_open_thread(struct ccr *parent);
 int ccr_mapv(struct ccr *ccr, struct cc_map *map, int count);
 ssize_t ccr_getnext(struct ccr *ccr, int flags, ...);
 int ccr_capture(struct ccr *ccr);
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <pthread.h>
+#include "ccr.h"
+
+char *ccfile = __FILE__ "fg";   /* test1.c becomes test1.cfg */
+char *ring = __FILE__ ".ring";  /* test1.c becomes test1.c.ring */
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+#define NTHREAD 4
+#define NFRAME 1000
+
+struct ccr *parent;
+
+static void *writer(void *arg) {
+  int32_t base = *(int32_t*)arg, i;
+  char *s = "thread", *h = "frame";
+  struct cc_map map[] = {
+    {"name", CC_str, &s},
+    {"handle", CC_str, &h},
+    {"id", CC_i32, &i},
+  };
+  struct ccr *ccr;
+
+  ccr = ccr_open_thread(parent);
+  if (ccr == NULL) return NULL;
+  if (ccr_mapv(ccr, map, adim(map)) < 0) goto done;
+
+  for(i = base; i < base + NFRAME; i++) {
+    if (ccr_capture(ccr) < 0) printf("error\n");
+  }
+
+ done:
+  /* flushes the last batch; fails if it could not be written */
+  if (ccr_close(ccr) < 0) printf("close error\n");
+  return NULL;
+}
+
+int main() {
+  int rc=-1, n;
+  int32_t i, base[NTHREAD];
+  pthread_t th[NTHREAD];
+  long sum = 0, count = 0;
+  char *s,*h;
+  struct cc_map map[] = {
+    {"name", CC_str, &s},
+    {"handle", CC_str, &h},
+    {"id", CC_i32, &i},
+  };
+
+  struct ccr *ccr;
+  if (ccr_init(ring, 1024*1024, CCR_OVERWRITE|CCR_CASTFILE, ccfile) < 0) goto done;
+  parent = ccr_open(ring, CCR_WRONLY|CCR_SHARED);
+  if (parent == NULL) goto done;
+
+  for(n = 0; n < NTHREAD; n++) {
+    base[n] = n * NFRAME;
+    pthread_create(&th[n], NULL, writer, &base[n]);
+  }
+  for(n = 0; n < NTHREAD; n++) pthread_join(th[n], NULL);
+
+  printf("closing\n");
+  ccr_close(parent);
+
+  /************************************************************************
+   * read the data back out
+   ***********************************************************************/
+
+  ccr = ccr_open(ring, CCR_RDONLY|CCR_NONBLOCK);
+  if (ccr == NULL) goto done;
+  rc = ccr_mapv(ccr, map, adim(map));
+  if (rc < 0) goto done;
+
+  while (ccr_getnext(ccr, CCR_RESTORE) > 0) {
+    sum += i;
+    count++;
+  }
+
+  printf("read %ld frames, id sum %ld\n", count, sum);
+  printf("closing\n");
+  ccr_close(ccr);
+
+ done:
+  return rc;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ccr.h"
+
+char *ccfile = __FILE__ "fg";   /* test1.c becomes test1.cfg */
+char *ring = __FILE__ ".ring";  /* test1.c becomes test1.c.ring */
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+/* write one frame, once the reader has had time to block */
+static void *writer(void *arg) {
+  char *s = "late", *h = "frame";
+  int32_t i = 7;
+  struct cc_map map[] = {
+    {"name", CC_str, &s},
+    {"handle", CC_str, &h},
+    {"id", CC_i32, &i},
+  };
+  struct ccr *ccr;
+
+  (void)arg;
+  usleep(100000);
+  ccr = ccr_open(ring, CCR_WRONLY);
+  if (ccr == NULL) return NULL;
+  if (ccr_mapv(ccr, map, adim(map)) < 0) goto done;
+  if (ccr_capture(ccr) < 0) printf("error\n");
+
+ done:
+  ccr_close(ccr);
+  return NULL;
+}
+
+int main() {
+  int rc=-1;
+  int32_t i;
+  char *s,*h;
+  ssize_t nr;
+  pthread_t th;
+  struct cc_map map[] = {
+    {"name", CC_str, &s},
+    {"handle", CC_str, &h},
+    {"id", CC_i32, &i},
+  };
+
+  struct ccr *ccr;
+  if (ccr_init(ring, 1024, CCR_DROP|CCR_OVERWRITE|CCR_CASTFILE, ccfile) < 0) goto done;
+  ccr = ccr_open(ring, CCR_WRONLY);
+  if (ccr == NULL) goto done;
+  rc = ccr_mapv(ccr, map, adim(map));
+  if (rc < 0) goto done;
+
+  s = "hello";
+  h = "world",
+  i = 42;
+  if (ccr_capture(ccr) < 0) printf("error\n");
+
+  s = "liquid";
+  h = "wave",
+  i = 99;
+  if (ccr_capture(ccr) < 0) printf("error\n");
+
+  printf("closing\n");
+  ccr_close(ccr);
+
+  /************************************************************************
+   * read the data back out, spinning 1000us on empty ring
+   ***********************************************************************/
+
+  ccr = ccr_open(ring, CCR_RDONLY|CCR_NONBLOCK|CCR_SPIN, 1000);
+  if (ccr == NULL) goto done;
+  rc = ccr_mapv(ccr, map, adim(map));
+  if (rc < 0) goto done;
+
+  while ((nr = ccr_getnext(ccr, CCR_RESTORE)) > 0) {
+    printf("%s %s %d\n", s, h, i);
+  }
+  printf("ccr_getnext: %zd\n", nr);
+
+  printf("closing\n");
+  ccr_close(ccr);
+
+  /************************************************************************
+   * blocking spin: past the 1000us budget, wait on the ring descriptor
+   * until a writer thread fills it
+   ***********************************************************************/
+
+  ccr = ccr_open(ring, CCR_RDONLY|CCR_SPIN, 1000);
+  if (ccr == NULL) goto done;
+  rc = ccr_mapv(ccr, map, adim(map));
+  if (rc < 0) goto done;
+
+  pthread_create(&th, NULL, writer, NULL);
+  nr = ccr_getnext(ccr, CCR_RESTORE);
+  if (nr > 0) printf("%s %s %d\n", s, h, i);
+  else printf("ccr_getnext: %zd\n", nr);
+  pthread_join(th, NULL);
+
+  printf("closing\n");
+  ccr_close(ccr);
+
+ done:
+  return rc;
+}
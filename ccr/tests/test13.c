@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include "ccr.h"
+
+char *ccfile = __FILE__ "fg";   /* test1.c becomes test1.cfg */
+char *ring = __FILE__ ".ring";  /* test1.c becomes test1.c.ring */
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+
+int main() {
+  int rc=-1;
+  int32_t i;
+  char *s,*h;
+  size_t len, niov;
+  struct ccr_stat st;
+  struct cc_map map[] = {
+    {"name", CC_str, &s},
+    {"handle", CC_str, &h},
+    {"id", CC_i32, &i},
+  };
+
+  struct ccr *ccr;
+  if (ccr_init(ring, 1024, CCR_DROP|CCR_OVERWRITE|CCR_CASTFILE, ccfile) < 0) goto done;
+  ccr = ccr_open(ring, CCR_WRONLY);
+  if (ccr == NULL) goto done;
+  rc = ccr_mapv(ccr, map, adim(map));
+  if (rc < 0) goto done;
+
+  s = "hello";
+  h = "world",
+  i = 42;
+  if (ccr_capture(ccr) < 0) printf("error\n");
+
+  s = "liquid";
+  h = "wave",
+  i = 99;
+  if (ccr_capture(ccr) < 0) printf("error\n");
+
+  printf("closing\n");
+  ccr_close(ccr);
+
+  /************************************************************************
+   * read the statistics the writer kept
+   ***********************************************************************/
+
+  ccr = ccr_open(ring, CCR_RDONLY);
+  if (ccr == NULL) goto done;
+
+  if (ccr_stat(ccr, &st) < 0) goto done;
+  printf("frames %lu bytes %lu max %lu\n", (unsigned long)st.frames,
+    (unsigned long)st.bytes, (unsigned long)st.max_frame);
+
+  if (ccr_readv_hint(ccr, 100, &len, &niov) < 0) goto done;
+  printf("hint fits largest frame: %s\n", (len >= st.max_frame) ? "yes" : "no");
+  printf("hint has iov: %s\n", (niov >= 1) ? "yes" : "no");
+
+  /* only a writer can note frames */
+  printf("reader note: %d\n", ccr_stat_note(ccr, 1, 1, 1));
+
+  printf("closing\n");
+  ccr_close(ccr);
+
+  /************************************************************************
+   * note frames written other than by ccr_capture
+   ***********************************************************************/
+
+  ccr = ccr_open(ring, CCR_WRONLY);
+  if (ccr == NULL) goto done;
+  printf("writer note: %d\n", ccr_stat_note(ccr, 3, 300, 150));
+  ccr_close(ccr);
+
+  ccr = ccr_open(ring, CCR_RDONLY);
+  if (ccr == NULL) goto done;
+  if (ccr_stat(ccr, &st) < 0) goto done;
+  printf("frames %lu bytes %lu max %lu\n", (unsigned long)st.frames,
+    (unsigned long)st.bytes, (unsigned long)st.max_frame);
+
+  printf("closing\n");
+  ccr_close(ccr);
+
+ done:
+  return rc;
+}
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "bufpool.h"
+
+#define MIN_LEN (64 * 1024)
+#define MIN_NIOV 64
+
+static size_t pbuf_bytes(struct bufpool *bp, struct pbuf *b) {
+  size_t n = b->len + b->niov * sizeof(struct iovec);
+  if (b->aux) n += b->niov * bp->aux_per + bp->aux_fixed;
+  return n;
+}
+
+static void pbuf_free(struct bufpool *bp, struct pbuf *b) {
+  bp->bytes -= pbuf_bytes(bp, b);
+  if (b->buf) free(b->buf);
+  if (b->iov) free(b->iov);
+  if (b->aux) free(b->aux);
+  free(b);
+}
+
+static struct pbuf *pbuf_new(struct bufpool *bp) {
+  struct pbuf *b;
+  size_t aux;
+
+  b = calloc(1, sizeof(*b));
+  if (b == NULL) goto fail;
+  b->len = bp->len;
+  b->niov = bp->niov;
+  b->buf = malloc(b->len);
+  b->iov = malloc(b->niov * sizeof(struct iovec));
+  if ((b->buf == NULL) || (b->iov == NULL)) goto fail;
+  aux = b->niov * bp->aux_per + bp->aux_fixed;
+  if (aux) {
+    b->aux = malloc(aux);
+    if (b->aux == NULL) goto fail;
+  }
+
+  bp->bytes += pbuf_bytes(bp, b);
+  if (bp->bytes > bp->hwm_bytes) bp->hwm_bytes = bp->bytes;
+  return b;
+
+ fail:
+  fprintf(stderr, "out of memory\n");
+  if (b) {
+    if (b->buf) free(b->buf);
+    if (b->iov) free(b->iov);
+    free(b);
+  }
+  return NULL;
+}
+
+/*
+ * bufpool_init
+ *
+ * buffers start small and grow with the reads, up to max_len
+ * bytes and max_niov frames
+ *
+ */
+void bufpool_init(struct bufpool *bp, size_t max_len, size_t max_niov,
+                  size_t aux_per, size_t aux_fixed) {
+  memset(bp, 0, sizeof(*bp));
+  bp->max_len = max_len;
+  bp->max_niov = max_niov;
+  bp->min_len = (MIN_LEN < max_len) ? MIN_LEN : max_len;
+  bp->min_niov = (MIN_NIOV < max_niov) ? MIN_NIOV : max_niov;
+  bp->len = bp->min_len;
+  bp->niov = bp->min_niov;
+  bp->aux_per = aux_per;
+  bp->aux_fixed = aux_fixed;
+}
+
+/*
+ * bufpool_get
+ *
+ * take a buffer of the current size from the free list, or
+ * allocate one. a free buffer of an earlier size is dropped.
+ * returns NULL if out of memory
+ *
+ */
+struct pbuf *bufpool_get(struct bufpool *bp) {
+  struct pbuf *b;
+
+  while ((b = bp->free) != NULL) {
+    bp->free = b->next;
+    bp->nfree--;
+    if ((b->len == bp->len) && (b->niov == bp->niov)) break;
+    pbuf_free(bp, b);
+  }
+
+  if ((b == NULL) && ((b = pbuf_new(bp)) == NULL)) return NULL;
+
+  b->next = NULL;
+  bp->out++;
+  if (bp->out > bp->peak_out) bp->peak_out = bp->out;
+  if (bp->out > bp->hwm_out) bp->hwm_out = bp->out;
+  return b;
+}
+
+/* return a buffer; one of an earlier size is freed */
+void bufpool_put(struct bufpool *bp, struct pbuf *b) {
+  assert(bp->out > 0);
+  bp->out--;
+
+  if ((b->len != bp->len) || (b->niov != bp->niov)) {
+    pbuf_free(bp, b);
+    return;
+  }
+
+  b->next = bp->free;
+  bp->free = b;
+  bp->nfree++;
+}
+
+/*
+ * bufpool_read
+ *
+ * note a read of len bytes and niov frames into b. a read that
+ * filled b in either respect doubles that size for later buffers
+ *
+ */
+void bufpool_read(struct bufpool *bp, struct pbuf *b, size_t len, size_t niov) {
+
+  if (len > bp->read_len) bp->read_len = len;
+  if (niov > bp->read_niov) bp->read_niov = niov;
+  if (len > bp->hwm_len) bp->hwm_len = len;
+  if (niov > bp->hwm_niov) bp->hwm_niov = niov;
+
+  if ((b->len >= bp->len) && (len > b->len - b->len / 8)) {
+    bp->len = b->len * 2;
+    if (bp->len > bp->max_len) bp->len = bp->max_len;
+  }
+
+  if ((b->niov >= bp->niov) && (niov == b->niov)) {
+    bp->niov = b->niov * 2;
+    if (bp->niov > bp->max_niov) bp->niov = bp->max_niov;
+  }
+}
+
+/*
+ * bufpool_grow
+ *
+ * ccr_readv found a frame larger than the empty buffer b.
+ * double b in place and the size of later buffers with it.
+ * returns -1 if b is already the largest allowed
+ *
+ */
+int bufpool_grow(struct bufpool *bp, struct pbuf *b) {
+  size_t len;
+  char *tmp;
+
+  if (b->len >= bp->max_len) {
+    fprintf(stderr, "frame exceeds %zu byte buffer\n", bp->max_len);
+    return -1;
+  }
+
+  len = b->len * 2;
+  if (len > bp->max_len) len = bp->max_len;
+  tmp = realloc(b->buf, len);
+  if (tmp == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+
+  b->buf = tmp;
+  bp->bytes += len - b->len;
+  if (bp->bytes > bp->hwm_bytes) bp->hwm_bytes = bp->bytes;
+  b->len = len;
+  if (len > bp->len) bp->len = len;
+  return 0;
+}
+
+/*
+ * bufpool_period
+ *
+ * called periodically. halve a size that no read of the period
+ * used a quarter of, and free the buffers the period did not need
+ *
+ */
+void bufpool_period(struct bufpool *bp) {
+  struct pbuf *b, **bb;
+  size_t keep;
+
+  if ((bp->read_len < bp->len / 4) && (bp->len / 2 >= bp->min_len))
+    bp->len /= 2;
+  if ((bp->read_niov < bp->niov / 4) && (bp->niov / 2 >= bp->min_niov))
+    bp->niov /= 2;
+
+  keep = bp->peak_out - bp->out;
+  bb = &bp->free;
+  while ((b = *bb) != NULL) {
+    if (keep && (b->len == bp->len) && (b->niov == bp->niov)) {
+      keep--;
+      bb = &b->next;
+      continue;
+    }
+    *bb = b->next;
+    bp->nfree--;
+    pbuf_free(bp, b);
+  }
+
+  bp->peak_out = bp->out;
+  bp->read_len = 0;
+  bp->read_niov = 0;
+}
+
+/* print the high-water marks, if they rose since last time */
+void bufpool_report(struct bufpool *bp, char *name, int always) {
+  if ((always == 0) && (bp->hwm_bytes == bp->reported_bytes)) return;
+  bp->reported_bytes = bp->hwm_bytes;
+
+  fprintf(stderr, "%s: buffer pool high-water %zu buffers, %zu bytes; "
+                  "largest read %zu frames, %zu bytes; "
+                  "now %zu buffers, %zu bytes\n", name,
+    bp->hwm_out, bp->hwm_bytes, bp->hwm_niov, bp->hwm_len,
+    bp->out + bp->nfree, bp->bytes);
+}
+
+/* free the pool; every buffer must have been returned */
+void bufpool_fini(struct bufpool *bp) {
+  struct pbuf *b;
+
+  while ((b = bp->free) != NULL) {
+    bp->free = b->next;
+    pbuf_free(bp, b);
+  }
+  bp->nfree = 0;
+}
@@ -0,0 +1,50 @@
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * a pool of ring read buffers, shared by the rings of a publisher.
+ * a buffer is a byte area and an iovec array for ccr_readv, plus
+ * optional caller scratch of aux_per bytes per iovec and aux_fixed
+ * bytes more. buffers are sized from the reads they take: the size
+ * doubles when a read fills a buffer, and halves after each period
+ * (bufpool_period) in which no read used a quarter of it. buffers
+ * left idle over a period are freed.
+ *
+ */
+struct pbuf {
+  char *buf;
+  size_t len;            /* of buf */
+  struct iovec *iov;
+  size_t niov;           /* of iov */
+  void *aux;             /* caller scratch */
+  struct pbuf *next;     /* free list */
+};
+
+struct bufpool {
+  size_t len, niov;      /* size of buffers now */
+  size_t min_len, max_len;
+  size_t min_niov, max_niov;
+  size_t aux_per, aux_fixed;
+  struct pbuf *free;
+  size_t nfree;
+  size_t out;            /* buffers in use */
+  size_t bytes;          /* allocated, in use or free */
+
+  /* this period */
+  size_t peak_out;
+  size_t read_len, read_niov; /* largest read */
+
+  /* high-water marks */
+  size_t hwm_out, hwm_bytes, hwm_len, hwm_niov;
+  size_t reported_bytes;
+};
+
+void bufpool_init(struct bufpool *bp, size_t max_len, size_t max_niov,
+                  size_t aux_per, size_t aux_fixed);
+struct pbuf *bufpool_get(struct bufpool *bp);
+void bufpool_put(struct bufpool *bp, struct pbuf *b);
+void bufpool_read(struct bufpool *bp, struct pbuf *b, size_t len, size_t niov);
+int bufpool_grow(struct bufpool *bp, struct pbuf *b);
+void bufpool_period(struct bufpool *bp);
+void bufpool_report(struct bufpool *bp, char *name, int always);
+void bufpool_fini(struct bufpool *bp);
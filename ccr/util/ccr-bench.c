@@ -0,0 +1,346 @@
+/*
+ * ccr benchmarks
+ *
+ * mp    multi-producer capture contention, 1-32 threads
+ * lat   reader latency percentiles, blocking vs CCR_SPIN
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include "ccr.h"
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+#define MAX_THREADS 32
+
+/* cast of the frames written by the benchmarks */
+char cast[] = "i32 id\n"
+              "i32 thread\n"
+              "d64 when\n"
+              "str payload\n";
+
+struct {
+  char *prog;
+  char *ring;
+  size_t size;
+  long frames;       /* per thread; 0 means the mode default */
+  int max_threads;
+  enum {mode_mp, mode_lat} mode;
+  struct ccr *parent;
+  long interval_us;  /* lat: writer pacing */
+  unsigned spin_us;  /* lat: CCR_SPIN budget */
+} cfg = {
+  .size = 1024L * 1024 * 1024,
+  .max_threads = MAX_THREADS,
+  .interval_us = 100,
+};
+
+void usage() {
+  fprintf(stderr,"usage: %s COMMAND [options] RING\n"
+                 "\n"
+                 "commands\n"
+                 "--------\n"
+                 " mp              multi-producer capture contention\n"
+                 " lat             read latency, blocking vs spin\n"
+                 "\n"
+                 "options\n"
+                 "-------\n"
+                 "  -s size        ring size with k|m|g suffix (default: 1g)\n"
+                 "  -n frames      frames per thread (default: mp 1000000, lat 100000)\n"
+                 "  -t threads     max threads (default: %d)\n"
+                 "  -i usec        lat: interval between frames (default: 100)\n"
+                 "  -S usec        lat: spin budget (default: library default)\n"
+                 "\n"
+                 "The ring is created (overwritten) by the benchmark.\n"
+                 "\n", cfg.prog, MAX_THREADS);
+  exit(-1);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the frame each thread captures; payload is a typical size */
+struct frame {
+  int32_t id;
+  int32_t thread;
+  double when;
+  char *payload;
+};
+
+static int map_frame(struct ccr *ccr, struct frame *f) {
+  struct cc_map map[] = {
+    {"id",      CC_i32, &f->id},
+    {"thread",  CC_i32, &f->thread},
+    {"when",    CC_d64, &f->when},
+    {"payload", CC_str, &f->payload},
+  };
+  return ccr_mapv(ccr, map, adim(map));
+}
+
+struct worker {
+  pthread_t th;
+  int n;
+  int shared;  /* 1: per-thread handle on cfg.parent. 0: own ccr_open */
+  int rc;
+};
+
+static void *mp_worker(void *arg) {
+  struct worker *w = (struct worker*)arg;
+  struct ccr *ccr;
+  struct frame f;
+  long i;
+
+  w->rc = -1;
+  ccr = w->shared ? ccr_open_thread(cfg.parent) :
+                    ccr_open(cfg.ring, CCR_WRONLY);
+  if (ccr == NULL) return NULL;
+  if (map_frame(ccr, &f) < 0) goto done;
+
+  f.thread = w->n;
+  f.payload = "0123456789abcdef0123456789abcdef0123456789abcdef";
+  for(i = 0; i < cfg.frames; i++) {
+    f.id = i;
+    f.when = i;
+    if (ccr_capture(ccr) < 0) goto done;
+  }
+  w->rc = 0;
+
+ done:
+  ccr_close(ccr);
+  return NULL;
+}
+
+/* run nthreads writers; returns aggregate frames/sec or < 0 on error */
+static double mp_run(int nthreads, int shared) {
+  struct worker w[MAX_THREADS];
+  double t0, t1;
+  int n;
+
+  memset(w, 0, sizeof(w));
+  t0 = now_sec();
+  for(n = 0; n < nthreads; n++) {
+    w[n].n = n;
+    w[n].shared = shared;
+    if (pthread_create(&w[n].th, NULL, mp_worker, &w[n])) return -1;
+  }
+  for(n = 0; n < nthreads; n++) pthread_join(w[n].th, NULL);
+  t1 = now_sec();
+
+  for(n = 0; n < nthreads; n++) if (w[n].rc < 0) return -1;
+  return (cfg.frames * nthreads) / (t1 - t0);
+}
+
+/*
+ * compare nthreads each with its own ccr_open (locking
+ * the ring per frame) to nthreads sharing one CCR_SHARED
+ * handle through per-thread batched handles
+ */
+int bench_mp(void) {
+  double own, shared;
+  int rc = -1, n;
+
+  printf("%8s %16s %16s\n", "threads", "own-handle f/s", "shared f/s");
+  for(n = 1; n <= cfg.max_threads; n *= 2) {
+
+    /* start each run from an empty ring */
+    if (ccr_init(cfg.ring, cfg.size, CCR_DROP|CCR_CASTTEXT,
+                 cast, sizeof(cast)-1) < 0) goto done;
+    own = mp_run(n, 0);
+    if (own < 0) goto done;
+
+    if (ccr_init(cfg.ring, cfg.size, CCR_DROP|CCR_CASTTEXT,
+                 cast, sizeof(cast)-1) < 0) goto done;
+    cfg.parent = ccr_open(cfg.ring, CCR_WRONLY|CCR_SHARED);
+    if (cfg.parent == NULL) goto done;
+    shared = mp_run(n, 1);
+    ccr_close(cfg.parent);
+    cfg.parent = NULL;
+    if (shared < 0) goto done;
+
+    printf("%8d %16.0f %16.0f\n", n, own, shared);
+  }
+
+  rc = 0;
+
+ done:
+  if (rc < 0) fprintf(stderr, "benchmark failed\n");
+  return rc;
+}
+
+/*
+ * lat: paced writer, stamping each frame with its capture time.
+ * the caller opens its handle, so that a reader never waits on a
+ * writer that could not open the ring
+ */
+static void *lat_writer(void *arg) {
+  struct ccr *ccr = arg;
+  struct timespec next;
+  struct frame f;
+  long i = 0;
+
+  if (map_frame(ccr, &f) < 0) goto done;
+
+  f.thread = 0;
+  f.payload = "0123456789abcdef0123456789abcdef0123456789abcdef";
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for(i = 0; i < cfg.frames; i++) {
+    next.tv_nsec += cfg.interval_us * 1000;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    f.id = i;
+    f.when = now_ns();
+    if (ccr_capture(ccr) < 0) goto done;
+  }
+
+ done:
+  if (i < cfg.frames) fprintf(stderr, "lat: writer failed\n");
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(double*)a, y = *(double*)b;
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/* read cfg.frames frames in the given open mode; print percentiles */
+static int lat_run(char *label, int open_mode) {
+  double *lat = NULL;
+  struct ccr *ccr = NULL, *wr = NULL;
+  struct frame f;
+  pthread_t th;
+  int rc = -1, started = 0;
+  long n = 0;
+  ssize_t nr;
+
+  lat = malloc(cfg.frames * sizeof(double));
+  if (lat == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
+
+  if (ccr_init(cfg.ring, cfg.size, CCR_DROP|CCR_CASTTEXT,
+               cast, sizeof(cast)-1) < 0) goto done;
+  ccr = ccr_open(cfg.ring, open_mode, cfg.spin_us);
+  if (ccr == NULL) goto done;
+  if (map_frame(ccr, &f) < 0) goto done;
+
+  wr = ccr_open(cfg.ring, CCR_WRONLY);
+  if (wr == NULL) goto done;
+
+  if (pthread_create(&th, NULL, lat_writer, wr)) goto done;
+  started = 1;
+
+  while (n < cfg.frames) {
+    nr = ccr_getnext(ccr, CCR_RESTORE);
+    if (nr < 0) goto done;
+    if (nr == 0) continue;
+    lat[n++] = now_ns() - f.when;
+  }
+
+  qsort(lat, n, sizeof(double), cmp_double);
+  printf("%8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+    lat[n * 50 / 100] / 1e3,
+    lat[n * 90 / 100] / 1e3,
+    lat[n * 99 / 100] / 1e3,
+    lat[n * 999 / 1000] / 1e3,
+    lat[n - 1] / 1e3);
+
+  rc = 0;
+
+ done:
+  if (started) pthread_join(th, NULL);
+  if (wr) ccr_close(wr);
+  if (ccr) ccr_close(ccr);
+  if (lat) free(lat);
+  return rc;
+}
+
+/*
+ * latency from capture to ccr_getnext return, in microseconds,
+ * for a blocking reader and a CCR_SPIN reader of a paced writer
+ */
+int bench_lat(void) {
+  int rc = -1;
+
+  printf("%8s %10s %10s %10s %10s %10s\n",
+    "mode", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  if (lat_run("block", CCR_RDONLY) < 0) goto done;
+  if (lat_run("spin", CCR_RDONLY|CCR_SPIN) < 0) goto done;
+
+  rc = 0;
+
+ done:
+  if (rc < 0) fprintf(stderr, "benchmark failed\n");
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  int opt, rc = -1, sc;
+  char unit, *cmd;
+
+  cfg.prog = argv[0];
+  if (argc < 3) usage();
+
+  cmd = argv[1];
+  if      (!strcmp(cmd, "mp"))  cfg.mode = mode_mp;
+  else if (!strcmp(cmd, "lat")) cfg.mode = mode_lat;
+  else usage();
+
+  argv++;
+  argc--;
+
+  while ( (opt = getopt(argc,argv,"s:n:t:i:S:")) > 0) {
+    switch(opt) {
+      default : usage(); break;
+      case 'n': cfg.frames = atol(optarg); break;
+      case 'i': cfg.interval_us = atol(optarg); break;
+      case 'S': cfg.spin_us = atoi(optarg); break;
+      case 't': cfg.max_threads = atoi(optarg);
+                if ((cfg.max_threads < 1) ||
+                    (cfg.max_threads > MAX_THREADS)) usage();
+                break;
+      case 's':  /* ring size */
+         sc = sscanf(optarg, "%ld%c", &cfg.size, &unit);
+         if (sc == 0) usage();
+         if (sc == 2) {
+            switch (unit) {
+              case 'g': case 'G': cfg.size *= 1024; /* fall through */
+              case 'm': case 'M': cfg.size *= 1024; /* fall through */
+              case 'k': case 'K': cfg.size *= 1024; break;
+              default: usage(); break;
+            }
+         }
+         break;
+    }
+  }
+
+  if (optind >= argc) usage();
+  cfg.ring = argv[optind++];
+
+  if (cfg.frames == 0) cfg.frames = (cfg.mode == mode_lat) ? 100000 : 1000000;
+
+  switch(cfg.mode) {
+    case mode_mp:  rc = bench_mp(); break;
+    case mode_lat: rc = bench_lat(); break;
+    default: usage(); break;
+  }
+
+  return (rc < 0) ? -1 : 0;
+}
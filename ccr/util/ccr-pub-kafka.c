@@ -3,23 +3,17 @@
  *
  */
 
-#define _GNU_SOURCE /* asprintf */
-#include <sys/signalfd.h>
-#include <sys/epoll.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
-#include <time.h>
 #include "ccr.h"
+#include "sink.h"
 
 #include <librdkafka/rdkafka.h>
 
-#define NUM_IOV 100000
-#define BUF_LEN (NUM_IOV * 1000)
 struct kafka {
   char *topic;
   rd_kafka_t *k;
@@ -28,26 +22,22 @@ struct kafka {
   rd_kafka_topic_conf_t *topic_conf;
 };
 
+/* a ring and its topic. the sink engine (see sink.h) reads the
+ * ring in batches, on one of -t threads, with -n batches in
+ * flight. the frames, or their json, are produced in place from
+ * the batch, which is held until the delivery report of its last
+ * message. the delivery reports of a ring run on its thread, as
+ * it alone polls the producer: the ring's own, or with -s, the
+ * one its thread's rings share */
 struct pub {
   char *ring_name;
-  int fd;
   char batch_end;      /* 1 means we sent the last record */
   char batch_end_ackd; /* 1 means kakfa ackd its delivery */
   unsigned sent;
   unsigned ackd;
   struct kafka k;
   struct ccr *ring;
-
-  /* read buffer, for ccr read */
-  struct iovec ccr_iov[NUM_IOV];
-  char ccr_buf[BUF_LEN];
-
-  /* push buffer, for kafka queues */
-  struct iovec out_iov[NUM_IOV];
-  size_t out_niov;
-  char *out_buf;
-  size_t buf_size;
-  size_t buf_used;
+  int kf;              /* index of the -k field; -1 until known */
 };
 
 struct {
@@ -55,19 +45,16 @@ struct {
   int batch_mode;
   char *prog;
   char *broker;
-  int signal_fd;
-  int epoll_fd;
-  int ticks;
-  int json;
-  int pretty;
   int num_pub;
   struct pub *pubv;
   int shutdown;
   int signal_ppid;
-} cfg = {
-  .signal_fd = -1,
-  .epoll_fd = -1,
-};
+  char *key_field;     /* message key from this field */
+  int partitions;      /* -N: hash the key to one of these */
+  int share;           /* -s: a producer per thread, not per ring */
+  struct kafka sharev[SINK_MAX_THREADS];
+  struct sink sink;
+} cfg;
 
 void usage() {
   fprintf(stderr,"usage: %s [options] <ring>[:topic] ...\n", cfg.prog);
@@ -78,14 +65,18 @@ void usage() {
   fprintf(stderr,"  -p                   pretty json\n");
   fprintf(stderr,"  -B                   batch mode\n");
   fprintf(stderr,"  -P                   signal parent on batch end\n");
+  fprintf(stderr,"  -n <reads>           ring reads in flight per ring (default: %d)\n", SINK_DEFAULT_BATCHES);
+  fprintf(stderr,"  -k <field>           message key from this field\n");
+  fprintf(stderr,"  -N <partitions>      hash the key to a partition in [0,N)\n");
+  fprintf(stderr,"                       (default: librdkafka partitioner)\n");
+  fprintf(stderr,"  -t <threads>         service the rings on this many threads (default: 1)\n");
+  fprintf(stderr,"  -a <cpu>[,<cpu>...]  pin the threads to these cpus, in turn\n");
+  fprintf(stderr,"  -s                   one producer per thread (default: per ring)\n");
   fprintf(stderr,"  -h                   this help\n");
   fprintf(stderr,"\n");
   exit(-1);
 }
 
-/* signals that we'll accept via signalfd in epoll */
-int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT,SIGALRM};
-
 void hexdump(char *buf, size_t len) {
   size_t i,n=0;
   unsigned char c;
@@ -106,74 +97,6 @@ void hexdump(char *buf, size_t len) {
   }
 }
 
-int drain_callbacks() {
-  struct pub *p;
-  int i, n=0;
-
-  for(i=0; i < cfg.num_pub; i++) {
-    p = &cfg.pubv[i];
-    do {
-       n = rd_kafka_poll(p->k.k, 0);
-    } while (n > 0);
-  }
-
-  return n;
-}
-
-
-int periodic_work() {
-  int rc  = -1, sc, complete=0;
-
-  sc = drain_callbacks();
-  if (sc < 0) goto done;
-
-  if (cfg.shutdown) {
-    fprintf(stderr, "inducing shutdown\n");
-    goto done;
-  }
-
-  if (complete && cfg.signal_ppid) {
-    fprintf(stderr, "batch end: signaling parent\n");
-    sc = kill(getppid(), SIGTERM);
-    if (sc < 0) {
-      fprintf(stderr, "error: %s\n", strerror(errno));
-      goto done;
-    }
-  }
-
-  rc = 0;
- 
- done:
-  return rc;
-}
-
-int new_epoll(int events, int fd) {
-  int rc;
-  struct epoll_event ev;
-  memset(&ev,0,sizeof(ev));
-  ev.events = events;
-  ev.data.fd= fd;
-  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
-  if (rc == -1) {
-    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
-  }
-  return rc;
-}
-
-int mod_epoll(int events, int fd) {
-  int rc;
-  struct epoll_event ev;
-  memset(&ev,0,sizeof(ev));
-  ev.events = events;
-  ev.data.fd= fd;
-  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_MOD, fd, &ev);
-  if (rc == -1) {
-    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
-  }
-  return rc;
-}
-
-
 void err_cb (rd_kafka_t *rk, int err, const char *reason, void *opaque) {
 
   fprintf(stderr,"librdkafka: error, %s %s: %s\n",
@@ -182,12 +105,18 @@ void err_cb (rd_kafka_t *rk, int err, const char *reason, void *opaque) {
   cfg.shutdown=1;
 }
 
-/* delivery report callback gets invoked for every message */
+/* delivery report callback gets invoked for every message.
+ * the topic's opaque is its pub, as a producer can be shared;
+ * each message carries its batch as the message opaque */
 void delivery_report_cb ( rd_kafka_t *rk, const rd_kafka_message_t *msg,
   void *opaque) {
-  struct pub *p = (struct pub*)opaque;
+  struct pub *p = (struct pub*)rd_kafka_topic_opaque(msg->rkt);
+  struct sink_batch *bt = (struct sink_batch*)msg->_private;
   int sc;
 
+  sc = sink_ack(bt, 1);
+  if (sc < 0) cfg.shutdown=1;
+
   if (msg->err != 0) {
     fprintf(stderr, "librdkafka: message delivery failure: %s\n",
       rd_kafka_err2str(msg->err));
@@ -197,24 +126,29 @@ void delivery_report_cb ( rd_kafka_t *rk, const rd_kafka_message_t *msg,
 
   /* successfully delivered message */
   p->ackd++;
-
-  /* restore ring epoll once vented */
-  if (p->ackd == p->sent) {
-    if (p->batch_end) p->batch_end_ackd=1;
-    sc = mod_epoll(EPOLLIN, p->fd);
-    if (sc < 0) cfg.shutdown=1;
-    //fprintf(stderr, "ring epoll reinstated\n");
-  }
+  if ((p->ackd == p->sent) && p->batch_end) p->batch_end_ackd=1;
 }
 
 
-int send_kafka(struct pub *p) {
-  int i, rc = -1, sc, msgflags=0;
+/*
+ * send_kafka
+ *
+ * produce the frames of a batch. librdkafka references them in
+ * place until delivered, so each message carries the batch, which
+ * the engine holds until its last delivery report
+ *
+ */
+int send_kafka(struct sink_batch *bt) {
+  struct pub *p = (struct pub*)bt->r->data;
+  int32_t part = RD_KAFKA_PARTITION_UA;
+  char *msg, *frame, *key = NULL;
+  size_t i, len, flen, klen = 0;
   const char *serr;
-  size_t len;
-  char *msg;
+  struct cc *cc;
+  int rc = -1, sc;
 
-  assert(p->out_niov > 0);
+  assert(bt->n > 0);
+  cc = ccr_get_cc( p->ring );
 
   /* publish one message at a time
    *
@@ -223,18 +157,31 @@ int send_kafka(struct pub *p) {
    * and retrying (c.f. examples/rdkafka_simple_producer.c)
    */
   i = 0;
-  while (i < p->out_niov) {
+  while (i < bt->n) {
 
     /* let it invoke callbacks */
     rd_kafka_poll(p->k.k, 0);
 
-    /* we're using iov_base as an offset here */
-    msg = (size_t)(p->out_iov[i].iov_base) + p->out_buf;
-    len = p->out_iov[i].iov_len;
+    /* the message, and the flat frame it came from */
+    msg = bt->iov[i].iov_base;
+    len = bt->iov[i].iov_len;
+    frame = bt->b->iov[i].iov_base;
+    flen = bt->b->iov[i].iov_len;
+
+    /* the key, and with -N its partition, from the flat frame */
+    if (cfg.key_field) {
+      sc = frame_key(cc, cfg.key_field, &p->kf, frame, flen, &key, &klen);
+      if (sc < 0) goto done;
+      if (cfg.partitions)
+        part = jump_hash(hash_bytes(key, klen), cfg.partitions);
+    }
+
+    /* sets p->batch_end as record indicates */
+    if (cfg.batch_mode) cc_restore(cc, frame, flen, 0);
+
     if (cfg.verbose) hexdump(msg, len);
 
-    sc = rd_kafka_produce(p->k.t, RD_KAFKA_PARTITION_UA,
-         msgflags, msg, len, NULL, 0, NULL);
+    sc = rd_kafka_produce(p->k.t, part, 0, msg, len, key, klen, bt);
     if (sc == 0) {
       p->sent++;
       i++;
@@ -264,12 +211,12 @@ int send_kafka(struct pub *p) {
   return rc;
 }
 
-int open_kafka(struct kafka *k, void *opaque) {
+/* the producer, which may be shared by several topics (-s) */
+int open_producer(struct kafka *k) {
   char err[512];
   int rc=-1, kr;
 
   k->conf = rd_kafka_conf_new();
-  rd_kafka_conf_set_opaque(k->conf, opaque);
   rd_kafka_conf_set_error_cb(k->conf, err_cb);
   rd_kafka_conf_set_dr_msg_cb(k->conf, delivery_report_cb);
 
@@ -289,8 +236,6 @@ int open_kafka(struct kafka *k, void *opaque) {
     goto done;
   }
 
-  k->topic_conf = rd_kafka_topic_conf_new();
-
   k->k = rd_kafka_new(RD_KAFKA_PRODUCER, k->conf, err, sizeof(err));
   if (k->k == NULL) {
     fprintf(stderr, "rd_kafka_new: %s\n", err);
@@ -302,6 +247,19 @@ int open_kafka(struct kafka *k, void *opaque) {
     goto done;
   }
 
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* the topic, on the producer k->k; its opaque is the pub */
+int open_topic(struct kafka *k, void *opaque) {
+  int rc=-1;
+
+  k->topic_conf = rd_kafka_topic_conf_new();
+  rd_kafka_topic_conf_set_opaque(k->topic_conf, opaque);
+
   k->t = rd_kafka_topic_new(k->k, k->topic, k->topic_conf);
   if (k->t == NULL) {
     fprintf(stderr, "error creating topic %s\n", k->topic);
@@ -314,180 +272,91 @@ int open_kafka(struct kafka *k, void *opaque) {
   return rc;
 }
 
-int handle_signal() {
-  struct signalfd_siginfo info;
-  int sc, rc=-1;
-  ssize_t nr;
-  char *s;
-  
-  nr = read(cfg.signal_fd, &info, sizeof(info));
-  if (nr != sizeof(info)) {
-    fprintf(stderr,"failed to read signal fd buffer\n");
-    goto done;
-  }
+/* connect the ring: its producer, or with -s its thread's,
+ * and its topic */
+int open_kafka(struct sink_ring *r) {
+  struct pub *p = (struct pub*)r->data;
+  struct kafka *share;
+  int rc = -1, sc;
 
-  switch(info.ssi_signo) {
-    case SIGALRM: 
-      sc = periodic_work();
-      if (sc < 0) goto done;
-      alarm(1); 
-      break;
-    default: 
-      s = strsignal(info.ssi_signo);
-      fprintf(stderr,"got signal %d (%s)\n", info.ssi_signo, s);
-      goto done;
-      break;
+  p->ring = r->ring;
+  struct cc_map map[] = {{"batch_end", CC_i8, &p->batch_end}};
+  sc = ccr_mapv(r->ring, map, 1);
+  if (sc < 0) goto done;
+
+  if (cfg.share) {
+    share = &cfg.sharev[r->w->n];
+    if ((share->k == NULL) && (open_producer(share) < 0)) goto done;
+    p->k.k = share->k;
   }
+  else if (open_producer( &p->k ) < 0) goto done;
+
+  sc = open_topic( &p->k, p );
+  if (sc < 0) goto done;
 
- rc = 0;
+  rc = 0;
 
  done:
   return rc;
 }
 
-/* test if fd belongs to an open ring.
- * if so, return 1 and store its ccr* into r */
-int is_ring(int fd, struct pub **p) {
-  int i;
+/* run the ring's callbacks: its delivery reports, and errors */
+int drain_callbacks(struct sink_ring *r) {
+  struct pub *p = (struct pub*)r->data;
 
-  for(i=0; i < cfg.num_pub; i++) {
-    if (cfg.pubv[i].fd != fd)
-      continue;
+  while (rd_kafka_poll(p->k.k, 0) > 0) ;
 
-    *p = &cfg.pubv[i];
-    return 1;
+  if (cfg.shutdown) {
+    fprintf(stderr, "inducing shutdown\n");
+    return -1;
   }
 
   return 0;
 }
 
-/* called when ring is readable */
-int handle_ring(struct pub *p) {
-  size_t niov, i, l, len;
-  int rc = -1, fl, sc;
-  char *b, *out;
-  struct ccr *r;
-  struct cc *cc;
-  ssize_t nr;
-  void *tmp;
-
-  r = p->ring;
-  niov = NUM_IOV;
-  nr = ccr_readv(r, 0, p->ccr_buf, BUF_LEN, p->ccr_iov, &niov);
-
-  if (nr <= 0) {
-    if (nr) fprintf(stderr, "ccr_readv: error %zd\n", nr);
-    else rc = 0;
-    goto done;
-  }
-
-  assert( nr > 0 );
-  assert( niov > 0 );
-
-  cc = ccr_get_cc( r );
-  fl = cfg.pretty ? CC_PRETTY : 0;
-
-  p->out_niov = 0;
-  p->buf_used = 0;
-  for (i=0; i < niov; i++) {
-
-    b = p->ccr_iov[i].iov_base;
-    l = p->ccr_iov[i].iov_len;
-
-    /* sets p->batch_end as record indicates */
-    if (cfg.batch_mode) cc_restore(cc, b, l, 0);
-
-    if (cfg.json) {
-      sc = cc_to_json(cc, &out, &len, b, l, fl);
-      if (sc < 0) {
-        fprintf(stderr, "json conversion failed\n");
-        goto done;
-      }
-    } else {
-      out = b;
-      len = l;
-    }
-
-    if (p->buf_size - p->buf_used < len) {
-      p->buf_size = p->buf_size ? (p->buf_size * 2) : (len * NUM_IOV);
-      tmp = realloc(p->out_buf, p->buf_size);
-      if (tmp == NULL) {
-        fprintf(stderr, "out of memory\n");
-        goto done;
-      }
-      p->out_buf = tmp;
-    }
-    memcpy(p->out_buf + p->buf_used, out, len);
-    p->out_iov[i].iov_base = (char*)p->buf_used; /* offset! */
-    p->out_iov[i].iov_len = len;
-    p->buf_used += len;
-    p->out_niov++;
-  }
-
-  /* suspend ring epoll while buffer vents */
-  sc = mod_epoll(0, p->fd);
-  if (sc < 0) goto done;
-  //fprintf(stderr, "ring epoll suspended\n");
-
-  /* queue entire output */
-  sc = send_kafka(p);
-  if (sc < 0) goto done;
-
-  rc = 0;
-
- done:
-  return rc;
-}
+struct sink_ops kafka_ops = {
+  .open = open_kafka,
+  .send_batch = send_kafka,
+  .on_ack = drain_callbacks,
+};
 
 int main(int argc, char *argv[]) {
-  char *ring, *topic, *colon;
-  struct epoll_event ev;
-  cfg.prog = argv[0];
-  int fd, i, sc, opt;
-  struct ccr *r;
+  char *ring, *colon;
+  int i, sc, opt;
   struct pub *p;
-  unsigned n;
 
-  while ( (opt=getopt(argc,argv,"b:BvhjpP")) != -1) {
+  cfg.prog = argv[0];
+  sink_init(&cfg.sink, &kafka_ops, NULL);
+
+  while ( (opt=getopt(argc,argv,"b:BvhjpPn:k:N:t:a:s")) != -1) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
       case 'b': cfg.broker = strdup(optarg); break;
       case 'B': cfg.batch_mode=1; break;
-      case 'j': cfg.json=1; break;
-      case 'p': cfg.json=1; cfg.pretty=1; break;
+      case 'j': cfg.sink.json=1; break;
+      case 'p': cfg.sink.json=1; cfg.sink.json_flags |= CC_PRETTY; break;
       case 'P': cfg.signal_ppid=1; break;
+      case 'k': cfg.key_field = strdup(optarg); break;
+      case 'N': cfg.partitions = atoi(optarg);
+                if (cfg.partitions < 1) usage();
+                break;
+      case 'n': cfg.sink.nbatch = atoi(optarg);
+                if ((cfg.sink.nbatch < 1) ||
+                    (cfg.sink.nbatch > SINK_MAX_BATCHES)) usage();
+                break;
+      case 't': cfg.sink.nthread = atoi(optarg);
+                if ((cfg.sink.nthread < 1) ||
+                    (cfg.sink.nthread > SINK_MAX_THREADS)) usage();
+                break;
+      case 'a': if (sink_cpus(&cfg.sink, optarg) < 0) usage(); break;
+      case 's': cfg.share=1; break;
       case 'h': default: usage(); break;
     }
   }
 
   if (cfg.broker == NULL) usage();
-
-  /* block all signals. we take signals synchronously via signalfd */
-  sigset_t all;
-  sigfillset(&all);
-  sigprocmask(SIG_SETMASK,&all,NULL);
-
-  /* a few signals we'll accept via our signalfd */
-  sigset_t sw;
-  sigemptyset(&sw);
-  for(n=0; n < sizeof(sigs)/sizeof(*sigs); n++) sigaddset(&sw, sigs[n]);
-
-  /* create the signalfd for receiving signals */
-  cfg.signal_fd = signalfd(-1, &sw, 0);
-  if (cfg.signal_fd == -1) {
-    fprintf(stderr,"signalfd: %s\n", strerror(errno));
-    goto done;
-  }
-
-  /* set up the epoll instance */
-  cfg.epoll_fd = epoll_create(1); 
-  if (cfg.epoll_fd == -1) {
-    fprintf(stderr,"epoll: %s\n", strerror(errno));
-    goto done;
-  }
-
-  /* add descriptors of interest */
-  if (new_epoll(EPOLLIN, cfg.signal_fd))   goto done;
+  if (cfg.partitions && (cfg.key_field == NULL)) usage();
+  cfg.sink.verbose = cfg.verbose;
 
   /* rings from command line */
   cfg.num_pub = argc - optind;
@@ -497,70 +366,30 @@ int main(int argc, char *argv[]) {
   if (cfg.pubv == NULL) goto done;
 
   for(i=0; optind < argc; i++, optind++) {
-
     p = &cfg.pubv[i];
     ring = strdup( argv[optind] );
+    if (ring == NULL) goto done;
     colon = strchr(ring, ':');
     if (colon) *colon = '\0';
-    topic = colon ? (colon+1) : ring;
-    p->k.topic = topic;
+    p->k.topic = colon ? (colon+1) : ring;
     p->ring_name = ring;
+    p->kf = -1;
 
-    r = ccr_open( ring, CCR_RDONLY|CCR_NONBLOCK);
-    if (r == NULL) goto done;
-    cfg.pubv[i].ring = r;
-
-    fd = ccr_get_selectable_fd( r );
-    if (fd < 0) goto done;
-    cfg.pubv[i].fd = fd;
-
-    sc = new_epoll(EPOLLIN, fd);
-    if (sc < 0) goto done;
-
-    struct cc_map map[] = {{"batch_end", CC_i8, &p->batch_end}};
-    sc = ccr_mapv(r, map, 1);
-    if (sc < 0) goto done;
-
-    sc = open_kafka( &p->k, p );
+    sc = sink_add(&cfg.sink, ring, p);
     if (sc < 0) goto done;
   }
 
-
-  alarm(1);
-  for (;;) {
-
-    sc = epoll_wait(cfg.epoll_fd, &ev, 1, -1);
-    if (sc < 0) {
-      fprintf(stderr,"epoll: %s\n", strerror(errno));
-      break;
-    }
-
-    if (ev.data.fd == cfg.signal_fd) {
-      sc = handle_signal();
-      if (sc < 0) goto done;
-    } 
-    else if (is_ring(ev.data.fd, &p)) {
-      sc = handle_ring(p);
-      if (sc < 0) goto done;
-    }
-    else {
-      fprintf(stderr, "unknown fd\n");
-      assert(0);
-    }
-
-  }
+  sink_run(&cfg.sink);
 
 done:
+  /* reads still in flight are left to librdkafka */
+  sink_fini(&cfg.sink);
   for(i=0; cfg.pubv && (i < cfg.num_pub); i++) {
     p = &cfg.pubv[ i ];
     if (p->ring_name) free(p->ring_name);
-    if (p->ring) ccr_close( p->ring );
-    if (p->out_buf) free(p->out_buf);
-    /* do not close p->fd */
   }
   if (cfg.pubv) free(cfg.pubv);
   if (cfg.broker) free(cfg.broker);
-  if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
-  if (cfg.signal_fd != -1) close(cfg.signal_fd);
+  if (cfg.key_field) free(cfg.key_field);
   return 0;
 }
@@ -1,92 +1,174 @@
 /*
  * redis publisher
  *
+ * the sink engine (see sink.h) reads the rings in batches on -t
+ * threads. each thread has its own connections to every redis,
+ * which it watches in the engine's loop (on_event): a batch is
+ * written to them as they drain, and its frames acknowledged as
+ * their parts are written
+ *
  */
 
-#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/un.h>
 #include <errno.h>
 #include <stdio.h>
 #include <netdb.h>
+#include <limits.h>
 #include <time.h>
 
 #include "ccr.h"
+#include "sink.h"
 
 /* redis related defaults */
 #define DEFAULT_PORT 6379
 #define DEFAULT_UNIX "/var/run/redis/redis.sock"
 #define DEFAULT_VERB "PUBLISH"
-#define MAX_RESP 2000 /* cmd e.g. publish foo bar */
-
-#define NUM_IOV 100000
-#define BUF_LEN (NUM_IOV * 1000)
+#define RESP_HDR 24   /* $<len>\r\n of one argument */
+#define RESP_IOV 4    /* per frame, at most: prefix, $<len>\r\n, frame, \r\n */
+
+/* with -V RPUSH|LPUSH, up to a batch of frames go in one variadic
+ * command; with -V XADD, a batch of commands goes per round trip.
+ * the batch doubles while round trips stay under the -L target
+ * and halves when they exceed it */
+#define BATCH_MIN 16
+#define BATCH_MAX 8192
+#define BATCH_INIT 256
+#define DEFAULT_RTT_US 2000
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define REPLY_LEN (1024 * 1024) /* replies are short; see handle_redis */
 struct redis {
-  char from[BUF_LEN];
+  char from[REPLY_LEN];
   size_t left;
-  char *key;
-  int key_len;
   int fd;
+  size_t skip;   /* bytes of a bulk reply yet to pass */
+};
+
+/* a redis to publish to, given by -b or -u. frames are spread
+ * over several (shards) by a consistent hash; see route_frames */
+#define MAX_SHARDS 16
+struct endpoint {
+  enum { TRANSPORT_TCP, TRANSPORT_UNIX } transport;
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+  char *name;
 };
 
+/* a connection to redis. there are -c of them to each endpoint.
+ * each has its own pipeline of ring reads to write, in order,
+ * its own reply count, and its own batch size */
+#define MAX_CONNS 64
+struct obuf;
+struct conn {
+  struct sink_worker *w; /* its thread */
+  struct redis k;
+  int shard;         /* its endpoint */
+  unsigned sent;     /* commands */
+  unsigned ackd;     /* replies */
+  size_t batch;      /* see BATCH_INIT */
+  int timing;        /* a round trip is being timed */
+  unsigned round_end;/* reply that ends it */
+  struct timespec round_ts;
+  struct obuf **q;   /* circular; oldest at q_head */
+  size_t q_head;
+  size_t q_used;
+  size_t q_max;
+};
+
+/* the redis output made from a ring read, a sink batch. each frame
+ * goes out as the command prefix, its length header, the frame
+ * itself in the read buffer (or its json), and \r\n, so frames are
+ * neither copied nor limited in size. -n batches of a ring are in
+ * flight, so the ring is read into one while others are still
+ * being written to redis. the frames routed to each connection
+ * are laid out as its part, and acknowledged once it is written.
+ * the per-frame arrays are carved from the read buffer's scratch
+ * (OBUF_AUX) */
+#define DEFAULT_OBUFS 2
+struct part {
+  size_t start;      /* first iovec in out_iov */
+  size_t used;
+  size_t sent;
+  size_t frames;
+};
+struct obuf {
+  struct sink_batch *bt;
+
+  struct iovec *out_iov;    /* out_max of them */
+  size_t out_max;
+  uint32_t *order;          /* frames, grouped by connection */
+  char (*hdr)[RESP_HDR];
+  char (*arr)[RESP_HDR];    /* *<n>\r\n of variadic commands */
+  uint8_t *route;           /* connection of each frame */
+  struct part part[MAX_CONNS];
+};
+
+#define OBUF_AUX (RESP_IOV * sizeof(struct iovec) + sizeof(uint32_t) + \
+                  2 * RESP_HDR + sizeof(uint8_t))
+#define OBUF_AUX_FIXED (2 * MAX_CONNS * sizeof(struct iovec))
+
 struct pub {
   char *ring_name;
-  int fd;
-  unsigned sent;
-  unsigned ackd;
-  struct redis k;
-  struct ccr *ring;
+  char *key;
+  int key_len;
+  uint64_t hash;     /* of the ring name, for routing by ring */
+  int kf;            /* index of the -k field; -1 until known */
 
-  /* read buffer, for ccr read */
-  struct iovec ccr_iov[NUM_IOV];
-  char ccr_buf[BUF_LEN];
+  /* redis output */
+  char *prefix;             /* *3 $verb verb $key key; made once */
+  size_t prefix_len;
+  struct obuf ob[SINK_MAX_BATCHES]; /* one per batch, as in r->bt */
+};
 
-  /* push buffer, for redis output */
-  char *out_buf;
-  size_t buf_sent;
-  size_t buf_size;
-  size_t buf_used;
+/* the connections of a thread. the engine deals the rings out
+ * over -t threads; each has its own connections to every redis,
+ * so the threads share nothing mutable */
+struct thr {
+  struct conn *connv;
+  int num_conn;
 };
 
 struct {
   int verbose;
   char *prog;
 
-  /* transport is either tcp host/port
+  /* redis endpoints; each is either tcp host/port
    * or unix domain socket (preferred) */
-  enum { TRANSPORT_TCP, TRANSPORT_UNIX } transport;
-  struct sockaddr_in in;
-  struct sockaddr_un un;
-  char *unix_socket;
-  char *host;
+  struct endpoint ep[MAX_SHARDS];
+  int num_ep;
+  int conns_per;     /* connections to each endpoint */
+  char *route_field; /* route frames by this field, not by ring */
 
-  int signal_fd;
-  int epoll_fd;
   int ticks;
-  int json;
-  int pretty;
   int num_pub;
   struct pub *pubv;
   int signal_ppid;
-  struct redis sk;
   char *verb;
   int verb_len;
-  char resp[MAX_RESP];
+  enum { VERB_ONE, VERB_PUSH, VERB_XADD } verb_mode;
+  long maxlen;       /* XADD MAXLEN ~; 0 = none */
+  long rtt_us;       /* round trip target for the batch size */
+
+  struct thr tv[SINK_MAX_THREADS];
+  struct sink sink;
 } cfg = {
-  .signal_fd = -1,
-  .epoll_fd = -1,
-  .transport = TRANSPORT_UNIX,
-  .unix_socket = DEFAULT_UNIX,
+  .conns_per = 1,
   .verb = DEFAULT_VERB,
   .verb_len = sizeof(DEFAULT_VERB)-1,
+  .rtt_us = DEFAULT_RTT_US,
 };
 
 void usage() {
@@ -95,7 +177,18 @@ void usage() {
   fprintf(stderr,"  -U                   connect using unix socket (default)\n");
   fprintf(stderr,"  -b <host>[:port]     connect using TCP socket\n");
   fprintf(stderr,"  -u <redis-socket>    unix socket (default: %s)\n", DEFAULT_UNIX);
+  fprintf(stderr,"                       -b|-u may repeat; frames are sharded\n");
+  fprintf(stderr,"  -c <conns>           connections to each redis (default: 1)\n");
+  fprintf(stderr,"  -k <field>           shard frames by this field (default: by ring)\n");
   fprintf(stderr,"  -V <verb>            redis mode (default: %s)\n", DEFAULT_VERB);
+  fprintf(stderr,"                       RPUSH|LPUSH batch frames per command\n");
+  fprintf(stderr,"                       XADD adds each frame as field data\n");
+  fprintf(stderr,"  -m <maxlen>          XADD MAXLEN ~ maxlen\n");
+  fprintf(stderr,"  -L <usec>            batch round trip target (default: %d)\n", DEFAULT_RTT_US);
+  fprintf(stderr,"  -n <bufs>            output buffers per ring (default: %d)\n", DEFAULT_OBUFS);
+  fprintf(stderr,"  -t <threads>         service the rings on this many threads,\n");
+  fprintf(stderr,"                       each with its own connections (default: 1)\n");
+  fprintf(stderr,"  -a <cpu>[,<cpu>...]  pin the threads to these cpus, in turn\n");
   fprintf(stderr,"  -v                   verbose\n");
   fprintf(stderr,"  -j                   json\n");
   fprintf(stderr,"  -p                   pretty json\n");
@@ -104,9 +197,6 @@ void usage() {
   exit(-1);
 }
 
-/* signals that we'll accept via signalfd in epoll */
-int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT,SIGALRM};
-
 void hexdump(char *buf, size_t len) {
   size_t i,n=0;
   unsigned char c;
@@ -127,132 +217,152 @@ void hexdump(char *buf, size_t len) {
   }
 }
 
-/* forms a volatile redis resp-formatted buffer.
- * caller must copy or use it immediately! */
-int form_resp(char **out, char *key, size_t keylen, char *arg, size_t arglen) {
-  int len;
-
-  len = snprintf(cfg.resp, MAX_RESP,
-                "*3\r\n"   /* array of length 3  */
-                "$%d\r\n"  /* strlen(verb)       */
-                "%s\r\n"   /* verb               */
-                "$%zu\r\n" /* strlen(key)        */
-                "%s\r\n"   /* key                */
-                "$%zu\r\n",/* arglen             */
-                cfg.verb_len,
-                cfg.verb,
-                keylen,
-                key,
-                arglen);
-
-  if (len + arglen + 2 >= MAX_RESP) {
-    fprintf(stderr, "RESP buffer too small\n");
-    *out = NULL;
-    return 0;
-  }
-
-  /* the argument can contain binary \0 so we
-   * write it using memcpy rather than printf */
-  memcpy(cfg.resp + len, arg, arglen);
-  memcpy(cfg.resp + len + arglen, "\r\n", 2);
-  len += arglen + 2;
-
-  if (cfg.verbose) {
-    fprintf(stderr, "resp:\n");
-    hexdump(cfg.resp, len);
-  }
-
-  *out = cfg.resp;
-  return len;
-}
-
+/*
+ * form_prefix
+ *
+ * the part of the resp command that is the same for
+ * every frame of a ring: the array header, the verb,
+ * and the key; for XADD, the arguments up to the
+ * value. only the frame's length header varies. a
+ * variadic RPUSH gets its array header per command.
+ *
+ */
+int form_prefix(struct pub *p) {
+  char max[RESP_HDR];
+  int rc = -1, len;
+  size_t size;
+
+  size = cfg.verb_len + p->key_len + 128;
+  p->prefix = malloc(size);
+  if (p->prefix == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
 
-int periodic_work() {
-  int rc = -1;
+  switch(cfg.verb_mode) {
+    case VERB_ONE:
+      len = snprintf(p->prefix, size, "*3\r\n"   /* array of length 3  */
+                                      "$%d\r\n"  /* strlen(verb)       */
+                                      "%s\r\n"   /* verb               */
+                                      "$%d\r\n"  /* strlen(key)        */
+                                      "%s\r\n",  /* key                */
+             cfg.verb_len, cfg.verb, p->key_len, p->key);
+      break;
+    case VERB_PUSH:
+      len = snprintf(p->prefix, size, "$%d\r\n%s\r\n$%d\r\n%s\r\n",
+             cfg.verb_len, cfg.verb, p->key_len, p->key);
+      break;
+    case VERB_XADD:
+      /* XADD key [MAXLEN ~ n] * data <frame> */
+      snprintf(max, sizeof(max), "%ld", cfg.maxlen);
+      len = snprintf(p->prefix, size, "*%d\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n",
+             cfg.maxlen ? 8 : 5, cfg.verb_len, cfg.verb, p->key_len, p->key);
+      if (cfg.maxlen)
+        len += snprintf(p->prefix + len, size - len,
+             "$6\r\nMAXLEN\r\n$1\r\n~\r\n$%zu\r\n%s\r\n", strlen(max), max);
+      len += snprintf(p->prefix + len, size - len,
+             "$1\r\n*\r\n$4\r\ndata\r\n");
+      break;
+    default:
+      assert(0);
+      goto done;
+  }
 
+  assert((size_t)len < size);
+  p->prefix_len = len;
   rc = 0;
- 
+
  done:
   return rc;
 }
 
-int new_epoll(int events, int fd) {
-  int rc;
-  struct epoll_event ev;
-  memset(&ev,0,sizeof(ev));
-  ev.events = events;
-  ev.data.fd= fd;
-  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
-  if (rc == -1) {
-    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
-  }
-  return rc;
+/* carve the per-frame arrays from the read buffer's scratch */
+void obuf_carve(struct obuf *o) {
+  size_t n = o->bt->b->niov;
+  char *a = o->bt->aux;
+
+  o->out_max = n * RESP_IOV + 2 * MAX_CONNS;
+  o->out_iov = (struct iovec*)a;
+  a += o->out_max * sizeof(struct iovec);
+  o->order = (uint32_t*)a;
+  a += n * sizeof(uint32_t);
+  o->hdr = (char (*)[RESP_HDR])a;
+  a += n * RESP_HDR;
+  o->arr = (char (*)[RESP_HDR])a;
+  a += n * RESP_HDR;
+  o->route = (uint8_t*)a;
 }
 
-int mod_epoll(int events, int fd) {
-  int rc;
-  struct epoll_event ev;
-  memset(&ev,0,sizeof(ev));
-  ev.events = events;
-  ev.data.fd= fd;
-  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_MOD, fd, &ev);
-  if (rc == -1) {
-    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
-  }
-  return rc;
-}
 
-int send_redis(struct pub *p, int *vented) {
-  int rc = -1;
+/* write the pending resp iovecs of the connection's oldest part,
+ * IOV_MAX at a time. an iovec written in part is trimmed to its
+ * unwritten tail */
+int send_redis(struct conn *c, int *vented) {
+  struct iovec *iov;
+  struct part *pt;
+  struct obuf *o;
+  int rc = -1, sc;
   ssize_t nr;
-  size_t l;
-  char *o;
+  size_t n;
 
-  assert(p->buf_sent < p->buf_used);
+  assert(c->q_used > 0);
+  o = c->q[c->q_head];
+  pt = &o->part[c - cfg.tv[c->w->n].connv];
+  assert(pt->sent < pt->used);
 
-  o = p->out_buf + p->buf_sent;
-  l = p->buf_used - p->buf_sent;
+  iov = &o->out_iov[pt->start + pt->sent];
+  n = pt->used - pt->sent;
+  if (n > IOV_MAX) n = IOV_MAX;
 
-  nr = write(p->k.fd, o, l);
+  nr = writev(c->k.fd, iov, n);
   if (nr < 0) {
-    fprintf(stderr, "write: %s\n", strerror(errno));
+    fprintf(stderr, "writev: %s\n", strerror(errno));
     goto done;
   }
 
-  p->buf_sent += nr;
-  *vented = (p->buf_sent < p->buf_used) ? 0 : 1;
+  while (nr > 0) {
+    iov = &o->out_iov[pt->start + pt->sent];
+    if ((size_t)nr < iov->iov_len) {
+      iov->iov_base = (char*)iov->iov_base + nr;
+      iov->iov_len -= nr;
+      break;
+    }
+    nr -= iov->iov_len;
+    pt->sent++;
+  }
+
+  if (pt->sent == pt->used) {
+    c->q_head = (c->q_head + 1) % c->q_max;
+    c->q_used--;
+    sc = sink_ack(o->bt, pt->frames);
+    if (sc < 0) goto done;
+  }
+
+  *vented = (c->q_used == 0) ? 1 : 0;
   rc = 0;
 
  done:
   return rc;
 }
 
-int open_redis(struct redis *r) {
-  int rc=-1, fd=-1, sc, domain, sl;
+int open_redis(struct conn *c) {
+  struct endpoint *ep = &cfg.ep[c->shard];
+  int rc=-1, fd=-1, sc, domain;
   struct sockaddr *sa;
   socklen_t sz;
 
-  fprintf(stderr, "connecting to %s\n",
-    (cfg.transport == TRANSPORT_TCP) ?
-    cfg.host : cfg.unix_socket);
+  fprintf(stderr, "connecting to %s\n", ep->name);
 
-  switch(cfg.transport) {
+  switch(ep->transport) {
     case TRANSPORT_TCP:
       domain = AF_INET;
-      sa = (struct sockaddr*)&cfg.in;
+      sa = (struct sockaddr*)&ep->in;
       sz = sizeof(struct sockaddr_in);
       break;
     case TRANSPORT_UNIX:
       domain = AF_UNIX;
-      sa = (struct sockaddr*)&cfg.un;
+      sa = (struct sockaddr*)&ep->un;
       sz = sizeof(struct sockaddr_un);
-      sl = strlen(cfg.unix_socket);
-      cfg.un.sun_family = AF_UNIX;
-      if (sl + 1 > sizeof(cfg.un.sun_path)) {
-        fprintf(stderr, "socket path too long\n");
-        goto done;
-      }
-      memcpy(cfg.un.sun_path, cfg.unix_socket, sl+1);
       break;
     default:
       fprintf(stderr, "unknown transport\n");
@@ -272,10 +382,10 @@ int open_redis(struct redis *r) {
     goto done;
   }
 
-  sc = new_epoll(EPOLLIN, fd);
+  sc = sink_watch(c->w, fd, EPOLLIN);
   if (sc < 0) goto done;
 
-  r->fd = fd;
+  c->k.fd = fd;
   rc = 0;
 
  done:
@@ -283,63 +393,17 @@ int open_redis(struct redis *r) {
   return rc;
 }
 
-int handle_signal() {
-  struct signalfd_siginfo info;
-  int sc, rc=-1;
-  ssize_t nr;
-  char *s;
-  
-  nr = read(cfg.signal_fd, &info, sizeof(info));
-  if (nr != sizeof(info)) {
-    fprintf(stderr,"failed to read signal fd buffer\n");
-    goto done;
-  }
-
-  switch(info.ssi_signo) {
-    case SIGALRM: 
-      sc = periodic_work();
-      if (sc < 0) goto done;
-      alarm(1); 
-      break;
-    default: 
-      s = strsignal(info.ssi_signo);
-      fprintf(stderr,"got signal %d (%s)\n", info.ssi_signo, s);
-      goto done;
-      break;
-  }
-
- rc = 0;
-
- done:
-  return rc;
-}
-
-/* test if fd belongs to an open ring.
- * if so, return 1 and store its pub* */
-int is_ring(int fd, struct pub **p) {
+/* test if fd belongs to an open redis fd of the thread.
+ * if so, return 1 and store its conn* */
+int is_redis(struct sink_worker *w, int fd, struct conn **c) {
+  struct thr *t = &cfg.tv[w->n];
   int i;
 
-  for(i=0; i < cfg.num_pub; i++) {
-    if (cfg.pubv[i].fd != fd)
+  for(i=0; i < t->num_conn; i++) {
+    if (t->connv[i].k.fd != fd)
       continue;
 
-    *p = &cfg.pubv[i];
-    return 1;
-  }
-
-  return 0;
-}
-
-/* test if fd belongs to an open redis fd.
- * if so, return 1 and store its pub* */
-int is_redis(int fd, struct pub **p) {
-  int i;
-
-  for(i=0; i < cfg.num_pub; i++) {
-    if (cfg.pubv[i].k.fd != fd)
-      continue;
-
-    *p = &cfg.pubv[i];
+    *c = &t->connv[i];
     return 1;
   }
 
@@ -349,12 +413,12 @@ int is_redis(int fd, struct pub **p) {
 /* called when redis is readable */
 int handle_redis(struct redis *k, int *ackd) {
   char *err, *r, *t, *eob, *fr;
-  ssize_t nr, fl;
+  ssize_t nr, fl, n;
 
   if (ackd) *ackd = 0;
 
   fr = k->from + k->left;
-  fl = BUF_LEN - k->left;
+  fl = REPLY_LEN - k->left;
   nr = read(k->fd, fr, fl);
   if (nr <= 0) {
     err = nr ? strerror(errno) : "closed";
@@ -367,6 +431,14 @@ int handle_redis(struct redis *k, int *ackd) {
   k->left = 0;
 
   for (r = k->from; r < eob; r++) {
+    /* pass over the body of a bulk reply */
+    if (k->skip) {
+      n = eob - r;
+      if ((size_t)n > k->skip) n = k->skip;
+      k->skip -= n;
+      r += n - 1;
+      continue;
+    }
     t = r;
     if (*t == '\n') continue;
     while ((r < eob) && (*r != '\r')) r++;
@@ -379,6 +451,11 @@ int handle_redis(struct redis *k, int *ackd) {
       case '+': case ':':
         if (ackd) (*ackd)++;
         continue;
+      case '$': /* bulk, e.g. an XADD entry id; then \n body \r\n */
+        if (ackd) (*ackd)++;
+        n = atol(t + 1);
+        if (n >= 0) k->skip = 1 + n + 2;
+        continue;
       case '-': /* error string */
         err = t + 1;
         fprintf(stderr, "redis: %.*s\n", (int)(r-err), err);
@@ -393,80 +470,212 @@ int handle_redis(struct redis *k, int *ackd) {
   return 0;
 }
 
-/* called when ring is readable */
-int handle_ring(struct pub *p) {
-  size_t niov, i, l, len;
-  char *b, *out, *resp;
-  int rc = -1, fl, sc;
-  struct ccr *r;
-  struct cc *cc;
-  ssize_t nr;
-  void *tmp;
+/*
+ * adapt_batch
+ *
+ * once the replies to a timed round are in, double the batch
+ * if the round trip was under the -L target, else halve it
+ *
+ */
+void adapt_batch(struct conn *c) {
+  struct timespec now;
+  long us;
+
+  if (c->timing == 0) return;
+  if ((int)(c->ackd - c->round_end) < 0) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  us = (now.tv_sec - c->round_ts.tv_sec) * 1000000L +
+       (now.tv_nsec - c->round_ts.tv_nsec) / 1000;
+  c->timing = 0;
+
+  if (us < cfg.rtt_us) {
+    if (c->batch < BATCH_MAX) c->batch *= 2;
+  } else {
+    if (c->batch > BATCH_MIN) c->batch /= 2;
+  }
 
-  r = p->ring;
-  niov = NUM_IOV;
-  nr = ccr_readv(r, 0, p->ccr_buf, BUF_LEN, p->ccr_iov, &niov);
+  if (cfg.verbose) fprintf(stderr, "%s: round trip %ld us, batch %zu\n",
+    cfg.ep[c->shard].name, us, c->batch);
+}
+/* in XADD mode, a batch of frames per connection is read per
+ * round; the engine reads no more than their sum at a time */
+void set_read_max(struct sink_worker *w) {
+  struct thr *t = &cfg.tv[w->n];
+  size_t l;
+  int c;
 
-  if (nr <= 0) {
-    if (nr) fprintf(stderr, "ccr_readv: error %zd\n", nr);
-    else rc = 0;
+  if (cfg.verb_mode != VERB_XADD) return;
+  for(l = 0, c = 0; c < t->num_conn; c++) l += t->connv[c].batch;
+  w->read_max = l;
+}
+
+/* the connection for a hash: a consistent choice of redis, so
+ * the same key stays on the same shard as shards are added, then
+ * one of its connections, so a key's frames stay in order */
+int hash_conn(uint64_t h) {
+  int shard;
+
+  shard = jump_hash(h, cfg.num_ep);
+  return shard * cfg.conns_per + (int)((h >> 32) % cfg.conns_per);
+}
+
+/*
+ * route_frames
+ *
+ * pick the connection for each frame of a ring read: by the
+ * hash of its -k key (see pubutil.h), or else by the ring.
+ * the frames are taken as read, before any json conversion
+ *
+ */
+int route_frames(struct pub *p, struct obuf *o) {
+  struct sink_batch *bt = o->bt;
+  int rc = -1, sc;
+  size_t i, klen;
+  struct cc *cc;
+  char *key;
+
+  if (cfg.route_field == NULL) {
+    memset(o->route, hash_conn(p->hash), bt->n);
+    rc = 0;
     goto done;
   }
 
-  assert( nr > 0 );
-  assert( niov > 0 );
-
-  cc = ccr_get_cc( r );
-  fl = cfg.pretty ? CC_PRETTY : 0;
+  cc = ccr_get_cc(bt->r->ring);
+  for(i = 0; i < bt->n; i++) {
+    sc = frame_key(cc, cfg.route_field, &p->kf, bt->b->iov[i].iov_base,
+                   bt->b->iov[i].iov_len, &key, &klen);
+    if (sc < 0) goto done;
+    o->route[i] = hash_conn(hash_bytes(key, klen));
+  }
 
-  p->buf_sent = 0;
-  p->buf_used = 0;
-  for (i=0; i < niov; i++) {
+  rc = 0;
 
-    b = p->ccr_iov[i].iov_base;
-    l = p->ccr_iov[i].iov_len;
+ done:
+  return rc;
+}
 
-    if (cfg.json) {
-      sc = cc_to_json(cc, &out, &len, b, l, fl);
-      if (sc < 0) {
-        fprintf(stderr, "json conversion failed\n");
-        goto done;
-      }
-    } else {
-      out = b;
-      len = l;
+/*
+ * lay_part
+ *
+ * lay out the resp commands for the frames routed to connection
+ * c, from out_iov[*next] on, and queue them to it
+ *
+ */
+int lay_part(struct pub *p, struct obuf *o, int c, uint32_t *frames,
+             size_t count, size_t *next) {
+  struct sink_worker *w = o->bt->r->w;
+  struct conn *cn = &cfg.tv[w->n].connv[c];
+  struct part *pt = &o->part[c];
+  size_t i, f, l, len, n, ncmd;
+  struct iovec *iov;
+  int sc;
+
+  iov = &o->out_iov[*next];
+  pt->start = *next;
+  pt->sent = 0;
+  pt->frames = count;
+  ncmd = 0;
+
+  for (i=0; i < count; i++) {
+    f = frames[i];
+    l = o->bt->iov[f].iov_len;
+    len = snprintf(o->hdr[f], RESP_HDR, "$%zu\r\n", l);
+
+    if (cfg.verb_mode != VERB_PUSH) {
+      iov[0].iov_base = p->prefix;
+      iov[0].iov_len = p->prefix_len;
+      iov++;
+      ncmd++;
+    } else if ((i % cn->batch) == 0) {
+      n = count - i;
+      if (n > cn->batch) n = cn->batch;
+      iov[0].iov_base = o->arr[f];
+      iov[0].iov_len = snprintf(o->arr[f], RESP_HDR, "*%zu\r\n", n + 2);
+      iov[1].iov_base = p->prefix;
+      iov[1].iov_len = p->prefix_len;
+      iov += 2;
+      ncmd++;
     }
 
-    /* wrap into redis resp protocol */
-    sc = form_resp(&resp, p->k.key, p->k.key_len, out, len);
-    if (resp == NULL) goto done;
-    out = resp;
-    len = sc;
-
-    /* realloc buffer if needed */
-    if (p->buf_size - p->buf_used < len) {
-      p->buf_size = p->buf_size ? (p->buf_size * 2) : (len * NUM_IOV);
-      tmp = realloc(p->out_buf, p->buf_size);
-      if (tmp == NULL) {
-        fprintf(stderr, "out of memory\n");
-        goto done;
-      }
-      p->out_buf = tmp;
+    iov[0].iov_base = o->hdr[f];
+    iov[0].iov_len = len;
+    iov[1] = o->bt->iov[f]; /* can contain binary \0 */
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    iov += 3;
+
+    if (cfg.verbose) {
+      fprintf(stderr, "resp: %s%.*s", p->prefix, (int)len, o->hdr[f]);
+      hexdump(o->bt->iov[f].iov_base, l);
     }
+  }
 
-    /* copy working buffer to output buffer */
-    memcpy(p->out_buf + p->buf_used, out, len);
-    p->buf_used += len;
+  pt->used = (iov - o->out_iov) - pt->start;
+  *next += pt->used;
+  assert(*next <= o->out_max);
+
+  /* queue it; vent whenever redis is writable */
+  assert(cn->q_used < cn->q_max);
+  cn->q[(cn->q_head + cn->q_used) % cn->q_max] = o;
+  if (cn->q_used++ == 0) {
+    sc = sink_rewatch(w, cn->k.fd, EPOLLIN|EPOLLOUT);
+    if (sc < 0) return -1;
   }
+  cn->sent += ncmd;
 
-  /* suspend ring epoll while buffer vents */
-  sc = mod_epoll(0, p->fd);
-  if (sc < 0) goto done;
+  /* time this round, if none is being timed */
+  if ((cfg.verb_mode != VERB_ONE) && (cn->timing == 0)) {
+    clock_gettime(CLOCK_MONOTONIC, &cn->round_ts);
+    cn->round_end = cn->sent;
+    cn->timing = 1;
+  }
 
-  /* vent buffer whenever redis is writable */
-  sc = mod_epoll(EPOLLIN|EPOLLOUT, p->k.fd);
+  return 0;
+}
+
+/*
+ * lay_batch
+ *
+ * called with each batch read from a ring. route its frames over
+ * the connections, and lay out each connection's part as resp
+ * iovecs: the ring's prefix, a $len header, the frame in place in
+ * the read buffer (or its json), and \r\n.
+ * send_redis vents each connection's parts in order, while the
+ * ring goes on being read into the other batches. in RPUSH mode
+ * a command takes a batch of frames, under its own array header;
+ * in XADD mode a batch of frames per connection is read per round
+ * (see set_read_max).
+ *
+ */
+int lay_batch(struct sink_batch *bt) {
+  size_t i, l, next, cnt[MAX_CONNS], at[MAX_CONNS];
+  struct pub *p = (struct pub*)bt->r->data;
+  struct thr *t = &cfg.tv[bt->r->w->n];
+  struct obuf *o;
+  int rc = -1, sc, c;
+
+  o = &p->ob[bt - bt->r->bt];
+  o->bt = bt;
+  obuf_carve(o);
+
+  /* route on the flat frames, not their json */
+  sc = route_frames(p, o);
   if (sc < 0) goto done;
-  p->sent += niov;
+
+  /* group the frames by connection, keeping their order */
+  memset(cnt, 0, sizeof(cnt));
+  for (i=0; i < bt->n; i++) cnt[ o->route[i] ]++;
+  for (l=0, c=0; c < t->num_conn; c++) { at[c] = l; l += cnt[c]; }
+  for (i=0; i < bt->n; i++) o->order[ at[ o->route[i] ]++ ] = i;
+
+  /* wrap into redis resp protocol, a part per connection */
+  for (next=0, l=0, c=0; c < t->num_conn; c++) {
+    if (cnt[c] == 0) continue;
+    sc = lay_part(p, o, c, &o->order[l], cnt[c], &next);
+    if (sc < 0) goto done;
+    l += cnt[c];
+  }
 
   rc = 0;
 
@@ -484,16 +693,14 @@ int handle_ring(struct pub *p) {
  * -1 error
  *
  */
-int parse_hostport() {
+int parse_hostport(char *host, struct sockaddr_in *sa) {
   char *colon=NULL, *p, *h;
   struct hostent *e;
   int rc = -1, port;
-  struct sockaddr_in *sa;
 
-  sa = &cfg.in;
   memset(sa, 0, sizeof(*sa));
 
-  h = cfg.host;
+  h = host;
   colon = strchr(h, ':');
   p = colon ? colon+1 : NULL;
   if (colon) *colon = '\0';
@@ -520,62 +727,186 @@ int parse_hostport() {
   return rc;
 }
 
+/* add a redis endpoint (-b or -u) */
+int add_endpoint(int transport, char *name) {
+  struct endpoint *ep;
+  size_t sl;
+
+  if (cfg.num_ep == MAX_SHARDS) {
+    fprintf(stderr, "too many redis endpoints\n");
+    return -1;
+  }
+
+  ep = &cfg.ep[cfg.num_ep];
+  ep->transport = transport;
+  ep->name = strdup(name);
+  if (ep->name == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+
+  if (transport == TRANSPORT_TCP) {
+    if (parse_hostport(ep->name, &ep->in) < 0) return -1;
+  } else {
+    sl = strlen(name);
+    if (sl + 1 > sizeof(ep->un.sun_path)) {
+      fprintf(stderr, "socket path too long\n");
+      return -1;
+    }
+    ep->un.sun_family = AF_UNIX;
+    memcpy(ep->un.sun_path, name, sl+1);
+  }
+
+  cfg.num_ep++;
+  return 0;
+}
+
+/* a connection is ready: read its replies, or write to it */
+int handle_conn(struct sink_worker *w, int fd, int events) {
+  int rc = -1, sc, ackd, vented;
+  struct conn *c;
+
+  if (is_redis(w, fd, &c) == 0) {
+    fprintf(stderr, "unknown fd\n");
+    goto done;
+  }
+
+  if (events & EPOLLIN) {
+    sc = handle_redis(&c->k, &ackd);
+    if (sc < 0) goto done;
+    c->ackd += ackd;
+    adapt_batch(c);
+    set_read_max(w);
+  }
+
+  if (events & EPOLLOUT) {
+    sc = send_redis(c, &vented);
+    if (sc < 0) goto done;
+    if (vented) {
+      /* undo pollout on redis */
+      sc = sink_rewatch(w, c->k.fd, EPOLLIN);
+      if (sc < 0) goto done;
+    }
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * setup_conns
+ *
+ * the thread's -c connections to each redis, in order. each
+ * queues the parts of up to every batch of the thread's rings
+ *
+ */
+int setup_conns(struct sink_worker *w) {
+  struct thr *t = &cfg.tv[w->n];
+  int rc = -1, sc, i;
+  struct conn *c;
+
+  t->num_conn = cfg.num_ep * cfg.conns_per;
+  t->connv = calloc(t->num_conn, sizeof(struct conn));
+  if (t->connv == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
+  for(i=0; i < t->num_conn; i++) t->connv[i].k.fd = -1;
+
+  for(i=0; i < t->num_conn; i++) {
+    c = &t->connv[i];
+    c->w = w;
+    c->shard = i / cfg.conns_per;
+    c->batch = BATCH_INIT;
+    c->q_max = w->num_ring * cfg.sink.nbatch;
+    c->q = calloc(c->q_max, sizeof(struct obuf*));
+    if (c->q == NULL) {
+      fprintf(stderr, "out of memory\n");
+      goto done;
+    }
+    sc = open_redis(c);
+    if (sc < 0) goto done;
+  }
+
+  set_read_max(w);
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* connect the ring: the first ring of a thread opens its connections */
+int open_ring(struct sink_ring *r) {
+  if (cfg.tv[r->w->n].connv) return 0;
+  return setup_conns(r->w);
+}
+
+struct sink_ops redis_ops = {
+  .open = open_ring,
+  .send_batch = lay_batch,
+  .on_event = handle_conn,
+};
+
 int main(int argc, char *argv[]) {
-  int fd, i, sc, opt, ackd, vented;
   char *ring, *key, *colon;
-  struct epoll_event ev;
-  cfg.prog = argv[0];
-  struct ccr *r;
+  struct sink_batch *bt;
+  int i, j, sc, opt;
   struct pub *p;
-  unsigned n;
+  struct thr *t;
 
-  while ( (opt=getopt(argc,argv,"b:Uu:vhjpPV:")) != -1) {
+  cfg.prog = argv[0];
+  sink_init(&cfg.sink, &redis_ops, NULL);
+  cfg.sink.nbatch = DEFAULT_OBUFS;
+  cfg.sink.aux_per = OBUF_AUX;
+  cfg.sink.aux_fixed = OBUF_AUX_FIXED;
+
+  while ( (opt=getopt(argc,argv,"b:Uu:vhjpPV:m:L:n:c:k:t:a:")) != -1) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
-      case 'b': cfg.transport = TRANSPORT_TCP;
-                cfg.host = strdup(optarg);
-                if (parse_hostport() < 0) goto done;
+      case 'b': if (add_endpoint(TRANSPORT_TCP, optarg) < 0) goto done;
+                break;
+      case 'U': break; /* the default */
+      case 'u': if (add_endpoint(TRANSPORT_UNIX, optarg) < 0) goto done;
                 break;
-      case 'U': cfg.transport = TRANSPORT_UNIX; break;
-      case 'u': cfg.unix_socket = strdup(optarg); break;
+      case 'c': cfg.conns_per = atoi(optarg);
+                if (cfg.conns_per < 1) usage();
+                break;
+      case 'k': cfg.route_field = strdup(optarg); break;
       case 'V': cfg.verb = strdup(optarg);
                 cfg.verb_len = strlen(cfg.verb);
                 break;
-      case 'j': cfg.json=1; break;
-      case 'p': cfg.json=1; cfg.pretty=1; break;
+      case 'm': cfg.maxlen = atol(optarg); break;
+      case 'L': cfg.rtt_us = atol(optarg); break;
+      case 'n': cfg.sink.nbatch = atoi(optarg);
+                if ((cfg.sink.nbatch < 1) ||
+                    (cfg.sink.nbatch > SINK_MAX_BATCHES)) usage();
+                break;
+      case 't': cfg.sink.nthread = atoi(optarg);
+                if ((cfg.sink.nthread < 1) ||
+                    (cfg.sink.nthread > SINK_MAX_THREADS)) usage();
+                break;
+      case 'a': if (sink_cpus(&cfg.sink, optarg) < 0) usage(); break;
+      case 'j': cfg.sink.json=1; break;
+      case 'p': cfg.sink.json=1; cfg.sink.json_flags |= CC_PRETTY; break;
       case 'P': cfg.signal_ppid=1; break;
       case 'h': default: usage(); break;
     }
   }
 
-  /* block all signals. we take signals synchronously via signalfd */
-  sigset_t all;
-  sigfillset(&all);
-  sigprocmask(SIG_SETMASK,&all,NULL);
-
-  /* a few signals we'll accept via our signalfd */
-  sigset_t sw;
-  sigemptyset(&sw);
-  for(n=0; n < sizeof(sigs)/sizeof(*sigs); n++) sigaddset(&sw, sigs[n]);
+  if (!strcasecmp(cfg.verb, "RPUSH") || !strcasecmp(cfg.verb, "LPUSH"))
+    cfg.verb_mode = VERB_PUSH;
+  if (!strcasecmp(cfg.verb, "XADD"))
+    cfg.verb_mode = VERB_XADD;
 
-  /* create the signalfd for receiving signals */
-  cfg.signal_fd = signalfd(-1, &sw, 0);
-  if (cfg.signal_fd == -1) {
-    fprintf(stderr,"signalfd: %s\n", strerror(errno));
+  if ((cfg.num_ep == 0) && (add_endpoint(TRANSPORT_UNIX, DEFAULT_UNIX) < 0))
     goto done;
-  }
-
-  /* set up the epoll instance */
-  cfg.epoll_fd = epoll_create(1); 
-  if (cfg.epoll_fd == -1) {
-    fprintf(stderr,"epoll: %s\n", strerror(errno));
+  if (cfg.num_ep * cfg.conns_per > MAX_CONNS) {
+    fprintf(stderr, "at most %d connections\n", MAX_CONNS);
     goto done;
   }
-
-  /* add descriptors of interest */
-  sc = new_epoll(EPOLLIN, cfg.signal_fd);
-  if (sc < 0) goto done;
-
+  cfg.sink.verbose = cfg.verbose;
 
   /* rings from command line */
   cfg.num_pub = argc - optind;
@@ -585,87 +916,53 @@ int main(int argc, char *argv[]) {
   if (cfg.pubv == NULL) goto done;
 
   for(i=0; optind < argc; i++, optind++) {
-
     p = &cfg.pubv[i];
     ring = strdup( argv[optind] );
+    if (ring == NULL) goto done;
     colon = strchr(ring, ':');
     if (colon) *colon = '\0';
     key = colon ? (colon+1) : ring;
     p->ring_name = ring;
-    p->k.key_len = strlen(key);
-    p->k.key = key;
-    p->k.fd = -1;
+    p->key_len = strlen(key);
+    p->key = key;
+    p->hash = hash_bytes(ring, strlen(ring));
+    p->kf = -1;
 
-    r = ccr_open( ring, CCR_RDONLY|CCR_NONBLOCK);
-    if (r == NULL) goto done;
-    cfg.pubv[i].ring = r;
-
-    fd = ccr_get_selectable_fd( r );
-    if (fd < 0) goto done;
-    cfg.pubv[i].fd = fd;
-
-    sc = new_epoll(EPOLLIN, fd);
+    sc = form_prefix(p);
     if (sc < 0) goto done;
 
-    sc = open_redis(&p->k);
+    sc = sink_add(&cfg.sink, ring, p);
     if (sc < 0) goto done;
   }
 
-  alarm(1);
-  for (;;) {
-
-    sc = epoll_wait(cfg.epoll_fd, &ev, 1, -1);
-    if (sc < 0) {
-      fprintf(stderr,"epoll: %s\n", strerror(errno));
-      break;
-    }
+  sink_run(&cfg.sink);
 
-    if (ev.data.fd == cfg.signal_fd) {
-      sc = handle_signal();
-      if (sc < 0) goto done;
-    } 
-    else if (is_redis(ev.data.fd, &p)) {
-      if (ev.events & EPOLLIN) {
-        sc = handle_redis(&p->k, &ackd);
-        if (sc < 0) goto done;
-        p->ackd += ackd;
-      }
-      if (ev.events & EPOLLOUT) {
-        sc = send_redis(p, &vented);
-        if (sc < 0) goto done;
-        if (vented) {
-          /* undo pollout on redis */
-          sc = mod_epoll(EPOLLIN, p->k.fd);
-          if (sc < 0) goto done;
-          /* restore pollin on ring */
-          sc = mod_epoll(EPOLLIN, p->fd);
-          if (sc < 0) goto done;
-        }
-      }
-    }
-    else if (is_ring(ev.data.fd, &p)) {
-      sc = handle_ring(p);
-      if (sc < 0) goto done;
-    }
-    else {
-      fprintf(stderr, "unknown fd\n");
-      assert(0);
+done:
+  /* reads still in flight go back to their pool */
+  for(i=0; i < cfg.sink.num_ring; i++) {
+    for(j=0; cfg.sink.ringv[i].bt && (j < cfg.sink.nbatch); j++) {
+      bt = &cfg.sink.ringv[i].bt[j];
+      if (bt->b == NULL) continue;
+      bufpool_put(&bt->r->w->pool, bt->b);
+      bt->b = NULL;
     }
-
   }
-
-done:
+  sink_fini(&cfg.sink);
   for(i=0; cfg.pubv && (i < cfg.num_pub); i++) {
     p = &cfg.pubv[ i ];
     if (p->ring_name) free(p->ring_name);
-    if (p->ring) ccr_close( p->ring );
-    if (p->k.fd != -1) close(p->k.fd);
-    if (p->out_buf) free(p->out_buf);
-    /* do not close p->fd */
+    if (p->prefix) free(p->prefix);
   }
   if (cfg.pubv) free(cfg.pubv);
-  if (cfg.host) free(cfg.host);
-  if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
-  if (cfg.signal_fd != -1) close(cfg.signal_fd);
+  for(i=0; i < SINK_MAX_THREADS; i++) {
+    t = &cfg.tv[ i ];
+    for(j=0; t->connv && (j < t->num_conn); j++) {
+      if (t->connv[j].k.fd != -1) close(t->connv[j].k.fd);
+      if (t->connv[j].q) free(t->connv[j].q);
+    }
+    if (t->connv) free(t->connv);
+  }
+  for(i=0; i < cfg.num_ep; i++) free(cfg.ep[i].name);
+  if (cfg.route_field) free(cfg.route_field);
   return 0;
 }
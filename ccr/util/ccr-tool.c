@@ -1,6 +1,13 @@
+#define _GNU_SOURCE /* memfd_create */
 #include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <string.h>
@@ -9,13 +16,25 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <ctype.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <time.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "libut.h"
+#include "crc32c.h"
 #include "ccr.h"
+#include "sink.h"
 
 /* 
  * ccr tool
@@ -28,10 +47,209 @@
  * in the initialized data area and the
  * resulting binary gets much larger */
 #define MAX_FRAME (1024*1024) /* safeguard */
-#define SUBBUFLEN (MAX_FRAME * 10)
-#define SUBNUMIOV (1024 * 1024)
-char sub_buf_bss[SUBBUFLEN];
-struct iovec sub_iov_bss[SUBNUMIOV];
+#define SUBBUFLEN (MAX_FRAME * 16) /* page multiple; see setup_recvbuf */
+#define SUBBATCH  (MAX_FRAME * 4)  /* bytes received per ring write */
+#define MAX_STRIPES 16             /* limit of sub -N */
+#define SUB_RETRY_MAX 32           /* sub -A backoff limit, seconds */
+
+/* pub: a batch is one bulk read from the ring. it is encoded
+ * once and queued by reference to every client. each client
+ * has its own queue and cursor, so a slow client holds only
+ * its own position back (within the -Q limit). the ring is
+ * read by the sink core (see pub_send); up to PUB_READS reads
+ * per -Q batch are held by the history and the queues */
+#define PUBBUFLEN (MAX_FRAME * 2)
+#define PUBNUMIOV (8 * 1024)
+#define PUBMAXQ 256      /* limit of -Q */
+#define PUB_READS 4
+#define MAX_CLIENTS 64
+
+/* in the sequenced protocol (s|r), each batch is sent as this
+ * header then the binary encoding of its frames (len, frame ...) */
+#define BATCH_MAGIC 0x62726363U  /* "ccrb" */
+#define BATCH_CRC   (1U << 0)    /* crc is the crc32c of the body */
+#define BATCH_LZ4   (1U << 1)    /* body is lz4 compressed */
+#define BATCH_ZSTD  (1U << 2)    /* body is zstd compressed */
+#define BATCH_SUBSET (1U << 3)   /* filtered; body has fewer frames */
+struct batch_hdr {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t seq;            /* sequence number of the first frame */
+  uint32_t frames;         /* frames spanned in sequence */
+  uint32_t len;            /* body length, as sent */
+  uint32_t crc;            /* of the uncompressed body */
+  uint32_t raw;            /* uncompressed body length, if compressed */
+};
+
+/* pub -W: batches leaving the replay history are appended to a
+ * spill file as this record then the frame lengths and the frames.
+ * the spill is two segments of up to half the -W size; when the
+ * one being written fills, the older one is truncated and reused */
+struct spill_rec {
+  uint64_t seq;            /* sequence number of the first frame */
+  uint64_t num;            /* batch number; see stripes */
+  uint32_t frames;
+  uint32_t len;            /* bytes of frames, after the lengths */
+};
+
+/* multicast (-E m): frames are packed into datagrams of up to -D
+ * bytes, each led by this header. frames are numbered as in the
+ * sequenced protocol; the subscriber counts a gap as lost frames
+ * and carries on. a frame too big for one datagram is sent alone,
+ * for ip to fragment, up to the udp limit */
+#define DGRAM_MAGIC  0x6d726363U  /* "ccrm" */
+#define DGRAM_MAX    65507        /* largest udp payload */
+#define DGRAM_FRAMES 256          /* frames per datagram, at most */
+#define MMSG_MAX     64           /* datagrams per sendmmsg|recvmmsg */
+struct dgram_hdr {
+  uint32_t magic;
+  uint32_t frames;
+  uint64_t seq;            /* sequence number of the first frame */
+};
+
+/* a sequenced batch compressed by a codec (l|z). the whole batch
+ * is one block, so the compression context spans its frames. it
+ * is compressed once, on the compression thread, for all clients
+ * using that codec */
+enum {codec_none, codec_lz4, codec_zstd, codec_max};
+struct zform {
+  enum {z_none, z_busy, z_ready} state;
+  struct batch *b;
+  int codec;
+  int err;                 /* compression failed */
+  char *buf;               /* compressed body */
+  size_t size;
+  struct batch_hdr hdr;
+  struct iovec iov[2];     /* hdr, body */
+  struct zform *next;      /* compression thread queues */
+};
+
+struct batch {
+  int refcnt;
+  size_t niov;             /* frames */
+  size_t span;             /* frames of the ring it covers */
+  uint64_t seq;            /* sequence number of the first frame */
+  uint64_t num;            /* batches read before it; see stripes */
+  struct sink_batch *sb;   /* the ring read it lies in; NULL if own */
+  char *buf;               /* frames as read from the ring */
+  struct iovec *iov;       /* frames in buf */
+  uint32_t *len;           /* binary length prefixes */
+  struct iovec *bin;       /* hdr, then binary wire: len, frame ... */
+  size_t rawlen;           /* bytes of binary wire */
+  struct batch_hdr hdr;    /* sequenced header; made on first use */
+  int have_hdr;
+  struct zform z[codec_max]; /* compressed forms, made on first use */
+  UT_string *json;         /* json wire; encoded on first use */
+  struct iovec json_iov;
+  int have_json;
+  struct view *view;       /* derived through this view, if any */
+  struct batch *derived;   /* batches derived from this one */
+  struct batch *sibling;   /* next in source's derived list */
+  struct batch *next;      /* free list, if own */
+};
+
+/* a projection (p) and filter (f) requested by a client, shared
+ * by the clients that request the same. each batch is derived
+ * through it once, on the flat frames, into a batch of its own
+ * whose frames have the derived cast */
+#define SPECMAX 256
+enum {op_eq, op_ne, op_lt, op_le, op_gt, op_ge};
+struct view {
+  int refcnt;
+  char proj[SPECMAX];      /* field list, as requested */
+  char filt[SPECMAX];      /* predicate, as requested */
+  int *idx;                /* projected fields; NULL = all */
+  int nidx;
+  int pf;                  /* predicate field; -1 = none */
+  int pf_type;
+  int op;
+  double num;              /* predicate operand, numeric types */
+  char val[SPECMAX];       /* predicate operand, others, as in a frame */
+  size_t val_len;
+  UT_string *cast;         /* derived cast */
+  struct cc *cc;           /* on the derived cast, for json */
+  struct view *next;
+};
+
+/* a batch in a client queue */
+struct qent {
+  struct batch *b;
+  int zc;                  /* some of it went as MSG_ZEROCOPY */
+  uint32_t zc_last;        /* id of the last such send */
+};
+
+struct client {
+  int used;
+  int fd;
+  char addr[INET_ADDRSTRLEN];
+  int encoding;            /* enc_proto until client sends j|b|s|r */
+  int codec;               /* sequenced compression; see zform */
+  char proj[SPECMAX];      /* requested projection (p) */
+  char filt[SPECMAX];      /* requested filter (f) */
+  int spec_want;           /* p|f while reading one */
+  size_t spec_len;
+  struct view *view;       /* made from proj and filt, when needed */
+  char rq[sizeof(uint64_t)]; /* r|k request argument */
+  int rq_op;               /* r|k while its argument arrives */
+  size_t rq_len;           /* bytes of it arrived */
+  size_t rq_need;          /* bytes of it expected */
+  int local;               /* unix domain; no tcp options */
+  int stripe;              /* gets batches numbered stripe mod nstripes */
+  int nstripes;            /* 0 = all batches */
+  int catchup;             /* replaying; see client_catchup */
+  uint64_t catchup_seq;    /* next frame to replay */
+  int sp_valid;            /* replay cursor in the spill is set */
+  uint64_t sp_gen;         /* its segment generation */
+  off_t sp_off;            /* offset of its next record */
+  struct qent q[PUBMAXQ];  /* circular; oldest at q_head */
+  size_t q_head;
+  size_t q_used;           /* entries queued */
+  size_t q_send;           /* entries fully sent, of q_used */
+  size_t iov_idx;          /* cursor in wire of first unsent batch */
+  size_t iov_off;
+  int pollout;             /* polling for room to send */
+  int held;                /* bytes held by MSG_MORE/TCP_CORK */
+  int zc_on;               /* SO_ZEROCOPY enabled */
+  uint32_t zc_sent;        /* zerocopy sends issued */
+  uint32_t zc_done;        /* zerocopy sends completed */
+  unsigned long drops;     /* batches dropped by slow client policy */
+};
+struct client clients_bss[MAX_CLIENTS];
+struct mmsghdr mc_msgs_bss[MMSG_MAX];
+struct iovec mc_iov_bss[MMSG_MAX * (1 + 2 * DGRAM_FRAMES)];
+struct dgram_hdr mc_hdrs_bss[MMSG_MAX];
+char mc_rbuf_bss[MMSG_MAX * DGRAM_MAX];
+
+/* a tcp [host:]port, or a unix:path endpoint */
+struct endpoint {
+  int domain;              /* AF_INET or AF_UNIX */
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+};
+#define ep_addr(ep) (((ep)->domain == AF_UNIX) ? \
+  (struct sockaddr*)&(ep)->un : (struct sockaddr*)&(ep)->in)
+#define ep_len(ep)  (((ep)->domain == AF_UNIX) ? \
+  sizeof((ep)->un) : sizeof((ep)->in))
+
+/* sub: one of the connections to the publisher. with -N, there are
+ * several; each gets every Nth batch, and they are merged in order */
+struct stripe {
+  int fd;
+  char *buf;               /* double-mapped; see setup_recvbuf */
+  size_t head;             /* bytes consumed, ever */
+  size_t tail;             /* bytes received, ever */
+  int paused;              /* buffer full; not polled */
+};
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
 
 struct {
   char *prog;
@@ -50,6 +268,7 @@ struct {
         mode_sub,
         mode_lib} mode;
   struct shr *shr;
+  struct ccr *stat_ccr;  /* sub: our ring, to keep its statistics */
   size_t size;
   int flags;
   int fd;
@@ -68,23 +287,89 @@ struct {
   struct modccr modccr;
   /* pub/sub sub */
   char *addr_spec;
-  struct sockaddr_in addr;
+  struct endpoint addr;
   int listen_fd;
-  int pub_fd;
-  int sub_fd;
-  char *sub_buf;
-  size_t sub_buf_used;
-  struct iovec *sub_iov;
-  enum {enc_proto, enc_json, enc_binary} encoding;
+  struct stripe stripes[MAX_STRIPES];
+  int nstripes;
+  int sub_unordered;       /* write stripes' batches as they come */
+  int sub_local;           /* read a local publisher's ring directly */
+  /* multicast */
+  int mcast_fd;
+  size_t dgram_max;        /* datagram payload, bytes */
+  int mc_ttl;
+  uint64_t mc_dgrams;      /* datagrams sent or received */
+  uint64_t mc_lost;        /* sub: frames missing in sequence */
+  uint64_t mc_late;        /* sub: frames behind sequence, discarded */
+  uint64_t mc_bad;         /* sub: malformed datagrams */
+  uint64_t mc_oversize;    /* pub: frames too big to send */
+  uint64_t mc_errors;      /* pub: failed sends */
+  struct iovec *sub_iov;   /* grows to the largest batch */
+  size_t sub_niov;
+  uint64_t sub_seq;        /* next sequence number expected */
+  int sub_seq_known;
+  int sub_codec;           /* compression to request */
+  char *sub_zbuf;          /* decompressed batch */
+  size_t sub_zlen;
+  int sub_lowat;           /* SO_RCVLOWAT; 0=default */
+  char *sub_proj;          /* projection to request */
+  char *sub_filt;          /* filter to request */
+  int sub_retry;           /* reconnect when the publisher goes away */
+  int retry_secs;          /* backoff before the next attempt */
+  time_t retry_at;         /* next attempt; 0 = none pending */
+  uint64_t sub_reconnects;
+  enum {enc_proto, enc_json, enc_binary, enc_seq, enc_mcast} encoding;
   int startup_encoding;
+  /* pub state */
+  struct client *clients;
+  struct sink sink;        /* reads the ring */
+  struct sink_ring *sr;
+  struct batch *free_batches;
+  struct view *views;
+  struct batch *hist[PUBMAXQ]; /* recent batches, for replay */
+  size_t hist_head;
+  size_t hist_used;
+  uint64_t pub_seq;        /* sequence number of next frame read */
+  uint64_t pub_batches;    /* batches read */
+  int pub_crc;             /* checksum sequenced batches */
+  size_t spill_max;        /* replay spill size, bytes; 0 = none */
+  int spill_fd[2];         /* segments, by generation mod 2 */
+  off_t spill_len[2];
+  uint64_t spill_gen;      /* generation of the segment written */
+  /* compression thread */
+  int zlevel;              /* 0 = codec default */
+  pthread_t zthread;
+  int zthread_started;
+  pthread_mutex_t zlock;
+  pthread_cond_t zcond;
+  struct zform *ztodo, *ztodo_tail, *zdone;
+  int zstop;
+  int zevent_fd;           /* compression thread posts when done */
+  /* link statistics, see link_stat */
+  uint64_t raw_bytes;      /* bytes the stream would be uncompressed */
+  uint64_t wire_bytes;     /* bytes actually sent or received */
+  uint64_t last_raw, last_wire;
+  struct timeval last_tv;
+  int link_stat_off;       /* the file could not be written */
+  int ring_watched;
+  size_t pub_maxq;         /* batches queued per client */
+  enum {slow_drop, slow_disconnect, slow_block} slow;
+  int cork;                /* coalesce with TCP_CORK, not MSG_MORE */
+  size_t zc_min;           /* MSG_ZEROCOPY sends this big; 0=off */
 } cfg = {
   .signal_fd = -1,
   .epoll_fd = -1,
   .listen_fd = -1,
-  .pub_fd = -1,
-  .sub_fd = -1,
-  .sub_buf = sub_buf_bss,
-  .sub_iov = sub_iov_bss,
+  .nstripes = 1,
+  .mcast_fd = -1,
+  .dgram_max = 1472,
+  .mc_ttl = 1,
+  .spill_fd = {-1, -1},
+  .clients = clients_bss,
+  .sink = {.signal_fd = -1, .epoll_fd = -1, .done_fd = -1},
+  .pub_maxq = 16,
+  .zlock = PTHREAD_MUTEX_INITIALIZER,
+  .zcond = PTHREAD_COND_INITIALIZER,
+  .zevent_fd = -1,
   .fd = -1,
 };
 
@@ -102,8 +387,8 @@ void usage() {
                  " readhex         read frames in hex/ascii\n"
                  " create          create a ring\n"
                  " load <mod>      load a module\n"
-                 " pub [ip:]port   publish ring over TCP\n"
-                 " sub host:port   subscribe to ring pub\n"
+                 " pub [ip:]port   publish ring over TCP (or unix:path)\n"
+                 " sub host:port   subscribe to ring pub (or unix:path)\n"
                  "\n"
                  "read options\n"
                  "------------\n"
@@ -115,20 +400,60 @@ void usage() {
                  "  -s size        size with k|m|g|t suffix\n"
                  "  -f file        read format from file\n"
                  "  -C ring        copy format from ring\n"
-                 "  -R host:port   fetch format from publisher\n"
-                 "  -m dfksl       flags (default: 0)\n"
+                 "  -R host:port   fetch format from publisher (as -P|-F derive it)\n"
+                 "  -m dfkslhp     flags (default: 0)\n"
                  "      d          drop unread frames when full\n"
                  "      f          farm of independent readers\n"
                  "      k          keep ring as-is if it exists\n"
                  "      l          lock into memory when opened\n"
                  "      s          sync after each i/o\n"
+                 "      h          back the ring with huge pages if possible\n"
+                 "      p          prefault (allocate) the ring pages now\n"
                  "\n"
                  "publish options\n"
                  "---------------\n"
-                 "  -E j|b|p       publisher mode (default: p)\n"
+                 "  -E j|b|s|m|p   publisher mode (default: p)\n"
                  "      j          JSON frames delimited by newlines\n"
                  "      b          binary frames prefixed by 4-byte length\n"
-                 "      p          client's g|j|b gets format|JSON|binary\n"
+                 "      s          sequenced batches of binary frames\n"
+                 "      m          datagrams to the multicast group:port\n"
+                 "      p          client's g|j|b|s gets format|JSON|binary|\n"
+                 "                 sequenced; r<seq> replays from seq; l|z\n"
+                 "                 before s|r compresses with lz4|zstd;\n"
+                 "                 p<fields>\\n and f<predicate>\\n before g|j|b|s|r\n"
+                 "                 project and filter the frames; k<i><n>\n"
+                 "                 before s|r sends batches numbered i mod n;\n"
+                 "                 m passes a unix: client a farm ring itself\n"
+                 "  -D bytes       multicast datagram size (default: 1472)\n"
+                 "  -T ttl         multicast ttl (default: 1)\n"
+                 "  -K             checksum sequenced batches (crc32c)\n"
+                 "  -l level       compression level (zstd; lz4 >1 is HC)\n"
+                 "  -c             coalesce with TCP_CORK (default: MSG_MORE)\n"
+                 "  -z bytes       MSG_ZEROCOPY sends of this size or more\n"
+                 "  -Q batches     queue limit per client (default: 16)\n"
+                 "  -W size        spill the replay history to disk, keeping\n"
+                 "                 this much (k|m|g suffix) for r<seq> beyond -Q\n"
+                 "  -S d|x|b       slow client policy at queue limit (default: d)\n"
+                 "      d          drop batches for that client\n"
+                 "      x          disconnect that client\n"
+                 "      b          stop reading the ring until it catches up\n"
+                 "\n"
+                 "subscribe options\n"
+                 "-----------------\n"
+                 "  -E b|s|m       binary, sequenced batches or multicast group\n"
+                 "                 datagrams (default: b)\n"
+                 "  -r seq         sequenced, replaying from seq\n"
+                 "  -Z lz4|zstd    sequenced and compressed\n"
+                 "  -L bytes       receive low-water mark (SO_RCVLOWAT)\n"
+                 "  -N conns       sequenced, striped over conns connections\n"
+                 "  -U             with -N, write batches in arrival order\n"
+                 "  -A             sequenced; reconnect with backoff when the\n"
+                 "                 publisher goes away, resuming where it was\n"
+                 "  -M             unix: only; read the publisher's ring\n"
+                 "                 directly if it is a farm ring\n"
+                 "  -P f1,f2,...   only these fields (ring cast must match)\n"
+                 "  -F 'f op val'  only frames where field f op val holds\n"
+                 "                 op is == != < <= > >= (ip and mac: == !=)\n"
                  "\n"
                  "load options\n"
                  "------------\n"
@@ -192,10 +517,105 @@ int new_epoll(int events, int fd) {
   return rc;
 }
 
+struct stripe;
+int do_subscriber(struct stripe *st);
+int sub_ring(void);
+int sub_reconnect(void);
+
+/*
+ * link_stat
+ *
+ * pub and sub keep their stream counters in a small text file
+ * beside the ring (RING.pub, RING.sub), rewritten each tick,
+ * for ccr-tool status. the rates cover the last tick. if the
+ * file cannot be written (say, the ring's directory is read-only)
+ * that is reported once, and the file is not kept after that.
+ *
+ */
+int link_stat(int unlink_only) {
+  char path[PATH_MAX], tmp[PATH_MAX], *tag;
+  double secs, ratio;
+  int rc = -1, n, nclients = 0;
+  FILE *f = NULL;
+
+  tag = (cfg.mode == mode_pub) ? "pub" : "sub";
+  snprintf(path, sizeof(path), "%s.%s", cfg.ring, tag);
+  snprintf(tmp, sizeof(tmp), "%s.%s.tmp", cfg.ring, tag);
+
+  if (unlink_only) {
+    unlink(path);
+    return 0;
+  }
+
+  if (cfg.link_stat_off) return 0;
+
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+
+  secs = (cfg.now.tv_sec - cfg.last_tv.tv_sec) +
+         (cfg.now.tv_usec - cfg.last_tv.tv_usec) / 1e6;
+  if (cfg.last_tv.tv_sec == 0) secs = 0;
+  ratio = cfg.wire_bytes ? ((double)cfg.raw_bytes / cfg.wire_bytes) : 0;
+
+  if (cfg.mode == mode_pub) {
+    for(n = 0; n < MAX_CLIENTS; n++) if (cfg.clients[n].used) nclients++;
+    fprintf(f, " pub-clients %d\n", nclients);
+  }
+  if ((cfg.encoding == enc_mcast) && (cfg.mode == mode_pub)) {
+    fprintf(f, " pub-datagrams %lu\n", (unsigned long)cfg.mc_dgrams);
+    fprintf(f, " pub-oversize-frames %lu\n", (unsigned long)cfg.mc_oversize);
+    fprintf(f, " pub-send-errors %lu\n", (unsigned long)cfg.mc_errors);
+  }
+  if ((cfg.encoding == enc_mcast) && (cfg.mode == mode_sub)) {
+    fprintf(f, " sub-datagrams %lu\n", (unsigned long)cfg.mc_dgrams);
+    fprintf(f, " sub-lost-frames %lu\n", (unsigned long)cfg.mc_lost);
+    fprintf(f, " sub-late-frames %lu\n", (unsigned long)cfg.mc_late);
+    fprintf(f, " sub-bad-datagrams %lu\n", (unsigned long)cfg.mc_bad);
+  }
+  if (cfg.sub_retry && (cfg.mode == mode_sub))
+    fprintf(f, " sub-reconnects %lu\n", (unsigned long)cfg.sub_reconnects);
+  fprintf(f, " %s-wire-bytes %lu\n", tag, (unsigned long)cfg.wire_bytes);
+  fprintf(f, " %s-raw-bytes %lu\n", tag, (unsigned long)cfg.raw_bytes);
+  fprintf(f, " %s-ratio %.2f\n", tag, ratio);
+  fprintf(f, " %s-wire-rate %.2f MB/s\n", tag, secs ?
+    ((cfg.wire_bytes - cfg.last_wire) / secs / (1024 * 1024)) : 0);
+  fprintf(f, " %s-raw-rate %.2f MB/s\n", tag, secs ?
+    ((cfg.raw_bytes - cfg.last_raw) / secs / (1024 * 1024)) : 0);
+
+  cfg.last_tv = cfg.now;
+  cfg.last_wire = cfg.wire_bytes;
+  cfg.last_raw = cfg.raw_bytes;
+
+  if (fclose(f)) {
+    f = NULL;
+    fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+  f = NULL;
+
+  if (rename(tmp, path) < 0) {
+    fprintf(stderr, "rename: %s\n", strerror(errno));
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (f) fclose(f);
+  if (rc < 0) {
+    fprintf(stderr, "%s: not kept\n", path);
+    cfg.link_stat_off = 1;
+  }
+  return rc;
+}
+
 int handle_signal(void) {
   struct signalfd_siginfo info;
   ssize_t nr;
-  int rc=-1;
+  int rc=-1, n;
   
   nr = read(cfg.signal_fd, &info, sizeof(info));
   if (nr != sizeof(info)) {
@@ -208,6 +628,24 @@ int handle_signal(void) {
       cfg.ticks++;
       gettimeofday(&cfg.now, NULL);
 
+      if ((cfg.mode == mode_pub) || (cfg.mode == mode_sub)) link_stat(0);
+
+      /* size the ring read buffers to the reads; with -v, report */
+      if ((cfg.mode == mode_pub) && (sink_period(&cfg.sink) < 0)) goto done;
+
+      /* with -A, reconnect when the backoff is up */
+      if ((cfg.mode == mode_sub) && cfg.retry_at) {
+        if (sub_reconnect() < 0) goto done;
+      }
+
+      /* with a receive low-water mark, pick up the trickle */
+      if ((cfg.mode == mode_sub) && cfg.sub_lowat) {
+        for(n = 0; n < cfg.nstripes; n++) {
+          if (cfg.stripes[n].fd == -1) continue;
+          if (do_subscriber(&cfg.stripes[n]) < 0) goto done;
+        }
+      }
+
       /* in module mode, run the module's periodic function */
       if ((cfg.mode == mode_lib) && cfg.modccr.mod_periodic) {
         if (cfg.modccr.mod_periodic(&cfg.modccr) < 0) {
@@ -230,89 +668,131 @@ int handle_signal(void) {
   return rc;
 }
 
-int close_client(void) {
-  int rc = -1, sc;
+/* drop a reference to a view; the last one frees it */
+void view_put(struct view *v) {
+  struct view **vp;
 
-  close(cfg.pub_fd);
-  cfg.pub_fd = -1;
-  cfg.encoding = cfg.startup_encoding;
+  assert(v->refcnt > 0);
+  if (--v->refcnt > 0) return;
 
-  /* stop monitoring ring */
-  sc = mod_epoll(0, cfg.fd);
-  if (sc < 0) goto done;
+  for(vp = &cfg.views; *vp != v; vp = &(*vp)->next) ;
+  *vp = v->next;
+  if (v->idx) free(v->idx);
+  if (v->cast) utstring_free(v->cast);
+  if (v->cc) cc_close(v->cc);
+  free(v);
+}
 
-  rc = 0;
+void batch_free(struct batch *b) {
+  int i;
 
- done:
-  return rc;
+  for(i = 0; i < codec_max; i++) if (b->z[i].buf) free(b->z[i].buf);
+  if (b->buf) free(b->buf);
+  if (b->iov) free(b->iov);
+  if (b->len) free(b->len);
+  if (b->bin) free(b->bin);
+  if (b->json) utstring_free(b->json);
+  free(b);
 }
 
-int handle_io(void) {
-  int rc = -1, sc, fl;
-  size_t len;
-  ssize_t nr;
-  char *out;
+/*
+ * batch_get
+ *
+ * take a batch from the free list, or allocate one
+ *
+ */
+struct batch *batch_get(void) {
+  struct batch *b = NULL;
+  int n;
 
-  switch (cfg.mode) {
+  if (cfg.free_batches) {
+    b = cfg.free_batches;
+    cfg.free_batches = b->next;
+    goto done;
+  }
 
-    case mode_read:
-      fl = CCR_BUFFER | CCR_JSON;
-      fl |= cfg.pretty ? CCR_PRETTY : 0;
-      sc = ccr_getnext(cfg.ccr, fl, &out, &len);
-      if (sc > 0) printf("%.*s\n", (int)len, out);
-      if (sc <= 0) {
-        fprintf(stderr, "ccr_getnext: %s (%d)\n",
-          (sc == 0) ? "end-of-data" : "error", sc);
-        goto done;
-      }
-      break;
+  b = calloc(1, sizeof(*b));
+  if (b == NULL) goto done;
+  b->buf = malloc(PUBBUFLEN);
+  b->iov = malloc(PUBNUMIOV * sizeof(struct iovec));
+  b->len = malloc(PUBNUMIOV * sizeof(uint32_t));
+  b->bin = malloc((PUBNUMIOV * 2 + 1) * sizeof(struct iovec));
+  utstring_new(b->json);
+  if (!b->buf || !b->iov || !b->len || !b->bin) {
+    batch_free(b);
+    b = NULL;
+  }
 
-    case mode_read_hex:
-      fl = CCR_BUFFER;
-      sc = ccr_getnext(cfg.ccr, fl, &out, &len);
-      if (sc > 0) hexdump(out, len);
-      if (sc <= 0) {
-        fprintf(stderr, "ccr_getnext: %s (%d)\n",
-          (sc == 0) ? "end-of-data" : "error", sc);
-        goto done;
-      }
-      break;
+ done:
+  if (b == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return NULL;
+  }
+  b->refcnt = 1;
+  b->next = NULL;
+  b->view = NULL;
+  b->derived = NULL;
+  b->sibling = NULL;
+  b->have_json = 0;
+  b->have_hdr = 0;
+  for(n = 0; n < codec_max; n++) b->z[n].state = z_none;
+  return b;
+}
 
-    case mode_lib:
-      if (cfg.modccr.mod_work == NULL) goto done;
-      if (cfg.modccr.mod_work(&cfg.modccr, cfg.ccr) < 0) {
-        fprintf(stderr,"module %s: exit\n", cfg.lib);
-        goto done;
-      }
-      break;
+/* drop a reference; the last one returns the batch to the free
+ * list, with the batches derived from it. a batch that lies in a
+ * ring read goes back to the sink with the read */
+void batch_put(struct batch *b) {
+  struct sink_batch *sb = b->sb;
+  struct batch *d;
+  int i;
+
+  assert(b->refcnt > 0);
+  if (--b->refcnt > 0) return;
+  while (b->derived) {
+    d = b->derived;
+    b->derived = d->sibling;
+    batch_put(d);
+  }
+  if (b->view) view_put(b->view);
+  b->view = NULL;
+  if (sb) {
+    for(i = 0; i < codec_max; i++) if (b->z[i].buf) free(b->z[i].buf);
+    if (b->json) utstring_free(b->json);
+    sink_ack(sb, sb->n); /* b is gone with it */
+    return;
+  }
+  b->next = cfg.free_batches;
+  cfg.free_batches = b;
+}
 
-    case mode_pub:
-      fl = CCR_BUFFER;
-      fl |= (cfg.encoding == enc_json)   ? (CCR_JSON | CCR_NEWLINE) : 0;
-      fl |= (cfg.encoding == enc_binary) ? (CCR_LEN4FIRST)          : 0;
-      sc = ccr_getnext(cfg.ccr, fl, &out, &len);
-      if (sc > 0) do {
-        nr = write(cfg.pub_fd, out, len);
-        if (nr < 0) {
-          fprintf(stderr, "write: %s\n", strerror(errno));
-          if (close_client() < 0) goto done;
-          break;
-        }
-        len -= nr;
-        out += nr;
-      } while (len > 0);
+/*
+ * batch_json
+ *
+ * encode the batch as newline-delimited JSON, once,
+ * however many json clients it is queued to
+ *
+ */
+int batch_json(struct batch *b) {
+  struct cc *cc;
+  int rc = -1, sc;
+  size_t i, len;
+  char *out;
 
-      if (sc < 0) {
-        fprintf(stderr, "ccr_getnext: error (%d)\n", sc);
-        goto done;
-      }
-      break;
+  if (b->have_json) return 0;
 
-    default:
-      assert(0);
-      goto done;
-      break;
+  cc = b->view ? b->view->cc : ccr_get_cc(cfg.ccr);
+  if (b->json == NULL) utstring_new(b->json);
+  utstring_clear(b->json);
+  for(i = 0; i < b->niov; i++) {
+    sc = cc_to_json(cc, &out, &len, b->iov[i].iov_base,
+                    b->iov[i].iov_len, CC_NEWLINE);
+    if (sc < 0) goto done;
+    utstring_bincpy(b->json, out, len);
   }
+  b->json_iov.iov_base = utstring_body(b->json);
+  b->json_iov.iov_len = utstring_len(b->json);
+  b->have_json = 1;
 
   rc = 0;
 
@@ -320,154 +800,2199 @@ int handle_io(void) {
   return rc;
 }
 
+/*
+ * batch_hdr
+ *
+ * make the sequenced protocol header, once; it goes
+ * in the slot ahead of the binary wire iovecs
+ *
+ */
+void batch_hdr(struct batch *b) {
+  struct batch_hdr *h = &b->hdr;
+  uint32_t crc = 0;
+  size_t i, len = 0;
 
-int load_module(void) {
-  int rc = -1;
+  if (b->have_hdr) return;
 
-  if (cfg.mode != mode_lib) {
-    rc = 0;
-    goto done;
-  }
-    
-  cfg.dl = dlopen(cfg.lib, RTLD_LAZY);
-  if (cfg.dl == NULL) {
-    fprintf(stderr, "%s\n", dlerror());
-    goto done;
+  for(i = 1; i <= b->niov * 2; i++) {
+    len += b->bin[i].iov_len;
+    if (cfg.pub_crc) crc = crc32c(crc, b->bin[i].iov_base, b->bin[i].iov_len);
   }
 
-  cfg.libinit = dlsym(cfg.dl, "ccr_module_init");
-  if (cfg.libinit == NULL) {
-    fprintf(stderr, "%s\n", dlerror());
-    goto done;
-  }
+  memset(h, 0, sizeof(*h));
+  h->magic = BATCH_MAGIC;
+  h->flags = cfg.pub_crc ? BATCH_CRC : 0;
+  h->flags |= (b->niov < b->span) ? BATCH_SUBSET : 0;
+  h->seq = b->seq;
+  h->frames = b->span;
+  h->len = len;
+  h->crc = crc;
+  b->bin[0].iov_base = h;
+  b->bin[0].iov_len = sizeof(*h);
+  b->have_hdr = 1;
+}
 
-  cfg.modccr.verbose = cfg.verbose;
-  cfg.modccr.opts = cfg.libopts;
+/*
+ * the wire form of a batch in the client's encoding,
+ * or NULL if its compressed form is not ready yet
+ */
+struct iovec *batch_wire(struct batch *b, struct client *c, size_t *n) {
+  struct zform *z;
 
-  if (cfg.libinit(&cfg.modccr) < 0) {
-    fprintf(stderr, "%s: module init failed\n", cfg.lib);
-    goto done;
+  if (c->encoding == enc_json) {
+    *n = 1;
+    return &b->json_iov;
   }
-
-  rc = 0;
-
- done:
-  return rc;
+  if (c->codec) {
+    z = &b->z[c->codec];
+    *n = 2;
+    return (z->state == z_ready) ? z->iov : NULL;
+  }
+  if (c->encoding == enc_seq) {
+    *n = b->niov * 2 + 1;
+    return b->bin;
+  }
+  *n = b->niov * 2;
+  return b->bin + 1;
 }
 
 /*
- * parse_spec
- *
- * parse [<ip|hostname>]:<port>, populate sockaddr_in
- *
- * if there was no IP/hostname, ip is set to INADDR_ANY
- * port is required, or the function fails
- *
- * returns 
- *  0 success
- * -1 error
+ * codec helpers. a codec that was not built in
+ * fails, and the batch goes uncompressed instead
  *
  */
-int parse_spec(char *spec, struct sockaddr_in *sa) {
-  char *colon=NULL, *p, *h;
-  struct hostent *e;
-  int rc = -1, port;
-  uint32_t s_addr;
+int codec_flag(int codec) {
+  return (codec == codec_lz4)  ? BATCH_LZ4  :
+         (codec == codec_zstd) ? BATCH_ZSTD : 0;
+}
 
-  memset(sa, 0, sizeof(*sa));
+int codec_available(int codec) {
+#ifdef HAVE_LZ4
+  if (codec == codec_lz4) return 1;
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == codec_zstd) return 1;
+#endif
+  return 0;
+}
 
-  colon = strchr(spec, ':');
-  h = colon ? spec : NULL;
-  p = colon ? colon+1 : spec;
+size_t codec_bound(int codec, size_t len) {
+#ifdef HAVE_LZ4
+  if (codec == codec_lz4) return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == codec_zstd) return ZSTD_compressBound(len);
+#endif
+  return 0;
+}
 
-  if (colon) *colon = '\0';
-  e = h ? gethostbyname(h) : NULL;
-  if (h && (!e || !e->h_length)) {
-    fprintf(stderr, "%s: %s\n", h, hstrerror(h_errno));
-    goto done;
+/* returns compressed length, or 0 on failure */
+size_t codec_compress(int codec, char *in, size_t len,
+                      char *out, size_t outlen) {
+  size_t rc = 0;
+#ifdef HAVE_LZ4
+  int n;
+  if (codec == codec_lz4) {
+    n = (cfg.zlevel > 1) ?
+      LZ4_compress_HC(in, out, len, outlen, cfg.zlevel) :
+      LZ4_compress_default(in, out, len, outlen);
+    rc = (n > 0) ? (size_t)n : 0;
   }
-
-  port = atoi(p);
-  if ((port <= 0) || (port > 65535)) {
-    fprintf(stderr, "%s: not a port number\n", p);
-    goto done;
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == codec_zstd) {
+    rc = ZSTD_compress(out, outlen, in, len, cfg.zlevel ? cfg.zlevel : 3);
+    if (ZSTD_isError(rc)) rc = 0;
   }
+#endif
+  return rc;
+}
 
-  sa->sin_family      = AF_INET;
-  sa->sin_port        = htons(port);
-  sa->sin_addr.s_addr = htonl(INADDR_ANY);
-  if (h) memcpy(&sa->sin_addr.s_addr, e->h_addr, e->h_length);
+/* returns decompressed length, or -1 on failure */
+ssize_t codec_decompress(int flags, char *in, size_t len,
+                         char *out, size_t outlen) {
+  ssize_t rc = -1;
+#ifdef HAVE_LZ4
+  if (flags & BATCH_LZ4) {
+    rc = LZ4_decompress_safe(in, out, len, outlen);
+    if (rc < 0) rc = -1;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  size_t n;
+  if (flags & BATCH_ZSTD) {
+    n = ZSTD_decompress(out, outlen, in, len);
+    rc = ZSTD_isError(n) ? -1 : (ssize_t)n;
+  }
+#endif
+  return rc;
+}
 
-  if (cfg.verbose) {
-    fprintf(stderr, "%s -> IP %s port %d\n",
-      spec, inet_ntoa(sa->sin_addr), port);
+/*
+ * zcompress
+ *
+ * on the compression thread: make the compressed form of a
+ * batch. the binary wire of its frames is gathered into one
+ * block in the thread's scratch buffer and compressed whole.
+ * if it does not shrink, the block itself is sent.
+ *
+ */
+int zcompress(struct zform *z, char **scratch, size_t *scratch_len) {
+  struct batch *b = z->b;
+  struct batch_hdr *h = &z->hdr;
+  size_t i, len = 0, bound, zlen = 0;
+  int rc = -1;
+  char *p;
+
+  /* gather the block */
+  if (*scratch_len < b->rawlen) {
+    p = realloc(*scratch, b->rawlen);
+    if (p == NULL) goto done;
+    *scratch = p;
+    *scratch_len = b->rawlen;
+  }
+  for(i = 1; i <= b->niov * 2; i++) {
+    memcpy(*scratch + len, b->bin[i].iov_base, b->bin[i].iov_len);
+    len += b->bin[i].iov_len;
+  }
+  assert(len == b->rawlen);
+
+  bound = codec_bound(z->codec, len);
+  if (bound < len) bound = len;
+  if (bound > z->size) {
+    p = realloc(z->buf, bound);
+    if (p == NULL) goto done;
+    z->buf = p;
+    z->size = bound;
+  }
+  zlen = codec_compress(z->codec, *scratch, len, z->buf, z->size);
+
+  memset(h, 0, sizeof(*h));
+  h->magic = BATCH_MAGIC;
+  h->flags = (b->niov < b->span) ? BATCH_SUBSET : 0;
+  h->seq = b->seq;
+  h->frames = b->span;
+  if (cfg.pub_crc) {
+    h->flags |= BATCH_CRC;
+    h->crc = crc32c(0, *scratch, len);
   }
+  if (zlen && (zlen < len)) {
+    h->flags |= codec_flag(z->codec);
+    h->len = zlen;
+    h->raw = len;
+  } else {
+    memcpy(z->buf, *scratch, len); /* incompressible; send as is */
+    h->len = len;
+  }
+  z->iov[0].iov_base = h;
+  z->iov[0].iov_len = sizeof(*h);
+  z->iov[1].iov_base = z->buf;
+  z->iov[1].iov_len = h->len;
 
   rc = 0;
 
  done:
-  if (colon) *colon = ':';
   return rc;
 }
 
-int proto_sendcast(void) {
-  struct shr *shr = NULL;
-  char *fmt=NULL, *f;
-  int rc = -1, sc;
-  size_t fmt_len;
-  uint32_t len32;
+/* compression thread */
+void *zthread(void *arg) {
+  size_t scratch_len = 0;
+  char *scratch = NULL;
+  uint64_t one = 1;
+  struct zform *z;
   ssize_t nr;
 
-  assert(cfg.mode == mode_pub);
-  assert(cfg.encoding == enc_proto);
+  (void)arg;
 
-  shr = shr_open(cfg.ring, SHR_RDONLY);
-  if (shr == NULL) goto done;
+  pthread_mutex_lock(&cfg.zlock);
+  while (1) {
+    while ((cfg.zstop == 0) && (cfg.ztodo == NULL))
+      pthread_cond_wait(&cfg.zcond, &cfg.zlock);
+    if (cfg.zstop) break;
 
-  fmt = NULL;
-  fmt_len = 0;
-  sc = shr_appdata(shr, (void**)&fmt, NULL, &fmt_len);
-  if (sc < 0) {
-    fprintf(stderr, "shr_appdata: error %d\n", sc);
-    goto done;
-  }
+    z = cfg.ztodo;
+    cfg.ztodo = z->next;
+    if (cfg.ztodo == NULL) cfg.ztodo_tail = NULL;
+    pthread_mutex_unlock(&cfg.zlock);
 
-  assert(fmt && fmt_len);
+    z->err = zcompress(z, &scratch, &scratch_len);
 
-  /* send 32-bit length prefix then the cast format */
-  len32 = (uint32_t)fmt_len;
-  nr = write(cfg.pub_fd, &len32, sizeof(len32));
-  if (nr < 0) {
-    fprintf(stderr, "write: %s\n", strerror(errno));
-    goto done;
+    pthread_mutex_lock(&cfg.zlock);
+    z->next = cfg.zdone;
+    cfg.zdone = z;
+    nr = write(cfg.zevent_fd, &one, sizeof(one));
+    if (nr < 0) fprintf(stderr, "write: %s\n", strerror(errno));
   }
-  assert (nr == sizeof(len32)); /* TODO drain */
-  f = fmt;
-  do {
-    nr = write(cfg.pub_fd, f, len32);
-    if (nr < 0) {
-      fprintf(stderr, "write: %s\n", strerror(errno));
-      goto done;
-    }
-    f += nr;
-    len32 -= nr;
-  } while (len32 > 0);
+  pthread_mutex_unlock(&cfg.zlock);
 
-  rc = 0;
-
- done:
-  if (fmt) free(fmt);
-  if (shr) shr_close(shr);
-  return rc;
+  if (scratch) free(scratch);
+  return NULL;
 }
 
 /*
- * given a buffer of N frames 
- * with a possible partial final frame
- * find message boundaries and write to ring
- * saving the last frame prefix if partial
+ * batch_z
+ *
+ * have the compression thread make a batch's compressed form
+ * for a codec, unless it exists or is in progress. the job
+ * holds a reference to the batch until handle_zdone
+ *
  */
-int decode_frames(void) {
+void batch_z(struct batch *b, int codec) {
+  struct zform *z = &b->z[codec];
+
+  if (z->state != z_none) return;
+
+  z->state = z_busy;
+  z->b = b;
+  z->codec = codec;
+  z->next = NULL;
+  b->refcnt++;
+
+  pthread_mutex_lock(&cfg.zlock);
+  if (cfg.ztodo_tail) cfg.ztodo_tail->next = z;
+  else cfg.ztodo = z;
+  cfg.ztodo_tail = z;
+  pthread_cond_signal(&cfg.zcond);
+  pthread_mutex_unlock(&cfg.zlock);
+}
+
+/*
+ * setup_zthread
+ *
+ * start the compression thread, and the eventfd
+ * it uses to wake the epoll loop. this is done
+ * when the first client asks for a codec
+ *
+ */
+int setup_zthread(void) {
+  int rc = -1, sc;
+
+  if (cfg.zthread_started) return 0;
+
+  cfg.zevent_fd = eventfd(0, EFD_NONBLOCK);
+  if (cfg.zevent_fd < 0) {
+    fprintf(stderr, "eventfd: %s\n", strerror(errno));
+    goto done;
+  }
+
+  sc = new_epoll(EPOLLIN, cfg.zevent_fd);
+  if (sc < 0) goto done;
+
+  sc = pthread_create(&cfg.zthread, NULL, zthread, NULL);
+  if (sc) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(sc));
+    goto done;
+  }
+  cfg.zthread_started = 1;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* the uncompressed size of a batch as sent to this client */
+size_t batch_len(struct batch *b, struct client *c) {
+  if (c->encoding == enc_json) return b->json_iov.iov_len;
+  if (c->encoding == enc_seq) return sizeof(struct batch_hdr) + b->rawlen;
+  return b->rawlen;
+}
+
+/* write out iovecs at a file offset, IOV_MAX at a time */
+int spill_pwritev(int fd, struct iovec *iov, size_t n, off_t off) {
+  size_t i, want;
+  ssize_t nr;
+  int k;
+
+  while (n) {
+    k = (n > IOV_MAX) ? IOV_MAX : n;
+    for(want = 0, i = 0; i < (size_t)k; i++) want += iov[i].iov_len;
+    nr = pwritev(fd, iov, k, off);
+    if (nr < 0) {
+      fprintf(stderr, "pwritev: %s\n", strerror(errno));
+      return -1;
+    }
+    if ((size_t)nr != want) {
+      fprintf(stderr, "pwritev: short write\n");
+      return -1;
+    }
+    off += nr;
+    iov += k;
+    n -= k;
+  }
+  return 0;
+}
+
+/*
+ * spill_write
+ *
+ * append a batch leaving the replay history to the spill, so
+ * that a client reconnecting after a longer outage can still
+ * replay it. a spill that cannot be written is turned off;
+ * replay then reaches back only as far as the history.
+ *
+ */
+void spill_write(struct batch *b) {
+  struct iovec iov[2];
+  struct spill_rec r;
+  size_t len;
+  int k;
+
+  r.seq = b->seq;
+  r.num = b->num;
+  r.frames = b->niov;
+  r.len = b->rawlen - b->niov * sizeof(uint32_t);
+  len = sizeof(r) + b->rawlen;
+
+  k = cfg.spill_gen % 2;
+  if (cfg.spill_len[k] && (cfg.spill_len[k] + len > cfg.spill_max / 2)) {
+    cfg.spill_gen++;
+    k = cfg.spill_gen % 2;
+    if (ftruncate(cfg.spill_fd[k], 0) < 0) {
+      fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+      goto fail;
+    }
+    cfg.spill_len[k] = 0;
+  }
+
+  iov[0].iov_base = &r;
+  iov[0].iov_len = sizeof(r);
+  iov[1].iov_base = b->len;
+  iov[1].iov_len = b->niov * sizeof(uint32_t);
+  if (spill_pwritev(cfg.spill_fd[k], iov, 2, cfg.spill_len[k]) < 0) goto fail;
+  if (spill_pwritev(cfg.spill_fd[k], b->iov, b->niov,
+                    cfg.spill_len[k] + sizeof(r) + iov[1].iov_len) < 0)
+    goto fail;
+
+  cfg.spill_len[k] += len;
+  return;
+
+ fail:
+  fprintf(stderr, "spill: disabled\n");
+  cfg.spill_max = 0;
+}
+
+/* create the two spill segments beside the ring */
+int setup_spill(void) {
+  char path[PATH_MAX];
+  int rc = -1, k;
+
+  for(k = 0; k < 2; k++) {
+    snprintf(path, sizeof(path), "%s.spill.%d", cfg.ring, k);
+    cfg.spill_fd[k] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (cfg.spill_fd[k] < 0) {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+      goto done;
+    }
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* close and remove the spill segments */
+void spill_close(void) {
+  char path[PATH_MAX];
+  int k;
+
+  for(k = 0; k < 2; k++) {
+    if (cfg.spill_fd[k] == -1) continue;
+    close(cfg.spill_fd[k]);
+    cfg.spill_fd[k] = -1;
+    snprintf(path, sizeof(path), "%s.spill.%d", cfg.ring, k);
+    unlink(path);
+  }
+}
+
+/*
+ * hist_push
+ *
+ * keep the last -Q batches read, so a
+ * client can ask to replay from them.
+ * with -W, older ones go to the spill
+ *
+ */
+void hist_push(struct batch *b) {
+  if (cfg.hist_used == cfg.pub_maxq) {
+    if (cfg.spill_max) spill_write(cfg.hist[cfg.hist_head]);
+    batch_put(cfg.hist[cfg.hist_head]);
+    cfg.hist_head = (cfg.hist_head + 1) % PUBMAXQ;
+    cfg.hist_used--;
+  }
+  cfg.hist[(cfg.hist_head + cfg.hist_used) % PUBMAXQ] = b;
+  cfg.hist_used++;
+  b->refcnt++;
+}
+
+/* lay out the binary wire (length prefix, frame, ...) of the frames */
+void batch_bin(struct batch *b) {
+  size_t i;
+
+  for(i = 0; i < b->niov; i++) {
+    b->len[i] = (uint32_t)b->iov[i].iov_len;
+    b->bin[2*i+1].iov_base = &b->len[i];
+    b->bin[2*i+1].iov_len = sizeof(uint32_t);
+    b->bin[2*i+2] = b->iov[i];
+  }
+}
+
+/* the ring's cast text; caller frees it */
+int ring_cast(char **fmt, size_t *fmt_len) {
+  struct shr *shr;
+  int rc = -1, sc;
+
+  *fmt = NULL;
+  *fmt_len = 0;
+
+  shr = shr_open(cfg.ring, SHR_RDONLY);
+  if (shr == NULL) goto done;
+
+  sc = shr_appdata(shr, (void**)fmt, NULL, fmt_len);
+  if (sc < 0) {
+    fprintf(stderr, "shr_appdata: error %d\n", sc);
+    goto done;
+  }
+
+  assert(*fmt && *fmt_len);
+  rc = 0;
+
+ done:
+  if (shr) shr_close(shr);
+  return rc;
+}
+
+/*
+ * view_operand
+ *
+ * parse the predicate operand for the type of its field
+ * into the form the field takes in a frame (or a number)
+ *
+ */
+int view_operand(struct view *v, char *val) {
+  struct in6_addr a6;
+  unsigned char *m;
+  size_t len;
+  char *end;
+  int sc;
+
+  len = strlen(val);
+  if ((len >= 2) && (val[0] == '"') && (val[len-1] == '"')) {
+    val[len-1] = '\0';
+    val++;
+    len -= 2;
+  }
+
+  switch (v->pf_type) {
+    case CC_i8:
+    case CC_i16:
+    case CC_u16:
+    case CC_i32:
+    case CC_d64:
+      v->num = strtod(val, &end);
+      if ((end == val) || *end) return -1;
+      return 0;
+    case CC_str:
+    case CC_str8:
+      memcpy(v->val, val, len);
+      v->val_len = len;
+      return 0;
+    default:
+      break;
+  }
+
+  /* the rest compare only for equality */
+  if ((v->op != op_eq) && (v->op != op_ne)) return -1;
+
+  switch (v->pf_type) {
+    case CC_ipv4:
+      sc = inet_pton(AF_INET, val, v->val);
+      v->val_len = 4;
+      return (sc == 1) ? 0 : -1;
+    case CC_ipv46:
+      sc = inet_pton(AF_INET, val, &a6);
+      v->val[0] = (sc == 1) ? 4 : 16;
+      if (sc != 1) sc = inet_pton(AF_INET6, val, &a6);
+      memcpy(&v->val[1], &a6, v->val[0]);
+      v->val_len = 1 + v->val[0];
+      return (sc == 1) ? 0 : -1;
+    case CC_mac:
+      m = (unsigned char*)v->val;
+      sc = sscanf(val, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                  &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]);
+      v->val_len = 6;
+      return (sc == 6) ? 0 : -1;
+    default:
+      return -1;
+  }
+}
+
+/* position of the named field in the cast, or -1 */
+int cast_field(struct cc *cc, char *fname) {
+  cc_type type;
+  char *name;
+  int i;
+
+  for(i = 0; cc_field(cc, i, &name, &type) == 0; i++) {
+    if (!strcmp(name, fname)) return i;
+  }
+
+  return -1;
+}
+
+/*
+ * view_new
+ *
+ * make a view from a field list (comma separated) and predicate
+ * (field op value) against the ring cast. the derived cast has
+ * the projected fields, in the order asked. the predicate field
+ * need not be projected.
+ *
+ */
+struct view *view_new(char *proj, char *filt) {
+  char val[SPECMAX], fname[SPECMAX], *p, *tok, *save, *name;
+  struct cc *cc = ccr_get_cc(cfg.ccr);
+  int rc = -1, n, i, k;
+  struct view *v = NULL;
+  cc_type type;
+  size_t len;
+  static struct { char *s; int op; } ops[] = {
+    {"==", op_eq}, {"!=", op_ne}, {"<=", op_le}, {">=", op_ge},
+    {"<",  op_lt}, {">",  op_gt}, {"=",  op_eq},
+  };
+
+  v = calloc(1, sizeof(*v));
+  if (v == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
+  v->refcnt = 1;
+  v->pf = -1;
+  strcpy(v->proj, proj);
+  strcpy(v->filt, filt);
+  utstring_new(v->cast);
+
+  n = cc_count(cc);
+  v->idx = calloc(n, sizeof(*v->idx));
+  if (v->idx == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
+
+  /* projection */
+  strcpy(val, proj);
+  for(tok = strtok_r(val, ", \t", &save); tok;
+      tok = strtok_r(NULL, ", \t", &save)) {
+    i = cast_field(cc, tok);
+    if (i < 0) {
+      fprintf(stderr, "projection: no field %s\n", tok);
+      goto done;
+    }
+    for(k = 0; k < v->nidx; k++) if (v->idx[k] == i) break;
+    if (k < v->nidx) {
+      fprintf(stderr, "projection: %s repeated\n", tok);
+      goto done;
+    }
+    v->idx[v->nidx++] = i;
+  }
+  if (v->nidx == 0) {
+    free(v->idx);
+    v->idx = NULL;
+  }
+
+  /* the derived cast, as the frames are flattened */
+  for(k = 0; k < (v->idx ? v->nidx : n); k++) {
+    cc_field(cc, v->idx ? v->idx[k] : k, &name, &type);
+    utstring_printf(v->cast, "%s %s\n", cc_types[type], name);
+  }
+
+  /* predicate */
+  p = filt;
+  while (isspace(*p)) p++;
+  for(len = 0; *p && !isspace(*p) && !strchr("=!<>", *p); p++) {
+    if (len + 1 < sizeof(fname)) fname[len++] = *p;
+  }
+  fname[len] = '\0';
+  if ((len == 0) && *p) {
+    fprintf(stderr, "filter: %s: no field\n", filt);
+    goto done;
+  }
+  if (len) {
+    i = cast_field(cc, fname);
+    if (i < 0) {
+      fprintf(stderr, "filter: no field %s\n", fname);
+      goto done;
+    }
+    cc_field(cc, i, &name, &type);
+    v->pf = i;
+    v->pf_type = type;
+    while (isspace(*p)) p++;
+    for(k = 0; k < (int)(sizeof(ops)/sizeof(*ops)); k++) {
+      if (!strncmp(p, ops[k].s, strlen(ops[k].s))) break;
+    }
+    if (k == (int)(sizeof(ops)/sizeof(*ops))) {
+      fprintf(stderr, "filter: %s: no operator\n", filt);
+      goto done;
+    }
+    v->op = ops[k].op;
+    p += strlen(ops[k].s);
+    while (isspace(*p)) p++;
+    strcpy(val, p);
+    for(len = strlen(val); len && isspace(val[len-1]); len--) val[len-1] = '\0';
+    if (view_operand(v, val) < 0) {
+      fprintf(stderr, "filter: %s: bad operand for %s field\n", filt,
+        cc_types[v->pf_type]);
+      goto done;
+    }
+  }
+
+  v->cc = cc_open(utstring_body(v->cast), CC_BUFFER, utstring_len(v->cast));
+  if (v->cc == NULL) goto done;
+
+  rc = 0;
+
+ done:
+  if ((rc < 0) && v) {
+    if (v->idx) free(v->idx);
+    if (v->cast) utstring_free(v->cast);
+    free(v);
+    v = NULL;
+  }
+  return v;
+}
+
+/* share the view with these specs, or make it */
+struct view *view_get(char *proj, char *filt) {
+  struct view *v;
+
+  for(v = cfg.views; v; v = v->next) {
+    if (strcmp(v->proj, proj) || strcmp(v->filt, filt)) continue;
+    v->refcnt++;
+    return v;
+  }
+
+  v = view_new(proj, filt);
+  if (v == NULL) return NULL;
+  v->next = cfg.views;
+  cfg.views = v;
+  return v;
+}
+
+/* compare two byte strings as memcmp, shorter first on a tie */
+int bytes_cmp(char *a, size_t alen, char *b, size_t blen) {
+  int sc;
+
+  sc = memcmp(a, b, (alen < blen) ? alen : blen);
+  if (sc) return sc;
+  return (alen < blen) ? -1 : (alen > blen) ? 1 : 0;
+}
+
+/* does the frame, as dissected, satisfy the view predicate */
+int view_match(struct view *v, struct cc_map *map) {
+  char *a = map[v->pf].addr;
+  int8_t i8;
+  int16_t i16;
+  uint16_t u16;
+  int32_t i32;
+  uint32_t u32;
+  uint8_t u8;
+  double d = 0;
+  int cmp;
+
+  switch (v->pf_type) {
+    case CC_i8:  memcpy(&i8,  a, sizeof(i8));  d = i8;  break;
+    case CC_i16: memcpy(&i16, a, sizeof(i16)); d = i16; break;
+    case CC_u16: memcpy(&u16, a, sizeof(u16)); d = u16; break;
+    case CC_i32: memcpy(&i32, a, sizeof(i32)); d = i32; break;
+    case CC_d64: memcpy(&d,   a, sizeof(d));            break;
+    default: break;
+  }
+
+  switch (v->pf_type) {
+    case CC_str:
+      memcpy(&u32, a, sizeof(u32));
+      cmp = bytes_cmp(a + sizeof(u32), u32, v->val, v->val_len);
+      break;
+    case CC_str8:
+      memcpy(&u8, a, sizeof(u8));
+      cmp = bytes_cmp(a + sizeof(u8), u8, v->val, v->val_len);
+      break;
+    case CC_ipv4:
+    case CC_mac:
+      cmp = memcmp(a, v->val, v->val_len);
+      break;
+    case CC_ipv46:
+      memcpy(&u8, a, sizeof(u8));
+      cmp = bytes_cmp(a, 1 + u8, v->val, v->val_len);
+      break;
+    default:
+      cmp = (d < v->num) ? -1 : (d > v->num) ? 1 : 0;
+      break;
+  }
+
+  switch (v->op) {
+    case op_eq: return cmp == 0;
+    case op_ne: return cmp != 0;
+    case op_lt: return cmp <  0;
+    case op_le: return cmp <= 0;
+    case op_gt: return cmp >  0;
+    case op_ge: return cmp >= 0;
+    default: assert(0); return 0;
+  }
+}
+
+/*
+ * view_batch
+ *
+ * the batch derived from src through a view; made on first use
+ * and kept with src, for the other clients of that view and for
+ * replay. each frame is dissected in place; the ones passing the
+ * predicate are copied to the derived batch, whole or as their
+ * projected field slices. the derived batch keeps the sequence
+ * numbers of src; filtered, it spans more frames than it has.
+ *
+ */
+struct batch *view_batch(struct view *v, struct batch *src) {
+  struct cc *cc = ccr_get_cc(cfg.ccr);
+  size_t i, off = 0, n = 0, len;
+  struct cc_map *map;
+  struct batch *d;
+  char *f, *s, *e;
+  int count, k, j;
+
+  for(d = src->derived; d; d = d->sibling) {
+    if (d->view == v) return d;
+  }
+
+  d = batch_get();
+  if (d == NULL) return NULL;
+
+  for(i = 0; i < src->niov; i++) {
+    f = src->iov[i].iov_base;
+    len = src->iov[i].iov_len;
+    if (cc_dissect(cc, &map, &count, f, len, 0) < 0) {
+      fprintf(stderr, "frame %lu: cannot dissect\n",
+        (unsigned long)(src->seq + i));
+      batch_put(d);
+      return NULL;
+    }
+    if ((v->pf >= 0) && (view_match(v, map) == 0)) continue;
+
+    s = d->buf + off;
+    if (v->idx == NULL) {
+      memcpy(s, f, len);
+      off += len;
+    } else {
+      for(k = 0; k < v->nidx; k++) {
+        j = v->idx[k];
+        e = (j + 1 < count) ? (char*)map[j+1].addr : f + len;
+        memcpy(d->buf + off, map[j].addr, e - (char*)map[j].addr);
+        off += e - (char*)map[j].addr;
+      }
+    }
+    d->iov[n].iov_base = s;
+    d->iov[n].iov_len = d->buf + off - s;
+    n++;
+  }
+
+  d->niov = n;
+  d->span = src->niov;
+  d->seq = src->seq;
+  d->rawlen = n * sizeof(uint32_t) + off;
+  batch_bin(d);
+
+  d->view = v;
+  v->refcnt++;
+  d->sibling = src->derived;
+  src->derived = d;
+  return d;
+}
+
+/* make the client's view, if it asked for one */
+int client_view(struct client *c) {
+  if (c->view) return 0;
+  if ((c->proj[0] == '\0') && (c->filt[0] == '\0')) return 0;
+
+  c->view = view_get(c->proj, c->filt);
+  if (c->view == NULL) {
+    fprintf(stderr, "client %s: bad projection or filter\n", c->addr);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* clients that have chosen an encoding and get frames */
+int streaming(struct client *c) {
+  return c->used && (c->encoding != enc_proto);
+}
+
+/*
+ * pub_can_read
+ *
+ * the ring is read when some client is streaming, except
+ * under the block policy, while any client's queue is full,
+ * or while the history and the queues hold every ring read
+ *
+ */
+int pub_can_read(void) {
+  int n, any = 0;
+  struct client *c;
+
+  /* every read is still held; see PUB_READS */
+  if (cfg.sr->in_flight == cfg.sink.nbatch) return 0;
+
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    c = &cfg.clients[n];
+    if (streaming(c) == 0) continue;
+    if ((cfg.slow == slow_block) && (c->q_used == cfg.pub_maxq)) return 0;
+    any = 1;
+  }
+
+  return any;
+}
+
+/* poll the ring or stop polling it, as pub_can_read says */
+int pub_rewatch(void) {
+  int want, sc;
+
+  want = pub_can_read();
+  if (want == cfg.ring_watched) return 0;
+
+  sc = mod_epoll(want ? EPOLLIN : 0, cfg.fd);
+  if (sc < 0) return -1;
+
+  cfg.ring_watched = want;
+  return 0;
+}
+
+/* poll a client for room to send, or stop */
+int client_watch(struct client *c, int pollout) {
+  int sc;
+
+  if (pollout == c->pollout) return 0;
+
+  sc = mod_epoll(EPOLLIN | (pollout ? EPOLLOUT : 0), c->fd);
+  if (sc < 0) return -1;
+
+  c->pollout = pollout;
+  return 0;
+}
+
+/*
+ * close_client
+ *
+ * drop a client and its queue. zerocopy pages the kernel
+ * still holds only reach the closed socket.
+ *
+ */
+int close_client(struct client *c) {
+  int rc = -1, sc;
+  struct qent *e;
+
+  fprintf(stderr, "client %s: disconnected", c->addr);
+  if (c->drops) fprintf(stderr, " (%lu batches dropped)", c->drops);
+  fprintf(stderr, "\n");
+
+  close(c->fd);
+  while (c->q_used) {
+    e = &c->q[c->q_head];
+    batch_put(e->b);
+    c->q_head = (c->q_head + 1) % PUBMAXQ;
+    c->q_used--;
+  }
+  if (c->view) view_put(c->view);
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+
+  /* stop monitoring ring if no one is left */
+  sc = pub_rewatch();
+  if (sc < 0) goto done;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * client_enqueue
+ *
+ * queue a batch to a client, applying the slow client
+ * policy if its queue is full. a stripe client gets only
+ * its share of the batches. a client with a view gets
+ * the batch derived through it; if the filter passed no
+ * frames, only a sequenced client gets the (empty) batch.
+ *
+ * returns
+ *  0 success (queued or dropped)
+ * -1 client must be disconnected
+ */
+int client_enqueue(struct client *c, struct batch *b) {
+  struct qent *e;
+
+  if (c->nstripes && ((b->num % c->nstripes) != (uint64_t)c->stripe))
+    return 0;
+
+  if (c->q_used == cfg.pub_maxq) {
+    assert(cfg.slow != slow_block); /* ring read is held instead */
+    if (cfg.slow == slow_disconnect) {
+      fprintf(stderr, "client %s: too slow\n", c->addr);
+      return -1;
+    }
+    c->drops++;
+    return 0;
+  }
+
+  if (c->view) {
+    b = view_batch(c->view, b);
+    if (b == NULL) return -1;
+    if ((b->niov == 0) && (c->encoding != enc_seq)) return 0;
+  }
+
+  if ((c->encoding == enc_json) && (batch_json(b) < 0)) return -1;
+  if (c->codec) batch_z(b, c->codec);
+  else if (c->encoding == enc_seq) batch_hdr(b);
+
+  e = &c->q[(c->q_head + c->q_used) % PUBMAXQ];
+  memset(e, 0, sizeof(*e));
+  e->b = b;
+  b->refcnt++;
+  c->q_used++;
+  return 0;
+}
+
+/*
+ * client_send
+ *
+ * send the client's unsent batches without blocking, gathering
+ * across batches up to IOV_MAX iovecs per sendmsg. sends are marked
+ * MSG_MORE (or the socket is corked) so consecutive batches pack
+ * into full segments; client_push releases the tail. big sends go
+ * as MSG_ZEROCOPY if enabled; the batches they touched stay queued
+ * until the completions are reaped (see client_reap). a batch whose
+ * compressed form is not ready yet holds up the rest of the queue.
+ *
+ * returns
+ *  2 sent up to a batch still being compressed
+ *  1 queue sent
+ *  0 socket full
+ * -1 error
+ */
+int client_send(struct client *c) {
+  struct iovec iov[IOV_MAX], *w;
+  size_t n, i, j, cnt, len, left;
+  struct msghdr msg;
+  struct qent *e;
+  int fl, zc;
+  ssize_t nr;
+
+  while (c->q_send < c->q_used) {
+
+    /* gather from the cursor on */
+    n = 0;
+    len = 0;
+    for(i = c->q_send; (i < c->q_used) && (n < IOV_MAX); i++) {
+      e = &c->q[(c->q_head + i) % PUBMAXQ];
+      w = batch_wire(e->b, c, &cnt);
+      if (w == NULL) break;
+      for(j = (i == c->q_send) ? c->iov_idx : 0; (j < cnt) && (n < IOV_MAX); j++) {
+        iov[n] = w[j];
+        if ((i == c->q_send) && (j == c->iov_idx)) {
+          iov[n].iov_base = (char*)iov[n].iov_base + c->iov_off;
+          iov[n].iov_len -= c->iov_off;
+        }
+        len += iov[n].iov_len;
+        n++;
+      }
+    }
+
+    if (n == 0) return 2;
+    zc = c->zc_on && (len >= cfg.zc_min);
+
+   again:
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    fl = MSG_DONTWAIT | MSG_NOSIGNAL;
+    fl |= (cfg.cork || c->local) ? 0 : MSG_MORE;
+    fl |= zc ? MSG_ZEROCOPY : 0;
+    nr = sendmsg(c->fd, &msg, fl);
+    if ((nr < 0) && zc && (errno == ENOBUFS)) {
+      zc = 0; /* out of optmem; copy instead */
+      goto again;
+    }
+    if (nr < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+      fprintf(stderr, "client %s: sendmsg: %s\n", c->addr, strerror(errno));
+      return -1;
+    }
+    if (zc) c->zc_sent++;
+    c->held = 1;
+    cfg.wire_bytes += nr;
+
+    /* advance the cursor over what was sent */
+    while (c->q_send < c->q_used) {
+      e = &c->q[(c->q_head + c->q_send) % PUBMAXQ];
+      if (zc) {
+        e->zc = 1;
+        e->zc_last = c->zc_sent - 1;
+      }
+      w = batch_wire(e->b, c, &cnt);
+      if (w == NULL) break;
+      while (c->iov_idx < cnt) {
+        left = w[c->iov_idx].iov_len - c->iov_off;
+        if ((size_t)nr < left) break;
+        nr -= left;
+        c->iov_off = 0;
+        c->iov_idx++;
+      }
+      if (c->iov_idx < cnt) {
+        c->iov_off += nr;
+        break;
+      }
+      cfg.raw_bytes += batch_len(e->b, c);
+      c->q_send++;
+      c->iov_idx = 0;
+      c->iov_off = 0;
+      if (nr == 0) break;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * client_release
+ *
+ * dequeue sent batches, once any zerocopy sends of them complete
+ *
+ */
+void client_release(struct client *c) {
+  struct qent *e;
+
+  while (c->q_send > 0) {
+    e = &c->q[c->q_head];
+    if (e->zc && ((int32_t)(c->zc_done - e->zc_last) <= 0)) break;
+    batch_put(e->b);
+    c->q_head = (c->q_head + 1) % PUBMAXQ;
+    c->q_used--;
+    c->q_send--;
+  }
+}
+
+/*
+ * client_push
+ *
+ * nothing left to send; release any coalesced partial segment
+ *
+ */
+int client_push(struct client *c) {
+  int rc = -1, sc, zero = 0, one = 1;
+
+  if (c->held == 0) return 0;
+
+  if (c->local) {
+    sc = 0; /* a unix domain socket holds nothing back */
+  } else if (cfg.cork) {
+    /* uncorking pushes the tail; cork again for the next burst */
+    sc = setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+    if (sc == 0)
+      sc = setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+  } else {
+    /* setting TCP_NODELAY flushes what MSG_MORE held back */
+    sc = setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (sc < 0) {
+    fprintf(stderr, "setsockopt: %s\n", strerror(errno));
+    goto done;
+  }
+
+  c->held = 0;
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * spill_next
+ *
+ * read the next spilled batch holding frames from the client's
+ * replay point, into a batch of its own. the cursor survives
+ * between calls, unless its segment was reused meanwhile.
+ *
+ * returns
+ *  1 batch read
+ *  0 the spill has none
+ * -1 error
+ */
+int spill_next(struct client *c, struct batch **out) {
+  struct batch *b = NULL;
+  struct spill_rec r;
+  int rc = -1, fd, k;
+  size_t i, sum;
+  ssize_t nr;
+  char *p;
+
+  *out = NULL;
+  if (cfg.spill_max == 0) return 0;
+
+  if ((c->sp_valid == 0) || (c->sp_gen + 1 < cfg.spill_gen)) {
+    c->sp_gen = cfg.spill_gen ? (cfg.spill_gen - 1) : 0;
+    c->sp_off = 0;
+    c->sp_valid = 1;
+  }
+
+  while (1) {
+    k = c->sp_gen % 2;
+    fd = cfg.spill_fd[k];
+    if (c->sp_off + (off_t)sizeof(r) > cfg.spill_len[k]) {
+      if (c->sp_gen == cfg.spill_gen) { rc = 0; goto done; }
+      c->sp_gen++;
+      c->sp_off = 0;
+      continue;
+    }
+    nr = pread(fd, &r, sizeof(r), c->sp_off);
+    if (nr != sizeof(r)) {
+      fprintf(stderr, "spill: short read\n");
+      goto done;
+    }
+    if ((r.frames > PUBNUMIOV) || (r.len > PUBBUFLEN)) {
+      fprintf(stderr, "spill: bad record\n");
+      goto done;
+    }
+    if (r.seq + r.frames > c->catchup_seq) break;
+    c->sp_off += sizeof(r) + r.frames * sizeof(uint32_t) + r.len;
+  }
+
+  b = batch_get();
+  if (b == NULL) goto done;
+
+  nr = pread(fd, b->len, r.frames * sizeof(uint32_t), c->sp_off + sizeof(r));
+  if (nr != (ssize_t)(r.frames * sizeof(uint32_t))) {
+    fprintf(stderr, "spill: short read\n");
+    goto done;
+  }
+  nr = pread(fd, b->buf, r.len,
+             c->sp_off + sizeof(r) + r.frames * sizeof(uint32_t));
+  if (nr != r.len) {
+    fprintf(stderr, "spill: short read\n");
+    goto done;
+  }
+
+  for(p = b->buf, sum = 0, i = 0; i < r.frames; i++) {
+    b->iov[i].iov_base = p;
+    b->iov[i].iov_len = b->len[i];
+    p += b->len[i];
+    sum += b->len[i];
+  }
+  if (sum != r.len) {
+    fprintf(stderr, "spill: bad record\n");
+    goto done;
+  }
+
+  b->niov = r.frames;
+  b->span = r.frames;
+  b->rawlen = r.frames * sizeof(uint32_t) + r.len;
+  b->seq = r.seq;
+  b->num = r.num;
+  batch_bin(b);
+
+  c->sp_off += sizeof(r) + b->rawlen;
+  c->catchup_seq = r.seq + r.frames;
+  *out = b;
+  b = NULL;
+  rc = 1;
+
+ done:
+  if (b) batch_put(b);
+  return rc;
+}
+
+/*
+ * catchup_next
+ *
+ * the next batch to replay to a client: from the spill if it
+ * is older than the history, else from the history. a replay
+ * point older than both skips ahead; the client sees the gap.
+ *
+ * returns
+ *  1 batch (a reference the caller drops)
+ *  0 caught up with the ring
+ * -1 error
+ */
+int catchup_next(struct client *c, struct batch **out) {
+  struct batch *b;
+  size_t i;
+  int sc;
+
+  *out = NULL;
+  if (cfg.hist_used == 0) return 0;
+
+  b = cfg.hist[cfg.hist_head];
+  if (c->catchup_seq < b->seq) {
+    sc = spill_next(c, out);
+    if (sc) return sc;
+    fprintf(stderr, "client %s: replay from %lu; oldest is %lu\n", c->addr,
+      (unsigned long)c->catchup_seq, (unsigned long)b->seq);
+    c->catchup_seq = b->seq;
+  }
+
+  for(i = 0; i < cfg.hist_used; i++) {
+    b = cfg.hist[(cfg.hist_head + i) % PUBMAXQ];
+    if (b->seq + b->span <= c->catchup_seq) continue;
+    c->catchup_seq = b->seq + b->span;
+    b->refcnt++;
+    *out = b;
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * client_catchup
+ *
+ * queue a replaying client its next batches as its queue has
+ * room, rather than all at once, so a long replay is bounded by
+ * -Q like any client. it gets no new batches meanwhile; they
+ * reach it through the history. once caught up, it streams.
+ *
+ * returns
+ *  0 success
+ * -1 client must be disconnected
+ */
+int client_catchup(struct client *c) {
+  struct batch *b;
+  int sc;
+
+  while (c->catchup && (c->q_used < cfg.pub_maxq)) {
+    sc = catchup_next(c, &b);
+    if (sc < 0) return -1;
+    if (sc == 0) {
+      c->catchup = 0;
+      break;
+    }
+    sc = client_enqueue(c, b);
+    batch_put(b);
+    if (sc < 0) return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * client_flush
+ *
+ * send what the client has queued; poll for room if its socket
+ * fills. push the tail when asked, if the queue went out entirely.
+ * (if it waits on compression, handle_zdone resumes it). a client
+ * catching up is topped up from the replay as its queue drains.
+ *
+ * returns
+ *  0 success (including, client was disconnected)
+ * -1 error
+ */
+int client_flush(struct client *c, int push) {
+  int rc = -1, sc;
+
+  do {
+    if (client_catchup(c) < 0) {
+      rc = close_client(c);
+      goto done;
+    }
+
+    sc = client_send(c);
+    if (sc < 0) {
+      rc = close_client(c);
+      goto done;
+    }
+
+    client_release(c);
+  } while ((sc == 1) && c->catchup && (c->q_used < cfg.pub_maxq));
+
+  if (client_watch(c, (sc == 0)) < 0) goto done;
+
+  if (push && (sc == 1) && (client_push(c) < 0)) {
+    rc = close_client(c);
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * client_reap
+ *
+ * read zerocopy completions from the client socket error queue.
+ * each notification covers a range of sends, in order.
+ *
+ * returns
+ *  number of notifications read
+ *  -1 error
+ */
+int client_reap(struct client *c) {
+  struct sock_extended_err *serr;
+  char control[128];
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  int rc = -1, n = 0;
+  ssize_t nr;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    nr = recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (nr < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+      fprintf(stderr, "recvmsg: %s\n", strerror(errno));
+      goto done;
+    }
+    for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      serr = (struct sock_extended_err*)CMSG_DATA(cm);
+      if ((serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || serr->ee_errno)
+        continue;
+      c->zc_done = serr->ee_data + 1;
+      if (cfg.verbose && (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED))
+        fprintf(stderr, "zerocopy: kernel copied batch\n");
+      n++;
+    }
+  }
+
+  rc = n;
+
+ done:
+  return rc;
+}
+
+/* queue a new batch to every streaming client */
+int pub_queue(struct batch *b) {
+  struct client *c;
+  int sc, n;
+
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    c = &cfg.clients[n];
+    if (streaming(c) == 0) continue;
+    if (c->catchup) continue; /* gets it through the history */
+    sc = client_enqueue(c, b);
+    if (sc < 0) sc = close_client(c);
+    else        sc = client_flush(c, 0);
+    if (sc < 0) return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * pub_drain
+ *
+ * in pub mode, read batches from the ring and queue each one to
+ * every streaming client (see pub_send), until the ring is empty
+ * (or, under the block policy, a client queue is full)
+ *
+ */
+int pub_drain(void) {
+  struct client *c;
+  int rc = -1, sc, n;
+
+  while (pub_can_read()) {
+    sc = sink_step(cfg.sr);
+    if (sc < 0) goto done;
+    if (sc == 0) break;
+  }
+
+  /* push the tail to clients that are caught up */
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    c = &cfg.clients[n];
+    if (streaming(c) == 0) continue;
+    if ((c->q_send == c->q_used) && (client_push(c) < 0)) {
+      if (close_client(c) < 0) goto done;
+    }
+  }
+
+  rc = pub_rewatch();
+
+ done:
+  return rc;
+}
+
+/* send the datagrams packed so far; a failure is counted, not fatal */
+void mcast_flush(struct mmsghdr *msgs, int n) {
+  int sent = 0, sc, i;
+
+  while (sent < n) {
+    sc = sendmmsg(cfg.mcast_fd, msgs + sent, n - sent, 0);
+    if (sc < 0) {
+      if (errno == EINTR) continue;
+      if (cfg.verbose) fprintf(stderr, "sendmmsg: %s\n", strerror(errno));
+      cfg.mc_errors++;
+      sent++; /* skip the datagram that failed */
+      continue;
+    }
+    for(i = sent; i < sent + sc; i++) {
+      cfg.wire_bytes += msgs[i].msg_len;
+      cfg.raw_bytes += msgs[i].msg_len;
+    }
+    cfg.mc_dgrams += sc;
+    sent += sc;
+  }
+}
+
+/*
+ * mcast_send
+ *
+ * pack a batch into datagrams of up to -D bytes and send them in
+ * sendmmsg bursts. the datagram iovecs point into the batch wire
+ * (length prefix, frame, ...), so frames are not copied here.
+ *
+ */
+void mcast_send(struct batch *b) {
+  struct mmsghdr *msgs = mc_msgs_bss;
+  struct iovec *iov = mc_iov_bss, *start;
+  size_t i = 0, len, flen, niov = 0;
+  struct dgram_hdr *h;
+  int nmsg = 0;
+
+  while (i < b->niov) {
+    h = &mc_hdrs_bss[nmsg];
+    h->magic = DGRAM_MAGIC;
+    h->frames = 0;
+    h->seq = b->seq + i;
+    start = &iov[niov];
+    iov[niov].iov_base = h;
+    iov[niov].iov_len = sizeof(*h);
+    niov++;
+    len = sizeof(*h);
+
+    while ((i < b->niov) && (h->frames < DGRAM_FRAMES)) {
+      flen = sizeof(uint32_t) + b->iov[i].iov_len;
+      if ((h->frames == 0) && (len + flen > DGRAM_MAX)) {
+        cfg.mc_oversize++; /* the gap shows as loss */
+        h->seq++;
+        i++;
+        continue;
+      }
+      if (h->frames && (len + flen > cfg.dgram_max)) break;
+      iov[niov++] = b->bin[2*i+1];
+      iov[niov++] = b->bin[2*i+2];
+      len += flen;
+      h->frames++;
+      i++;
+    }
+
+    if (h->frames == 0) { /* only oversize frames were left */
+      niov--;
+      break;
+    }
+
+    memset(&msgs[nmsg], 0, sizeof(msgs[nmsg]));
+    msgs[nmsg].msg_hdr.msg_iov = start;
+    msgs[nmsg].msg_hdr.msg_iovlen = &iov[niov] - start;
+    if (++nmsg == MMSG_MAX) {
+      mcast_flush(msgs, nmsg);
+      nmsg = 0;
+      niov = 0;
+    }
+  }
+
+  if (nmsg) mcast_flush(msgs, nmsg);
+}
+
+/*
+ * pub_send
+ *
+ * the sink's send_batch: take a bulk read of the ring as a new
+ * batch. the batch lies in the read's scratch, and its binary
+ * form is laid out there as wire iovecs (length prefix, frame,
+ * ...) that point into the read buffer. the batch is numbered
+ * and, except in multicast, kept in the replay history, then
+ * sent as datagrams or queued to the clients. the read is done
+ * when the last reference to the batch is put.
+ *
+ */
+int pub_send(struct sink_batch *sb) {
+  struct batch *b = sb->aux;
+  size_t i;
+  int rc;
+
+  memset(b, 0, sizeof(*b));
+  b->refcnt = 1;
+  b->sb = sb;
+  b->buf = sb->b->buf;
+  b->iov = sb->b->iov;
+  b->bin = (struct iovec*)(b + 1);
+  b->len = (uint32_t*)(b->bin + sb->b->niov * 2 + 1);
+  b->niov = sb->n;
+  b->span = sb->n;
+  b->rawlen = sb->n * sizeof(uint32_t);
+  for(i = 0; i < sb->n; i++) b->rawlen += b->iov[i].iov_len;
+  b->seq = cfg.pub_seq;
+  b->num = cfg.pub_batches++;
+  cfg.pub_seq += sb->n;
+  batch_bin(b);
+
+  /* multicast has no replay channel, so keeps no history */
+  if (cfg.encoding == enc_mcast) {
+    mcast_send(b);
+    rc = 0;
+  } else {
+    hist_push(b);
+    rc = pub_queue(b);
+  }
+
+  batch_put(b);
+  return rc;
+}
+
+struct sink_ops pub_ops = {.send_batch = pub_send};
+
+/* read the ring by the sink core, from the epoll loop. each
+ * read has room after it for a batch and its binary wire */
+int setup_pub_sink(void) {
+  int rc = -1, sc;
+
+  sink_init(&cfg.sink, &pub_ops, NULL);
+  cfg.sink.verbose = cfg.verbose;
+  cfg.sink.max_len = PUBBUFLEN;
+  cfg.sink.max_niov = PUBNUMIOV;
+  cfg.sink.skip_big = 1; /* over MAX_FRAME, no subscriber takes it */
+  cfg.sink.aux_per = 2 * sizeof(struct iovec) + sizeof(uint32_t);
+  cfg.sink.aux_fixed = sizeof(struct batch) + sizeof(struct iovec);
+  cfg.sink.nbatch = cfg.pub_maxq * PUB_READS;
+
+  sc = sink_attach(&cfg.sink, cfg.ccr, cfg.ring, NULL);
+  if (sc < 0) goto done;
+  sc = sink_start(&cfg.sink);
+  if (sc < 0) goto done;
+  cfg.sr = &cfg.sink.ringv[0];
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* in multicast pub mode, send the ring as it fills. each
+ * batch is done once sent (see pub_send), so reads are free */
+int mcast_drain(void) {
+  int rc = -1, sc;
+
+  do {
+    sc = sink_step(cfg.sr);
+    if (sc < 0) goto done;
+  } while (sc);
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * handle_zdone
+ *
+ * in pub mode, the compression thread finished some batches.
+ * mark them ready and resume the clients waiting on them.
+ *
+ */
+int handle_zdone(void) {
+  struct zform *z, *done;
+  int rc = -1, n, err = 0;
+  struct client *c;
+  uint64_t count;
+  ssize_t nr;
+
+  nr = read(cfg.zevent_fd, &count, sizeof(count));
+  if ((nr < 0) && (errno != EAGAIN)) {
+    fprintf(stderr, "read: %s\n", strerror(errno));
+    goto done;
+  }
+
+  pthread_mutex_lock(&cfg.zlock);
+  done = cfg.zdone;
+  cfg.zdone = NULL;
+  pthread_mutex_unlock(&cfg.zlock);
+
+  while (done) {
+    z = done;
+    done = z->next;
+    if (z->err) err = 1;
+    z->state = z_ready;
+    batch_put(z->b);
+  }
+
+  if (err) {
+    fprintf(stderr, "compression: out of memory\n");
+    goto done;
+  }
+
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    c = &cfg.clients[n];
+    if ((c->used == 0) || (c->codec == 0)) continue;
+    if (client_flush(c, 1) < 0) goto done;
+  }
+
+  rc = pub_rewatch();
+
+ done:
+  return rc;
+}
+
+/*
+ * client_ready
+ *
+ * in pub mode, client socket has room, or error queue data
+ *
+ */
+int client_ready(struct client *c, int events) {
+  int rc = -1, sc, err = 0;
+  socklen_t sz = sizeof(err);
+
+  assert( cfg.mode == mode_pub );
+
+  if (events & EPOLLERR) {
+    sc = c->zc_on ? client_reap(c) : 0;
+    if (sc <= 0) { /* not a completion; a socket error */
+      getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &sz);
+      fprintf(stderr, "client %s: %s\n", c->addr, strerror(err));
+      rc = close_client(c);
+      goto done;
+    }
+  }
+
+  sc = client_flush(c, 1);
+  if (sc < 0) goto done;
+
+  /* a drained queue may let the ring be read again */
+  rc = pub_rewatch();
+
+ done:
+  return rc;
+}
+
+struct client *find_client(int fd) {
+  int n;
+
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    if (cfg.clients[n].used && (cfg.clients[n].fd == fd))
+      return &cfg.clients[n];
+  }
+
+  return NULL;
+}
+
+int handle_io(void) {
+  int rc = -1, sc, fl;
+  size_t len;
+  char *out;
+
+  switch (cfg.mode) {
+
+    case mode_read:
+      fl = CCR_BUFFER | CCR_JSON;
+      fl |= cfg.pretty ? CCR_PRETTY : 0;
+      sc = ccr_getnext(cfg.ccr, fl, &out, &len);
+      if (sc > 0) printf("%.*s\n", (int)len, out);
+      if (sc <= 0) {
+        fprintf(stderr, "ccr_getnext: %s (%d)\n",
+          (sc == 0) ? "end-of-data" : "error", sc);
+        goto done;
+      }
+      break;
+
+    case mode_read_hex:
+      fl = CCR_BUFFER;
+      sc = ccr_getnext(cfg.ccr, fl, &out, &len);
+      if (sc > 0) hexdump(out, len);
+      if (sc <= 0) {
+        fprintf(stderr, "ccr_getnext: %s (%d)\n",
+          (sc == 0) ? "end-of-data" : "error", sc);
+        goto done;
+      }
+      break;
+
+    case mode_lib:
+      if (cfg.modccr.mod_work == NULL) goto done;
+      if (cfg.modccr.mod_work(&cfg.modccr, cfg.ccr) < 0) {
+        fprintf(stderr,"module %s: exit\n", cfg.lib);
+        goto done;
+      }
+      break;
+
+    case mode_pub:
+      sc = (cfg.encoding == enc_mcast) ? mcast_drain() : pub_drain();
+      if (sc < 0) goto done;
+      break;
+
+    case mode_sub:
+      if (sub_ring() < 0) goto done;
+      break;
+
+    default:
+      assert(0);
+      goto done;
+      break;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+
+int load_module(void) {
+  int rc = -1;
+
+  if (cfg.mode != mode_lib) {
+    rc = 0;
+    goto done;
+  }
+    
+  cfg.dl = dlopen(cfg.lib, RTLD_LAZY);
+  if (cfg.dl == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    goto done;
+  }
+
+  cfg.libinit = dlsym(cfg.dl, "ccr_module_init");
+  if (cfg.libinit == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    goto done;
+  }
+
+  cfg.modccr.verbose = cfg.verbose;
+  cfg.modccr.opts = cfg.libopts;
+
+  if (cfg.libinit(&cfg.modccr) < 0) {
+    fprintf(stderr, "%s: module init failed\n", cfg.lib);
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * parse_spec
+ *
+ * parse [<ip|hostname>]:<port> or unix:<path>, populate endpoint
+ *
+ * if there was no IP/hostname, ip is set to INADDR_ANY
+ * port is required, or the function fails
+ *
+ * returns 
+ *  0 success
+ * -1 error
+ *
+ */
+int parse_spec(char *spec, struct endpoint *ep) {
+  char *colon=NULL, *p, *h;
+  struct sockaddr_in *sa = &ep->in;
+  struct hostent *e;
+  int rc = -1, port;
+  uint32_t s_addr;
+  size_t len;
+
+  memset(ep, 0, sizeof(*ep));
+
+  if (!strncmp(spec, "unix:", 5)) {
+    p = spec + 5;
+    len = strlen(p);
+    if ((len == 0) || (len + 1 > sizeof(ep->un.sun_path))) {
+      fprintf(stderr, "%s: bad socket path\n", spec);
+      goto done;
+    }
+    ep->domain = AF_UNIX;
+    ep->un.sun_family = AF_UNIX;
+    memcpy(ep->un.sun_path, p, len + 1);
+    rc = 0;
+    goto done;
+  }
+
+  colon = strchr(spec, ':');
+  h = colon ? spec : NULL;
+  p = colon ? colon+1 : spec;
+
+  if (colon) *colon = '\0';
+  e = h ? gethostbyname(h) : NULL;
+  if (h && (!e || !e->h_length)) {
+    fprintf(stderr, "%s: %s\n", h, hstrerror(h_errno));
+    goto done;
+  }
+
+  port = atoi(p);
+  if ((port <= 0) || (port > 65535)) {
+    fprintf(stderr, "%s: not a port number\n", p);
+    goto done;
+  }
+
+  ep->domain          = AF_INET;
+  sa->sin_family      = AF_INET;
+  sa->sin_port        = htons(port);
+  sa->sin_addr.s_addr = htonl(INADDR_ANY);
+  if (h) memcpy(&sa->sin_addr.s_addr, e->h_addr, e->h_length);
+
+  if (cfg.verbose) {
+    fprintf(stderr, "%s -> IP %s port %d\n",
+      spec, inet_ntoa(sa->sin_addr), port);
+  }
+
+  rc = 0;
+
+ done:
+  if (colon) *colon = ':';
+  return rc;
+}
+
+/*
+ * proto_sendcast
+ *
+ * send the ring cast, or the cast derived by the client's view
+ *
+ */
+int proto_sendcast(struct client *c) {
+  char *fmt=NULL, *f;
+  int rc = -1, sc;
+  size_t fmt_len;
+  uint32_t len32;
+  ssize_t nr;
+
+  assert(cfg.mode == mode_pub);
+
+  /* don't splice the cast into the frame stream */
+  if (c->encoding != enc_proto) {
+    fprintf(stderr, "client %s: cast request while streaming\n", c->addr);
+    rc = 0;
+    goto done;
+  }
+
+  sc = client_view(c);
+  if (sc < 0) goto done;
+
+  if (c->view) {
+    f = utstring_body(c->view->cast);
+    fmt_len = utstring_len(c->view->cast);
+  } else {
+    sc = ring_cast(&fmt, &fmt_len);
+    if (sc < 0) goto done;
+    f = fmt;
+  }
+
+  /* send 32-bit length prefix then the cast format */
+  len32 = (uint32_t)fmt_len;
+  nr = write(c->fd, &len32, sizeof(len32));
+  if (nr < 0) {
+    fprintf(stderr, "write: %s\n", strerror(errno));
+    goto done;
+  }
+  assert (nr == sizeof(len32)); /* TODO drain */
+  do {
+    nr = write(c->fd, f, len32);
+    if (nr < 0) {
+      fprintf(stderr, "write: %s\n", strerror(errno));
+      goto done;
+    }
+    f += nr;
+    len32 -= nr;
+  } while (len32 > 0);
+
+  rc = 0;
+
+ done:
+  if (fmt) free(fmt);
+  return rc;
+}
+
+/*
+ * proto_sendring
+ *
+ * local fast path: tell a unix domain client where the ring is,
+ * so it reads it with no socket between. the reply is m, then
+ * the ring's absolute path and a newline. the client opens the
+ * ring by its path, so it needs read permission on the ring as
+ * any reader does; the fast path saves only the socket copy.
+ * only a farm ring is offered, since its readers are independent.
+ * otherwise the client is told n, and may ask for a stream.
+ *
+ */
+int proto_sendring(struct client *c) {
+  char buf[PATH_MAX + 2], path[PATH_MAX];
+  struct shr *shr = NULL;
+  struct shr_stat stat;
+  int rc = -1, sc;
+  size_t len;
+  ssize_t nr;
+  char *b;
+
+  assert(cfg.mode == mode_pub);
+
+  buf[0] = 'n';
+  len = 1;
+
+  if (c->local == 0) {
+    fprintf(stderr, "client %s: ring requested over tcp\n", c->addr);
+    goto reply;
+  }
+
+  shr = shr_open(cfg.ring, SHR_RDONLY);
+  if (shr == NULL) goto done;
+  sc = shr_stat(shr, &stat, NULL);
+  if (sc < 0) goto done;
+  if ((stat.flags & SHR_FARM) == 0) {
+    fprintf(stderr, "client %s: not a farm ring; not offering it\n", c->addr);
+    goto reply;
+  }
+
+  /* absolute, as the client's working directory may differ */
+  if (realpath(cfg.ring, path) == NULL) {
+    fprintf(stderr, "realpath %s: %s\n", cfg.ring, strerror(errno));
+    goto reply;
+  }
+  len = snprintf(buf, sizeof(buf), "m%s\n", path);
+
+ reply:
+  b = buf;
+  do {
+    nr = send(c->fd, b, len, MSG_NOSIGNAL);
+    if (nr < 0) {
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      goto done;
+    }
+    b += nr;
+    len -= nr;
+  } while (len > 0);
+
+  rc = 0;
+
+ done:
+  if (shr) shr_close(shr);
+  return rc;
+}
+
+/*
+ * sub_local
+ *
+ * ask a unix domain publisher for its ring (see proto_sendring)
+ * and open it as our source, by the path received
+ *
+ * returns
+ *  1 reading the publisher's ring directly
+ *  0 publisher declined; stream instead
+ * -1 error
+ */
+int sub_local(int fd) {
+  char reply, path[PATH_MAX];
+  size_t len = 0;
+  int rc = -1;
+  ssize_t nr;
+
+  nr = write(fd, "m", 1);
+  if (nr != 1) {
+    fprintf(stderr, "write: %s\n", (nr < 0) ? strerror(errno) : "incomplete");
+    goto done;
+  }
+
+  nr = read(fd, &reply, 1);
+  if (nr != 1) {
+    fprintf(stderr, "read: %s\n", (nr < 0) ? strerror(errno) : "eof");
+    goto done;
+  }
+  if (reply != 'm') {
+    fprintf(stderr, "publisher declined its ring; streaming\n");
+    rc = 0;
+    goto done;
+  }
+
+  /* the path, up to its newline. it is short, and
+   * the publisher sends nothing after it unasked */
+  do {
+    if (len == sizeof(path)) {
+      fprintf(stderr, "publisher ring path too long\n");
+      goto done;
+    }
+    nr = read(fd, &path[len], 1);
+    if (nr != 1) {
+      fprintf(stderr, "read: %s\n", (nr < 0) ? strerror(errno) : "eof");
+      goto done;
+    }
+  } while (path[len++] != '\n');
+  path[len-1] = '\0';
+
+  cfg.ccr = ccr_open(path, CCR_RDONLY|CCR_NONBLOCK, 0);
+  if (cfg.ccr == NULL) goto done;
+  cfg.fd = ccr_get_selectable_fd(cfg.ccr);
+  if (cfg.fd < 0) goto done;
+
+  rc = 1;
+
+ done:
+  return rc;
+}
+
+/* account for frames written to our ring by shr_writev in its
+ * statistics (ccr_stat), as ccr_capture would */
+void sub_stat(struct iovec *iov, size_t n) {
+  size_t i, bytes = 0, max = 0;
+
+  if (cfg.stat_ccr == NULL) return;
+  for(i = 0; i < n; i++) {
+    bytes += iov[i].iov_len;
+    if (iov[i].iov_len > max) max = iov[i].iov_len;
+  }
+  ccr_stat_note(cfg.stat_ccr, n, bytes, max);
+}
+
+/*
+ * sub_ring
+ *
+ * local fast path: copy the frames ready in the
+ * publisher's ring to ours, a bulk read at a time
+ *
+ */
+int sub_ring(void) {
+  size_t niov, flen;
+  struct batch *b;
+  int rc = -1, sc;
+  ssize_t nr;
+  char *f;
+
+  b = batch_get();
+  if (b == NULL) goto done;
+
+  while (1) {
+    niov = PUBNUMIOV;
+    nr = ccr_readv(cfg.ccr, 0, b->buf, PUBBUFLEN, b->iov, &niov);
+    /* a frame larger than the batch buffer is copied on its own */
+    if (nr == -2) {
+      sc = ccr_getnext(cfg.ccr, CCR_BUFFER, &f, &flen);
+      if (sc < 0) {
+        fprintf(stderr, "ccr_getnext: error (%d)\n", sc);
+        goto done;
+      }
+      b->iov[0].iov_base = f;
+      b->iov[0].iov_len = flen;
+      niov = 1;
+      nr = flen;
+    }
+    if (nr < 0) {
+      fprintf(stderr, "ccr_readv: error (%zd)\n", nr);
+      goto done;
+    }
+    if (nr == 0) break;
+
+    sc = shr_writev(cfg.shr, b->iov, niov);
+    if (sc < 0) {
+      fprintf(stderr, "shr_writev: error (%d)\n", sc);
+      goto done;
+    }
+    if (sc > 0) sub_stat(b->iov, niov);
+    cfg.raw_bytes += nr;
+  }
+
+  rc = 0;
+
+ done:
+  if (b) batch_put(b);
+  return rc;
+}
+
+/*
+ * setup_recvbuf
+ *
+ * map the subscriber receive buffer twice, back to back, over
+ * the same memory. a frame that wraps past the end of the first
+ * mapping continues into the second, so frames are always
+ * contiguous and a partial frame never has to be moved.
+ *
+ */
+int setup_recvbuf(struct stripe *st) {
+  int rc = -1, fd = -1;
+  char *base = MAP_FAILED, *m;
+
+  fd = memfd_create("ccr-sub", 0);
+  if (fd < 0) {
+    fprintf(stderr, "memfd_create: %s\n", strerror(errno));
+    goto done;
+  }
+
+  if (ftruncate(fd, SUBBUFLEN) < 0) {
+    fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+    goto done;
+  }
+
+  /* reserve the span, then put the two views in it */
+  base = mmap(NULL, SUBBUFLEN * 2, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    goto done;
+  }
+
+  m = mmap(base, SUBBUFLEN, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, 0);
+  if (m == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    goto done;
+  }
+
+  m = mmap(base + SUBBUFLEN, SUBBUFLEN, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, 0);
+  if (m == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    goto done;
+  }
+
+  st->buf = base;
+  st->head = 0;
+  st->tail = 0;
+  rc = 0;
+
+ done:
+  if (fd != -1) close(fd);
+  if ((rc < 0) && (base != MAP_FAILED)) munmap(base, SUBBUFLEN * 2);
+  return rc;
+}
+
+/* append a frame to the ring write batch, growing it as needed */
+int sub_iov_add(size_t *iov_used, char *body, uint32_t blen) {
+  struct iovec *iov;
+  size_t n;
+
+  if (*iov_used == cfg.sub_niov) {
+    n = cfg.sub_niov ? (cfg.sub_niov * 2) : 1024;
+    iov = realloc(cfg.sub_iov, n * sizeof(struct iovec));
+    if (iov == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return -1;
+    }
+    cfg.sub_iov = iov;
+    cfg.sub_niov = n;
+  }
+
+  cfg.sub_iov[ *iov_used ].iov_base = body;
+  cfg.sub_iov[ *iov_used ].iov_len  = blen;
+  (*iov_used)++;
+  return 0;
+}
+
+/*
+ * given the received bytes: N frames with
+ * a possible partial final frame, find the
+ * message boundaries and write to ring,
+ * leaving the partial frame in place
+ */
+int decode_frames(struct stripe *st) {
   char *c, *body, *eob;
   size_t iov_used=0;
   uint32_t blen;
@@ -476,69 +3001,458 @@ int decode_frames(void) {
 
   assert( cfg.mode == mode_sub );
 
-  eob = cfg.sub_buf + cfg.sub_buf_used;
-  c = cfg.sub_buf;
+  c = st->buf + (st->head % SUBBUFLEN);
+  eob = c + (st->tail - st->head);
   while(1) {
     if (c + sizeof(uint32_t) > eob) break;
     memcpy(&blen, c, sizeof(uint32_t));
     if (blen > MAX_FRAME) goto done;
     body = c + sizeof(uint32_t);
     if (body + blen > eob) break;
-    cfg.sub_iov[ iov_used ].iov_base = body;
-    cfg.sub_iov[ iov_used ].iov_len  = blen;
-    iov_used++;
-    if (iov_used == SUBNUMIOV) break;
+    if (sub_iov_add(&iov_used, body, blen) < 0) goto done;
     c += sizeof(uint32_t) + blen;
   }
 
+  if (iov_used == 0) {
+    rc = 0;
+    goto done;
+  }
+
   nr = shr_writev(cfg.shr, cfg.sub_iov, iov_used);
   if (nr < 0) {
     fprintf(stderr,"shr_writev: error (%zd)\n", nr);
     goto done;
   }
+  if (nr > 0) sub_stat(cfg.sub_iov, iov_used);
+
+  /* consume the whole frames */
+  cfg.raw_bytes += c - (st->buf + (st->head % SUBBUFLEN));
+  st->head += c - (st->buf + (st->head % SUBBUFLEN));
+
+  rc = 0;
+
+ done:
+  if (rc < 0) fprintf(stderr, "frame parsing error\n");
+  return rc;
+}
+
+/* write the frames gathered so far to the ring */
+int sub_flush(size_t *iov_used) {
+  ssize_t nr;
+
+  if (*iov_used == 0) return 0;
+
+  nr = shr_writev(cfg.shr, cfg.sub_iov, *iov_used);
+  if (nr < 0) {
+    fprintf(stderr,"shr_writev: error (%zd)\n", nr);
+    return -1;
+  }
+  if (nr > 0) sub_stat(cfg.sub_iov, *iov_used);
+
+  *iov_used = 0;
+  return 0;
+}
+
+/*
+ * stripe_peek
+ *
+ * the header and body of the whole batch at the head
+ * of a stripe's receive buffer, if it has arrived
+ *
+ * returns
+ *  1 batch at head
+ *  0 not yet
+ * -1 error
+ */
+int stripe_peek(struct stripe *st, struct batch_hdr *h, char **body) {
+  char *c = st->buf + (st->head % SUBBUFLEN);
+  size_t used = st->tail - st->head;
+
+  if (used < sizeof(*h)) return 0;
+  memcpy(h, c, sizeof(*h));
+  if (h->magic != BATCH_MAGIC) {
+    fprintf(stderr, "bad batch header\n");
+    return -1;
+  }
+  if (h->len > SUBBUFLEN / 2) {
+    fprintf(stderr, "batch too large\n");
+    return -1;
+  }
+  if (used < sizeof(*h) + h->len) return 0;
+
+  *body = c + sizeof(*h);
+  return 1;
+}
+
+/*
+ * sub_batch
+ *
+ * check a whole batch (crc, frame count) and add its frames to
+ * the ring write. frames already seen, as when replaying, are
+ * skipped; a jump in the sequence numbers is reported as lost
+ * frames. a filtered batch (BATCH_SUBSET) does not number its
+ * frames, so it is skipped only if all the frames it spans were
+ * seen. a compressed batch is decompressed into a scratch buffer
+ * and written on its own. unordered stripes skip the sequencing.
+ *
+ */
+int sub_batch(struct batch_hdr *h, char *body, size_t *iov_used) {
+  char *f, *end, *p;
+  uint32_t blen, n;
+  uint64_t seq;
+  int rc = -1, z, keep;
+  size_t len;
+  ssize_t nr;
+
+  end = body + h->len;
+  z = h->flags & (BATCH_LZ4 | BATCH_ZSTD);
+  if (z) {
+    if (h->raw > SUBBUFLEN / 2) {
+      fprintf(stderr, "batch too large\n");
+      goto done;
+    }
+    if (h->raw > cfg.sub_zlen) {
+      p = realloc(cfg.sub_zbuf, h->raw);
+      if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+      }
+      cfg.sub_zbuf = p;
+      cfg.sub_zlen = h->raw;
+    }
+    /* the scratch buffer is reused; write what points into it */
+    if (sub_flush(iov_used) < 0) goto done;
+    nr = codec_decompress(h->flags, body, h->len, cfg.sub_zbuf, h->raw);
+    if (nr != h->raw) {
+      fprintf(stderr, "batch %lu: decompression failed\n",
+        (unsigned long)h->seq);
+      goto done;
+    }
+    body = cfg.sub_zbuf;
+    end = body + h->raw;
+  }
+  len = end - body;
+  cfg.raw_bytes += sizeof(*h) + len;
+
+  if ((h->flags & BATCH_CRC) && (crc32c(0, body, len) != h->crc)) {
+    fprintf(stderr, "batch %lu: crc mismatch\n", (unsigned long)h->seq);
+    goto done;
+  }
+
+  if (cfg.sub_unordered) cfg.sub_seq_known = 0;
+  if (cfg.sub_seq_known && (h->seq > cfg.sub_seq)) {
+    fprintf(stderr, "lost %lu frames before %lu\n",
+      (unsigned long)(h->seq - cfg.sub_seq), (unsigned long)h->seq);
+  }
+
+  keep = (cfg.sub_seq_known == 0) || (h->seq + h->frames > cfg.sub_seq);
+  for(f = body, n = 0, seq = h->seq; f < end; f += sizeof(uint32_t) + blen) {
+    if (f + sizeof(uint32_t) > end) goto done;
+    memcpy(&blen, f, sizeof(uint32_t));
+    if (f + sizeof(uint32_t) + blen > end) goto done;
+    if ((h->flags & BATCH_SUBSET) == 0)
+      keep = (cfg.sub_seq_known == 0) || (seq >= cfg.sub_seq);
+    if (keep) {
+      if (sub_iov_add(iov_used, f + sizeof(uint32_t), blen) < 0) goto done;
+    }
+    n++;
+    seq++;
+  }
+  if ((h->flags & BATCH_SUBSET) ? (n > h->frames) : (n != h->frames)) goto done;
+  seq = h->seq + h->frames;
+
+  if ((cfg.sub_seq_known == 0) || (seq > cfg.sub_seq)) cfg.sub_seq = seq;
+  cfg.sub_seq_known = 1;
+  if (z && (sub_flush(iov_used) < 0)) goto done;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * decode_batches
+ *
+ * sequenced protocol counterpart of decode_frames. the frames
+ * of the whole batches received are written to the ring together
+ * (see sub_batch), leaving a partial batch in place
+ *
+ */
+int decode_batches(struct stripe *st) {
+  size_t iov_used = 0;
+  struct batch_hdr h;
+  int rc = -1, sc;
+  char *body;
+
+  assert( cfg.mode == mode_sub );
+
+  while ((sc = stripe_peek(st, &h, &body)) > 0) {
+    if (sub_batch(&h, body, &iov_used) < 0) goto done;
+    st->head += sizeof(h) + h.len;
+  }
+  if (sc < 0) goto done;
+
+  if (sub_flush(&iov_used) < 0) goto done;
+
+  rc = 0;
+
+ done:
+  if (rc < 0) fprintf(stderr, "batch parsing error\n");
+  return rc;
+}
+
+/*
+ * decode_striped
+ *
+ * merge the stripes in sequence order. the next batch is the one
+ * with the lowest sequence number at the head of any stripe; it is
+ * written once it is the one expected. a stripe delivers in order,
+ * so once every stripe has a later batch at its head the expected
+ * one was lost, and the lowest is written. until then, batches wait
+ * in place in their receive buffers (which pause when full).
+ *
+ */
+int decode_striped(void) {
+  struct batch_hdr h[MAX_STRIPES];
+  char *body[MAX_STRIPES];
+  int rc = -1, sc, i, best, have;
+  size_t iov_used = 0;
+
+  assert( cfg.mode == mode_sub );
+
+  while (1) {
+    best = -1;
+    have = 0;
+    for(i = 0; i < cfg.nstripes; i++) {
+      sc = stripe_peek(&cfg.stripes[i], &h[i], &body[i]);
+      if (sc < 0) goto done;
+      if (sc == 0) continue;
+      if ((best < 0) || (h[i].seq < h[best].seq)) best = i;
+      have++;
+    }
+    if (best < 0) break;
+
+    /* an earlier batch may yet arrive on a stripe with none whole */
+    if ((have < cfg.nstripes) &&
+        ((cfg.sub_seq_known == 0) || (h[best].seq > cfg.sub_seq))) break;
+
+    if (sub_batch(&h[best], body[best], &iov_used) < 0) goto done;
+    cfg.stripes[best].head += sizeof(h[best]) + h[best].len;
+  }
+
+  if (sub_flush(&iov_used) < 0) goto done;
+
+  rc = 0;
+
+ done:
+  if (rc < 0) fprintf(stderr, "batch parsing error\n");
+  return rc;
+}
+
+/* stop polling stripes whose buffer is full, resume the others */
+int stripe_rewatch(void) {
+  struct stripe *st;
+  int n, full, sc;
+
+  for(n = 0; n < cfg.nstripes; n++) {
+    st = &cfg.stripes[n];
+    full = (st->tail - st->head == SUBBUFLEN);
+    if (full == st->paused) continue;
+    sc = mod_epoll(full ? 0 : EPOLLIN, st->fd);
+    if (sc < 0) return -1;
+    st->paused = full;
+  }
+
+  return 0;
+}
+
+struct stripe *find_stripe(int fd) {
+  int n;
+
+  for(n = 0; n < cfg.nstripes; n++) {
+    if (cfg.stripes[n].fd == fd) return &cfg.stripes[n];
+  }
+
+  return NULL;
+}
+
+/* drop the connections to the publisher, and what they buffered
+ * beyond the frames written to the ring; a replay resends it */
+void sub_close(void) {
+  struct stripe *st;
+  int n;
+
+  for(n = 0; n < cfg.nstripes; n++) {
+    st = &cfg.stripes[n];
+    if (st->fd != -1) close(st->fd);
+    st->fd = -1;
+    st->head = 0;
+    st->tail = 0;
+    st->paused = 0;
+  }
+}
+
+/*
+ * sub_lost
+ *
+ * the publisher went away, or could not be reached. with -A,
+ * close up and let the timer reconnect (see sub_reconnect),
+ * backing off exponentially while it fails. otherwise give up.
+ *
+ */
+int sub_lost(void) {
+  if (cfg.sub_retry == 0) return -1;
+
+  sub_close();
+  cfg.retry_secs = cfg.retry_secs ? (cfg.retry_secs * 2) : 1;
+  if (cfg.retry_secs > SUB_RETRY_MAX) cfg.retry_secs = SUB_RETRY_MAX;
+  cfg.retry_at = time(NULL) + cfg.retry_secs;
+  fprintf(stderr, "reconnecting in %d s\n", cfg.retry_secs);
+  return 0;
+}
+
+/*
+ * do_subscriber
+ *
+ * receive until the socket is drained or a batch of SUBBATCH
+ * bytes is buffered, then write the whole frames to the ring
+ *
+ */
+int do_subscriber(struct stripe *st) {
+  int rc = -1, sc;
+  size_t used;
+  ssize_t nr;
+  char *b;
+
+  assert( cfg.mode == mode_sub );
+  assert( st->fd != -1 );
+
+  /* the buffer has free space because any time we receive
+   * a batch we process it right here, leaving at most one
+   * partial frame behind; except that merged stripes may
+   * hold whole batches, until the stripe is paused */
+  do {
+    used = st->tail - st->head;
+    if (used == SUBBUFLEN) break;
+    b = st->buf + (st->tail % SUBBUFLEN);
+
+    nr = recv(st->fd, b, SUBBUFLEN - used, MSG_DONTWAIT);
+    if (nr < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+      fprintf(stderr, "recv: %s\n", strerror(errno));
+      rc = sub_lost();
+      goto done;
+    }
+    if (nr == 0) {
+      fprintf(stderr, "recv: eof\n");
+      rc = sub_lost();
+      goto done;
+    }
+
+    st->tail += nr;
+    cfg.wire_bytes += nr;
+  } while (st->tail - st->head < SUBBATCH);
+
+  if (cfg.encoding != enc_seq) sc = decode_frames(st);
+  else if ((cfg.nstripes > 1) && (cfg.sub_unordered == 0)) sc = decode_striped();
+  else sc = decode_batches(st);
+  if (sc < 0) goto done;
 
-  /* if buffer ends with partial frame, save it */
-  if (c < eob) memmove(cfg.sub_buf, c, eob - c);
-  cfg.sub_buf_used = eob - c;
+  sc = stripe_rewatch();
+  if (sc < 0) goto done;
 
   rc = 0;
 
  done:
-  if (rc < 0) fprintf(stderr, "frame parsing error\n");
   return rc;
 }
 
+
 /*
- * do_subscriber
+ * mcast_recv
  *
+ * multicast counterpart of do_subscriber. receive datagrams in
+ * recvmmsg bursts and write their frames to the ring. a datagram
+ * ahead of the sequence counts the frames skipped as lost; one
+ * behind it (reordered or duplicated) is counted and discarded,
+ * so the ring stays in order. neither holds up the stream.
  *
  */
-int do_subscriber(void) {
-  int rc = -1, sc;
-  size_t avail;
-  ssize_t nr;
-  char *b;
+int mcast_recv(void) {
+  struct mmsghdr *msgs = mc_msgs_bss;
+  struct iovec *iov = mc_iov_bss;
+  size_t iov_used = 0, mark;
+  struct dgram_hdr h;
+  char *d, *f, *end;
+  int rc = -1, n, k;
+  uint32_t blen, j;
 
   assert( cfg.mode == mode_sub );
-  assert( cfg.sub_fd != -1 );
 
-  /* the buffer must have some free space because
-   * any time we read data we process it right here,
-   * leaving at most a tiny fragment of a partial
-   * frame to prepend the next read */
-  assert(cfg.sub_buf_used < SUBBUFLEN);
-  avail = SUBBUFLEN - cfg.sub_buf_used;
-  b = cfg.sub_buf + cfg.sub_buf_used;
+  do {
+    for(k = 0; k < MMSG_MAX; k++) {
+      iov[k].iov_base = mc_rbuf_bss + k * DGRAM_MAX;
+      iov[k].iov_len = DGRAM_MAX;
+      memset(&msgs[k], 0, sizeof(msgs[k]));
+      msgs[k].msg_hdr.msg_iov = &iov[k];
+      msgs[k].msg_hdr.msg_iovlen = 1;
+    }
 
-  nr = read(cfg.sub_fd, b, avail);
-  if (nr <= 0) {
-    fprintf(stderr, "read: %s\n", nr ? strerror(errno) : "eof");
-    goto done;
-  }
+    n = recvmmsg(cfg.mcast_fd, msgs, MMSG_MAX, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) break;
+      fprintf(stderr, "recvmmsg: %s\n", strerror(errno));
+      goto done;
+    }
 
-  assert(nr > 0);
-  cfg.sub_buf_used += nr;
-  if (decode_frames() < 0) goto done;
+    for(k = 0; k < n; k++) {
+      d = iov[k].iov_base;
+      end = d + msgs[k].msg_len;
+      cfg.wire_bytes += msgs[k].msg_len;
+      cfg.mc_dgrams++;
+
+      if ((msgs[k].msg_len < sizeof(h)) ||
+          (msgs[k].msg_hdr.msg_flags & MSG_TRUNC)) goto bad;
+      memcpy(&h, d, sizeof(h));
+      if (h.magic != DGRAM_MAGIC) goto bad;
+
+      if (cfg.sub_seq_known && (h.seq < cfg.sub_seq)) {
+        cfg.mc_late += h.frames;
+        continue;
+      }
+
+      mark = iov_used;
+      for(f = d + sizeof(h), j = 0; j < h.frames; j++) {
+        if (f + sizeof(uint32_t) > end) break;
+        memcpy(&blen, f, sizeof(uint32_t));
+        if (f + sizeof(uint32_t) + blen > end) break;
+        if (sub_iov_add(&iov_used, f + sizeof(uint32_t), blen) < 0) goto done;
+        f += sizeof(uint32_t) + blen;
+      }
+      if ((j < h.frames) || (f != end)) {
+        iov_used = mark;
+        goto bad;
+      }
+
+      if (cfg.sub_seq_known && (h.seq > cfg.sub_seq)) {
+        cfg.mc_lost += h.seq - cfg.sub_seq;
+        if (cfg.verbose) fprintf(stderr, "lost %lu frames before %lu\n",
+          (unsigned long)(h.seq - cfg.sub_seq), (unsigned long)h.seq);
+      }
+      cfg.sub_seq = h.seq + h.frames;
+      cfg.sub_seq_known = 1;
+      cfg.raw_bytes += msgs[k].msg_len;
+      continue;
+
+     bad:
+      cfg.mc_bad++;
+    }
+
+    /* the receive buffers are reused; write what points into them */
+    if (sub_flush(&iov_used) < 0) goto done;
+
+  } while (n == MMSG_MAX);
 
   rc = 0;
 
@@ -546,6 +3460,23 @@ int do_subscriber(void) {
   return rc;
 }
 
+/*
+ * client_replay
+ *
+ * start a client in the sequenced protocol, catching up from
+ * seq through the spill and history (see client_catchup)
+ *
+ */
+int client_replay(struct client *c, uint64_t seq) {
+  if (client_view(c) < 0) return close_client(c);
+  c->encoding = enc_seq;
+  c->catchup = 1;
+  c->catchup_seq = seq;
+  c->sp_valid = 0;
+
+  if (client_flush(c, 1) < 0) return -1;
+  return pub_rewatch();
+}
 
 /*
  * handle_client
@@ -553,58 +3484,116 @@ int do_subscriber(void) {
  * in pub mode, client sent data or closed
  *
  */
-int handle_client(void) {
-  int rc = -1, sc;
-  char buf[100], *b;
+int handle_client(struct client *c) {
+  char buf[100], *b, *s;
+  uint64_t seq;
   ssize_t nr;
+  int sc;
 
   assert( cfg.mode == mode_pub );
-  assert( cfg.pub_fd != -1 );
+  assert( c->used );
 
-  nr = recv(cfg.pub_fd, buf, sizeof(buf), MSG_DONTWAIT);
+  nr = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
   if (nr < 0) {
     fprintf(stderr, "recv: %s\n", strerror(errno) );
-    close_client();
-    return -1;
+    return close_client(c);
   }
 
-  if (nr == 0) {
-    fprintf(stderr, "client disconnected\n");
-    close_client();
-    return 0;
-  }
+  if (nr == 0) return close_client(c);
 
   assert(nr > 0);
 
-  if ((cfg.encoding == enc_binary) ||
-      (cfg.encoding == enc_json )) {
+  if (c->encoding != enc_proto) {
     fprintf(stderr, "discarding %zd bytes from client\n", nr);
     return 0;
   }
 
-  assert(cfg.encoding == enc_proto);
-  for (b = buf; b < buf+nr; b++) {
+  for (b = buf; (b < buf+nr) && c->used && (c->encoding == enc_proto); b++) {
+
+    /* projection or filter, up to newline */
+    if (c->spec_want) {
+      s = (c->spec_want == 'p') ? c->proj : c->filt;
+      if (*b != '\n') {
+        if (c->spec_len + 1 == SPECMAX) {
+          fprintf(stderr, "client %s: %c spec too long\n", c->addr, c->spec_want);
+          return close_client(c);
+        }
+        s[c->spec_len++] = *b;
+        continue;
+      }
+      s[c->spec_len] = '\0';
+      c->spec_want = 0;
+      if (c->view) view_put(c->view); /* made again on use */
+      c->view = NULL;
+      continue;
+    }
+
+    /* request argument, possibly split across reads */
+    if (c->rq_op) {
+      c->rq[ c->rq_len++ ] = *b;
+      if (c->rq_len < c->rq_need) continue;
+      c->rq_len = 0;
+      if (c->rq_op == 'k') {
+        c->rq_op = 0;
+        c->stripe = (unsigned char)c->rq[0];
+        c->nstripes = (unsigned char)c->rq[1];
+        if (c->stripe >= c->nstripes) {
+          fprintf(stderr, "client %s: bad stripe %d of %d\n", c->addr,
+            c->stripe, c->nstripes);
+          return close_client(c);
+        }
+        continue;
+      }
+      c->rq_op = 0;
+      memcpy(&seq, c->rq, sizeof(seq));
+      sc = client_replay(c, seq);
+      if (sc < 0) return -1;
+      continue;
+    }
+
     switch (*b) {
       case 'g': 
-        sc = proto_sendcast();
-        if (sc < 0) {
-          close_client();
-          return -1;
-        }
+        sc = proto_sendcast(c);
+        if (sc < 0) return close_client(c);
         break;
       case 'j': 
-        cfg.encoding = enc_json;
-        sc = mod_epoll(EPOLLIN, cfg.fd); /* start ring monitoring */
-        if (sc < 0) return -1;
-        break;
       case 'b': 
-        cfg.encoding = enc_binary;
-        sc = mod_epoll(EPOLLIN, cfg.fd); /* start ring monitoring */
+      case 's': 
+        if (client_view(c) < 0) return close_client(c);
+        c->encoding = (*b == 'j') ? enc_json :
+                      (*b == 'b') ? enc_binary : enc_seq;
+        sc = pub_rewatch(); /* start ring monitoring */
         if (sc < 0) return -1;
         break;
+      case 'r': /* replay; 8-byte sequence number follows */
+        c->rq_op = 'r';
+        c->rq_need = sizeof(uint64_t);
+        break;
+      case 'k': /* stripe; its index and the count follow, a byte each */
+        c->rq_op = 'k';
+        c->rq_need = 2;
+        break;
+      case 'l': /* compress sequenced batches; precedes s|r */
+      case 'z':
+        c->codec = (*b == 'l') ? codec_lz4 : codec_zstd;
+        if (codec_available(c->codec) == 0) {
+          fprintf(stderr, "client %s: %s not built in; not compressing\n",
+            c->addr, (*b == 'l') ? "lz4" : "zstd");
+          c->codec = codec_none;
+        }
+        if (c->codec && (setup_zthread() < 0)) return -1;
+        break;
+      case 'p': /* projection; fields and newline follow */
+      case 'f': /* filter; predicate and newline follow */
+        c->spec_want = *b;
+        c->spec_len = 0;
+        break;
+      case 'm': /* the ring's path, over a unix domain socket */
+        sc = proto_sendring(c);
+        if (sc < 0) return close_client(c);
+        break;
       case 'd': /* disconnect request */
-        close_client();
-        return 0;
+        return close_client(c);
         break;
       case '\n': break;
       default: 
@@ -623,74 +3612,344 @@ int handle_client(void) {
  *
  */
 int accept_client(void) {
-  struct sockaddr_in remote;
+  struct sockaddr_storage remote;
   socklen_t sz = sizeof(remote);
-  int rc = -1, sc;
+  int rc = -1, sc, fd, n, one = 1;
+  struct client *c = NULL;
 
   assert( cfg.mode == mode_pub );
 
-  sc = accept(cfg.listen_fd, (struct sockaddr*)&remote, &sz);
-  if (sc < 0) {
+  fd = accept(cfg.listen_fd, (struct sockaddr*)&remote, &sz);
+  if (fd < 0) {
     fprintf(stderr, "accept: %s\n", strerror(errno));
     goto done;
   }
 
-  /* one client at a time */
-  if (cfg.pub_fd != -1) {
-    fprintf(stderr, "refusing secondary client connection\n");
-    close(sc);
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    if (cfg.clients[n].used == 0) {
+      c = &cfg.clients[n];
+      break;
+    }
+  }
+
+  if (c == NULL) {
+    fprintf(stderr, "refusing client connection: %d clients\n", MAX_CLIENTS);
+    close(fd);
     rc = 0;
     goto done;
   }
 
-  cfg.pub_fd = sc;
-  sc = new_epoll(EPOLLIN, cfg.pub_fd);
-  fprintf(stderr, "connection from %s\n", inet_ntoa(remote.sin_addr));
+  memset(c, 0, sizeof(*c));
+  c->used = 1;
+  c->fd = fd;
+  c->encoding = cfg.startup_encoding;
+  c->local = (cfg.addr.domain == AF_UNIX);
+  if (c->local) snprintf(c->addr, sizeof(c->addr), "unix%d", fd);
+  else inet_ntop(AF_INET, &((struct sockaddr_in*)&remote)->sin_addr,
+                 c->addr, sizeof(c->addr));
+  fprintf(stderr, "connection from %s\n", c->addr);
+
+  sc = new_epoll(EPOLLIN, c->fd);
+  if (sc < 0) goto done;
+
+  if (cfg.cork && !c->local) {
+    sc = setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    if (sc < 0) fprintf(stderr, "TCP_CORK: %s\n", strerror(errno));
+  }
+
+  if (cfg.zc_min && !c->local) {
+    sc = setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+    if (sc < 0) fprintf(stderr, "SO_ZEROCOPY: %s\n", strerror(errno));
+    c->zc_on = (sc < 0) ? 0 : 1;
+  }
 
   /* monitor the ring. except enc_proto waits for client */
-  if (cfg.encoding != enc_proto) {
-    sc = mod_epoll(EPOLLIN, cfg.fd);
-    if (sc < 0) goto done;
+  sc = pub_rewatch();
+  if (sc < 0) goto done;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * setup_mcast_pub
+ *
+ * the datagram socket for -E m, connected to the group
+ *
+ */
+int setup_mcast_pub(void) {
+  int rc = -1, sc;
+
+  if (cfg.spill_max) {
+    fprintf(stderr, "-W spills the replay history; not with -E m\n");
+    goto done;
+  }
+
+  sc = parse_spec(cfg.addr_spec, &cfg.addr);
+  if (sc < 0) goto done;
+  if (cfg.addr.domain != AF_INET) {
+    fprintf(stderr, "multicast needs a group:port\n");
+    goto done;
+  }
+
+  cfg.mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (cfg.mcast_fd == -1) {
+    fprintf(stderr, "socket: %s\n", strerror(errno));
+    goto done;
+  }
+
+  sc = setsockopt(cfg.mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL,
+                  &cfg.mc_ttl, sizeof(cfg.mc_ttl));
+  if (sc < 0) {
+    fprintf(stderr, "setsockopt: %s\n", strerror(errno));
+    goto done;
+  }
+
+  sc = connect(cfg.mcast_fd, ep_addr(&cfg.addr), ep_len(&cfg.addr));
+  if (sc < 0) {
+    fprintf(stderr, "connect: %s\n", strerror(errno));
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * setup_mcast_sub
+ *
+ * bind the group port and join the group (-E m)
+ *
+ */
+int setup_mcast_sub(void) {
+  struct sockaddr_in sa;
+  struct ip_mreq mr;
+  int rc = -1, sc, one = 1, rcvbuf = SUBBUFLEN;
+
+  sc = parse_spec(cfg.addr_spec, &cfg.addr);
+  if (sc < 0) goto done;
+  if (cfg.addr.domain != AF_INET) {
+    fprintf(stderr, "multicast needs a group:port\n");
+    goto done;
+  }
+
+  cfg.mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (cfg.mcast_fd == -1) {
+    fprintf(stderr, "socket: %s\n", strerror(errno));
+    goto done;
+  }
+
+  /* others on this host may be in the group too */
+  sc = setsockopt(cfg.mcast_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (sc < 0) {
+    fprintf(stderr, "setsockopt: %s\n", strerror(errno));
+    goto done;
+  }
+
+  /* room to ride out a burst; the kernel may cap it */
+  sc = setsockopt(cfg.mcast_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (sc < 0) fprintf(stderr, "SO_RCVBUF: %s\n", strerror(errno));
+
+  sa = cfg.addr.in;
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  sc = bind(cfg.mcast_fd, (struct sockaddr*)&sa, sizeof(sa));
+  if (sc < 0) {
+    fprintf(stderr, "bind: %s\n", strerror(errno));
+    goto done;
   }
 
+  if (IN_MULTICAST(ntohl(cfg.addr.in.sin_addr.s_addr))) {
+    memset(&mr, 0, sizeof(mr));
+    mr.imr_multiaddr = cfg.addr.in.sin_addr;
+    mr.imr_interface.s_addr = htonl(INADDR_ANY);
+    sc = setsockopt(cfg.mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr));
+    if (sc < 0) {
+      fprintf(stderr, "IP_ADD_MEMBERSHIP: %s\n", strerror(errno));
+      goto done;
+    }
+  }
+
+  cfg.nstripes = 0;
   rc = 0;
 
  done:
   return rc;
 }
 
+/*
+ * send_view
+ *
+ * ask the publisher for the -P projection and -F filter,
+ * ahead of the g|b|s|r request they apply to
+ *
+ */
+int send_view(int fd) {
+  char req[2 * (SPECMAX + 2)];
+  size_t len = 0;
+  ssize_t nr;
+
+  if (cfg.sub_proj)
+    len += snprintf(req + len, sizeof(req) - len, "p%s\n", cfg.sub_proj);
+  if (cfg.sub_filt)
+    len += snprintf(req + len, sizeof(req) - len, "f%s\n", cfg.sub_filt);
+  if (len == 0) return 0;
+
+  nr = write(fd, req, len);
+  if (nr != (ssize_t)len) {
+    fprintf(stderr, "write: %s\n", (nr < 0) ?
+       strerror(errno) : "incomplete");
+    return -1;
+  }
+
+  return 0;
+}
+
 /*
  * setup_subscriber
  *
  *
  */
 int setup_subscriber(void) {
-  int rc = -1, sc;
+  char req[5 + sizeof(uint64_t)];
+  struct stripe *st;
+  int rc = -1, sc, n;
+  size_t len;
   ssize_t nr;
 
-  cfg.sub_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (cfg.sub_fd == -1) {
-    fprintf(stderr, "socket: %s\n", strerror(errno));
+  if (cfg.sub_retry && (cfg.sub_local || (cfg.encoding == enc_mcast))) {
+    fprintf(stderr, "-A resumes a stream; not with -M or -E m\n");
+    goto done;
+  }
+
+  if (cfg.encoding == enc_mcast) return setup_mcast_sub();
+
+  if (cfg.sub_local && (cfg.sub_proj || cfg.sub_filt || (cfg.nstripes > 1))) {
+    fprintf(stderr, "-M reads the ring as is; not with -P|-F|-N\n");
     goto done;
   }
 
+  /* the checks above leave cfg.addr unset; see sub_lost */
   sc = parse_spec(cfg.addr_spec, &cfg.addr);
   if (sc < 0) goto done;
 
-  sc = connect(cfg.sub_fd, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr));
+  /* for now we induce binary or sequenced publishing mode
+   * with no attempt to validate the ring compatibility.
+   * a known sequence number asks for replay from there.
+   * stripes are merged by sequence number. resuming
+   * after a reconnect needs the sequence numbers too */
+  if (cfg.sub_codec || (cfg.nstripes > 1) || cfg.sub_retry)
+    cfg.encoding = enc_seq;
+  if (cfg.encoding != enc_seq) cfg.encoding = enc_binary;
+
+  for(n = 0; n < cfg.nstripes; n++) {
+    st = &cfg.stripes[n];
+
+    st->fd = socket(cfg.addr.domain, SOCK_STREAM, 0);
+    if (st->fd == -1) {
+      fprintf(stderr, "socket: %s\n", strerror(errno));
+      goto done;
+    }
+
+    sc = connect(st->fd, ep_addr(&cfg.addr), ep_len(&cfg.addr));
+    if (sc < 0) {
+      fprintf(stderr, "connect: %s\n", strerror(errno));
+      goto done;
+    }
+
+    /* the local fast path needs no stream */
+    if (cfg.sub_local) {
+      sc = sub_local(st->fd);
+      if (sc < 0) goto done;
+      if (sc > 0) {
+        close(st->fd);
+        st->fd = -1;
+        cfg.nstripes = 0;
+        break;
+      }
+    }
+
+    /* wake only once this much has arrived. the timer
+     * collects anything smaller that is left waiting */
+    if (cfg.sub_lowat) {
+      sc = setsockopt(st->fd, SOL_SOCKET, SO_RCVLOWAT,
+                      &cfg.sub_lowat, sizeof(cfg.sub_lowat));
+      if (sc < 0) {
+        fprintf(stderr, "setsockopt: %s\n", strerror(errno));
+        goto done;
+      }
+    }
+
+    if (st->buf == NULL) {
+      sc = setup_recvbuf(st);
+      if (sc < 0) goto done;
+    }
+
+    sc = send_view(st->fd);
+    if (sc < 0) goto done;
+
+    len = 0;
+    if (cfg.sub_codec) req[len++] = (cfg.sub_codec == codec_lz4) ? 'l' : 'z';
+    if (cfg.nstripes > 1) {
+      req[len++] = 'k';
+      req[len++] = n;
+      req[len++] = cfg.nstripes;
+    }
+    req[len++] = (cfg.encoding == enc_seq) ? 's' : 'b';
+    if (cfg.sub_seq_known) {
+      req[len-1] = 'r';
+      memcpy(&req[len], &cfg.sub_seq, sizeof(cfg.sub_seq));
+      len += sizeof(cfg.sub_seq);
+    }
+    nr = write(st->fd, req, len);
+    if (nr < 0) {
+      fprintf(stderr, "write: %s\n", strerror(errno));
+      goto done;
+    }
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * sub_reconnect
+ *
+ * on the timer, once the -A backoff is up, connect again. a
+ * known sequence number resumes the stream after the frames
+ * already written; the publisher replays from its history or
+ * spill. with -U, that is after the latest batch written.
+ *
+ */
+int sub_reconnect(void) {
+  int rc = -1, sc, n;
+
+  if (time(NULL) < cfg.retry_at) return 0;
+  cfg.retry_at = 0;
+
+  sc = setup_subscriber();
   if (sc < 0) {
-    fprintf(stderr, "connect: %s\n", strerror(errno));
+    rc = sub_lost();
     goto done;
   }
 
-  /* for now we induce binary publishing mode with
-   * no attempt to validate the ring compatibility */
-  nr = write(cfg.sub_fd, "b", 1);
-  if (nr < 0) {
-    fprintf(stderr, "write: %s\n", strerror(errno));
-    goto done;
+  for(n = 0; n < cfg.nstripes; n++) {
+    sc = new_epoll(EPOLLIN, cfg.stripes[n].fd);
+    if (sc < 0) goto done;
   }
 
+  cfg.retry_secs = 0;
+  cfg.sub_reconnects++;
+  if (cfg.sub_seq_known)
+    fprintf(stderr, "reconnected; resuming at %lu\n", (unsigned long)cfg.sub_seq);
+  else
+    fprintf(stderr, "reconnected\n");
+
   rc = 0;
 
  done:
@@ -706,14 +3965,17 @@ int setup_subscriber(void) {
 int setup_listener(void) {
   int rc = -1, sc, one=1;
 
-  cfg.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  sc = parse_spec(cfg.addr_spec, &cfg.addr);
+  if (sc < 0) goto done;
+
+  cfg.listen_fd = socket(cfg.addr.domain, SOCK_STREAM, 0);
   if (cfg.listen_fd == -1) {
     fprintf(stderr, "socket: %s\n", strerror(errno));
     goto done;
   }
 
-  sc = parse_spec(cfg.addr_spec, &cfg.addr);
-  if (sc < 0) goto done;
+  /* a unix socket path left by an earlier publisher */
+  if (cfg.addr.domain == AF_UNIX) unlink(cfg.addr.un.sun_path);
 
   sc = setsockopt(cfg.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
   if (sc < 0) {
@@ -721,13 +3983,13 @@ int setup_listener(void) {
     goto done;
   }
 
-  sc = bind(cfg.listen_fd, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr));
+  sc = bind(cfg.listen_fd, ep_addr(&cfg.addr), ep_len(&cfg.addr));
   if (sc < 0) {
     fprintf(stderr, "bind: %s\n", strerror(errno));
     goto done;
   }
 
-  sc = listen(cfg.listen_fd, 1);
+  sc = listen(cfg.listen_fd, SOMAXCONN);
   if (sc < 0) {
     fprintf(stderr, "listen: %s\n", strerror(errno));
     goto done;
@@ -752,7 +4014,7 @@ int setup_listener(void) {
  * -1 error
  */
 int fetch_cast(char *spec, char **cast, size_t *castlen) {
-  struct sockaddr_in addr;
+  struct endpoint addr;
   int rc = -1, sc, fd = -1;
   char *buf = NULL;
   ssize_t nr, buflen;
@@ -770,19 +4032,21 @@ int fetch_cast(char *spec, char **cast, size_t *castlen) {
   sc = parse_spec(spec, &addr);
   if (sc < 0) goto done;
 
-  fd = socket(AF_INET, SOCK_STREAM, 0);
+  fd = socket(addr.domain, SOCK_STREAM, 0);
   if (fd < 0) {
     fprintf(stderr, "socket: %s\n", strerror(errno));
     goto done;
   }
 
-  sc = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  sc = connect(fd, ep_addr(&addr), ep_len(&addr));
   if (sc < 0) {
     fprintf(stderr, "connect: %s\n", strerror(errno));
     goto done;
   }
 
-  /* (g)etcast and (d)isconnect */
+  /* (g)etcast, as projected, and (d)isconnect */
+  sc = send_view(fd);
+  if (sc < 0) goto done;
   nr = write(fd, "gd", 2);
   if (nr != 2) {
     fprintf(stderr, "write: %s\n", (nr < 0) ? 
@@ -828,8 +4092,13 @@ int main(int argc, char *argv[]) {
   char unit, *c, *fmt, *out, *cmd;
   struct epoll_event ev;
   struct shr_stat stat;
+  struct stripe *st;
+  struct client *cl;
+  struct batch *b;
+  struct zform *z;
   size_t fmt_len, len;
   cfg.prog = argv[0];
+  for(n = 0; n < MAX_STRIPES; n++) cfg.stripes[n].fd = -1;
 
   if (argc < 3) usage();
 
@@ -861,7 +4130,7 @@ int main(int argc, char *argv[]) {
       argc--;
   }
 
-  while ( (opt = getopt(argc,argv,"vs:m:bf:po:C:E:R:")) > 0) {
+  while ( (opt = getopt(argc,argv,"vs:m:bf:po:C:E:R:cz:Q:S:L:Kr:l:Z:P:F:N:UMD:T:AW:")) > 0) {
     switch(opt) {
       default : usage(); break;
       case 'v': cfg.verbose++; break;
@@ -883,11 +4152,68 @@ int main(int argc, char *argv[]) {
                   case 'j': cfg.encoding = enc_json; break;
                   case 'b': cfg.encoding = enc_binary; break;
                   case 'p': cfg.encoding = enc_proto; break;
+                  case 's': cfg.encoding = enc_seq; break;
+                  case 'm': cfg.encoding = enc_mcast; break;
                   default : usage(); break;
                 }
                 cfg.startup_encoding = cfg.encoding;
                 break;
       case 'o': cfg.libopts = strdup(optarg); break;
+      case 'c': cfg.cork = 1; break;
+      case 'L': cfg.sub_lowat = atoi(optarg); break;
+      case 'K': cfg.pub_crc = 1; break;
+      case 'l': cfg.zlevel = atoi(optarg); break;
+      case 'Z': if      (!strcmp(optarg, "lz4"))  cfg.sub_codec = codec_lz4;
+                else if (!strcmp(optarg, "zstd")) cfg.sub_codec = codec_zstd;
+                else usage();
+                if (codec_available(cfg.sub_codec) == 0) {
+                  fprintf(stderr, "%s: not built in\n", optarg);
+                  exit(-1);
+                }
+                break;
+      case 'r': cfg.sub_seq = strtoull(optarg, NULL, 10);
+                cfg.sub_seq_known = 1;
+                cfg.encoding = enc_seq;
+                break;
+      case 'P':
+      case 'F': if ((strlen(optarg) >= SPECMAX) || strchr(optarg, '\n')) usage();
+                if (opt == 'P') cfg.sub_proj = strdup(optarg);
+                else            cfg.sub_filt = strdup(optarg);
+                break;
+      case 'N': cfg.nstripes = atoi(optarg);
+                if ((cfg.nstripes < 1) || (cfg.nstripes > MAX_STRIPES)) usage();
+                break;
+      case 'U': cfg.sub_unordered = 1; break;
+      case 'M': cfg.sub_local = 1; break;
+      case 'A': cfg.sub_retry = 1; break;
+      case 'W':  /* replay spill size */
+         sc = sscanf(optarg, "%zu%c", &cfg.spill_max, &unit);
+         if (sc == 0) usage();
+         if (sc == 2) {
+            switch (unit) {
+              case 'g': case 'G': cfg.spill_max *= 1024; /* fall through */
+              case 'm': case 'M': cfg.spill_max *= 1024; /* fall through */
+              case 'k': case 'K': cfg.spill_max *= 1024; break;
+              default: usage(); break;
+            }
+         }
+         break;
+      case 'D': cfg.dgram_max = atol(optarg);
+                if ((cfg.dgram_max < sizeof(struct dgram_hdr) + sizeof(uint32_t)) ||
+                    (cfg.dgram_max > DGRAM_MAX)) usage();
+                break;
+      case 'T': cfg.mc_ttl = atoi(optarg); break;
+      case 'z': cfg.zc_min = atol(optarg); break;
+      case 'Q': cfg.pub_maxq = atol(optarg);
+                if ((cfg.pub_maxq < 1) || (cfg.pub_maxq > PUBMAXQ)) usage();
+                break;
+      case 'S': switch (*optarg) {
+                  case 'd': cfg.slow = slow_drop; break;
+                  case 'x': cfg.slow = slow_disconnect; break;
+                  case 'b': cfg.slow = slow_block; break;
+                  default : usage(); break;
+                }
+                break;
       case 's':  /* ring size */
          sc = sscanf(optarg, "%ld%c", &cfg.size, &unit);
          if (sc == 0) usage();
@@ -910,6 +4236,8 @@ int main(int argc, char *argv[]) {
              case 'k': cfg.flags |= CCR_KEEPEXIST; break;
              case 'l': cfg.flags |= CCR_MLOCK; break;
              case 's': cfg.flags |= CCR_SYNC; break;
+             case 'h': cfg.flags |= CCR_HUGEPAGE; break;
+             case 'p': cfg.flags |= CCR_PREFAULT; break;
              default: usage(); break;
            }
            c++;
@@ -971,6 +4299,27 @@ int main(int argc, char *argv[]) {
         if (stat.flags & SHR_MLOCK)   printf("mlock ");
         if (stat.flags & SHR_SYNC)    printf("sync ");
         printf("\n");
+
+        /* frame statistics, if writers keep them */
+        struct ccr_stat cs;
+        cfg.ccr = ccr_open(cfg.ring, CCR_RDONLY|CCR_NONBLOCK, 0);
+        if (cfg.ccr && (ccr_stat(cfg.ccr, &cs) == 0) && cs.frames) {
+          printf(" frame-max-len %lu\n"
+                 " frame-avg-len %lu\n",
+             (unsigned long)cs.max_frame,
+             (unsigned long)(cs.bytes / cs.frames));
+        }
+
+        /* stream statistics, if a pub or sub is running */
+        char path[PATH_MAX], line[100], *tag[] = {"pub", "sub"};
+        FILE *lf;
+        for(n = 0; n < 2; n++) {
+          snprintf(path, sizeof(path), "%s.%s", cfg.ring, tag[n]);
+          lf = fopen(path, "r");
+          if (lf == NULL) continue;
+          while (fgets(line, sizeof(line), lf)) printf("%s", line);
+          fclose(lf);
+        }
       }
 
       if (cfg.mode == mode_getfmt) {
@@ -989,8 +4338,18 @@ int main(int argc, char *argv[]) {
       break;
 
     case mode_pub:
-      sc = setup_listener();
+      sc = (cfg.encoding == enc_mcast) ? setup_mcast_pub() : setup_listener();
+      if (sc < 0) goto done;
+      /* number frames by the ring's read count, so that
+       * sequence numbers carry across publisher restarts */
+      cfg.shr = shr_open(cfg.ring, SHR_RDONLY);
+      if (cfg.shr == NULL) goto done;
+      sc = shr_stat(cfg.shr, &stat, NULL);
       if (sc < 0) goto done;
+      cfg.pub_seq = stat.mr;
+      shr_close(cfg.shr);
+      cfg.shr = NULL;
+      if (cfg.spill_max && (setup_spill() < 0)) goto done;
       /* FALL THROUGH */
     case mode_lib:
     case mode_read:
@@ -1000,12 +4359,18 @@ int main(int argc, char *argv[]) {
       if (cfg.ccr == NULL) goto done;
       cfg.fd = ccr_get_selectable_fd(cfg.ccr);
       if (cfg.fd < 0) goto done;
+      if ((cfg.mode == mode_pub) && (setup_pub_sink() < 0)) goto done;
       break;
 
     case mode_sub:
       cfg.shr = shr_open(cfg.ring, SHR_WRONLY);
       if (cfg.shr == NULL) goto done;
+      /* frames go in by shr_writev; a ccr handle keeps the stats */
+      cfg.stat_ccr = ccr_open(cfg.ring, CCR_WRONLY);
+      if (cfg.stat_ccr == NULL) goto done;
       sc = setup_subscriber();
+      /* with -A, a publisher not up yet is waited for */
+      if ((sc < 0) && cfg.addr.domain) sc = sub_lost();
       if (sc < 0) goto done;
       break;
 
@@ -1046,14 +4411,21 @@ int main(int argc, char *argv[]) {
   sc = new_epoll(EPOLLIN, cfg.signal_fd);
   if (sc < 0) goto done;
 
-  if (cfg.mode == mode_pub) {
+  if ((cfg.mode == mode_pub) && (cfg.listen_fd != -1)) {
     sc = new_epoll(EPOLLIN, cfg.listen_fd);
     if (sc < 0) goto done;
   }
 
   if (cfg.mode == mode_sub) {
-    sc = new_epoll(EPOLLIN, cfg.sub_fd);
-    if (sc < 0) goto done;
+    for(n = 0; n < cfg.nstripes; n++) {
+      if (cfg.stripes[n].fd == -1) continue; /* see sub_lost */
+      sc = new_epoll(EPOLLIN, cfg.stripes[n].fd);
+      if (sc < 0) goto done;
+    }
+    if (cfg.mcast_fd != -1) {
+      sc = new_epoll(EPOLLIN, cfg.mcast_fd);
+      if (sc < 0) goto done;
+    }
   }
 
   /* most modes poll the ring immediately */
@@ -1067,8 +4439,14 @@ int main(int argc, char *argv[]) {
       if (sc < 0) goto done;
       break;
     case mode_pub:
-      /* poll when connected */
-      sc = new_epoll(0, cfg.fd);
+      /* poll when connected; multicast always */
+      sc = new_epoll((cfg.encoding == enc_mcast) ? EPOLLIN : 0, cfg.fd);
+      if (sc < 0) goto done;
+      break;
+    case mode_sub:
+      /* the publisher's ring, on the local fast path */
+      if (cfg.fd == -1) break;
+      sc = new_epoll(EPOLLIN, cfg.fd);
       if (sc < 0) goto done;
       break;
     default:
@@ -1095,20 +4473,76 @@ int main(int argc, char *argv[]) {
     else if (ev.data.fd == cfg.fd)        { if (handle_io()     < 0) goto done;}
     else if (ev.data.fd == cfg.signal_fd) { if (handle_signal() < 0) goto done;}
     else if (ev.data.fd == cfg.listen_fd) { if (accept_client() < 0) goto done;}
-    else if (ev.data.fd == cfg.pub_fd)    { if (handle_client() < 0) goto done;}
-    else if (ev.data.fd == cfg.sub_fd)    { if (do_subscriber() < 0) goto done;}
-    else { assert(0); }
+    else if (ev.data.fd == cfg.mcast_fd)  { if (mcast_recv()    < 0) goto done;}
+    else if ((st = find_stripe(ev.data.fd)) != NULL)
+                                          { if (do_subscriber(st) < 0) goto done;}
+    else if (ev.data.fd == cfg.zevent_fd) { if (handle_zdone()   < 0) goto done;}
+    else if ((cl = find_client(ev.data.fd)) == NULL) { assert(0); }
+    else if (ev.events & (EPOLLOUT|EPOLLERR))
+                                          { if (client_ready(cl, ev.events) < 0) goto done;}
+    else                                  { if (handle_client(cl) < 0) goto done;}
   } while (ec >= 0);
 
   rc = 0;
  
  done:
+  if ((cfg.mode == mode_pub) || (cfg.mode == mode_sub)) link_stat(1);
+  if (cfg.zthread_started) {
+    pthread_mutex_lock(&cfg.zlock);
+    cfg.zstop = 1;
+    pthread_cond_signal(&cfg.zcond);
+    pthread_mutex_unlock(&cfg.zlock);
+    pthread_join(cfg.zthread, NULL);
+  }
+  if (cfg.zevent_fd != -1) close(cfg.zevent_fd);
   if (cfg.signal_fd != -1) close(cfg.signal_fd);
   if (cfg.listen_fd != -1) close(cfg.listen_fd);
-  if (cfg.pub_fd != -1) close(cfg.pub_fd);
-  if (cfg.sub_fd != -1) close(cfg.sub_fd);
+  if (cfg.mcast_fd != -1) close(cfg.mcast_fd);
+  spill_close();
+  if ((cfg.listen_fd != -1) && (cfg.addr.domain == AF_UNIX))
+    unlink(cfg.addr.un.sun_path);
+  for(n = 0; n < MAX_CLIENTS; n++) {
+    cl = &cfg.clients[n];
+    while (cl->used && cl->q_used) {
+      batch_put(cl->q[cl->q_head].b);
+      cl->q_head = (cl->q_head + 1) % PUBMAXQ;
+      cl->q_used--;
+    }
+    if (cl->used && cl->view) view_put(cl->view);
+    if (cl->used) close(cl->fd);
+  }
+  while (cfg.hist_used) {
+    batch_put(cfg.hist[cfg.hist_head]);
+    cfg.hist_head = (cfg.hist_head + 1) % PUBMAXQ;
+    cfg.hist_used--;
+  }
+  while (cfg.ztodo) {
+    z = cfg.ztodo; /* may lie in a ring read, gone with the put */
+    cfg.ztodo = z->next;
+    batch_put(z->b);
+  }
+  while (cfg.zdone) {
+    z = cfg.zdone;
+    cfg.zdone = z->next;
+    batch_put(z->b);
+  }
+  while (cfg.free_batches) {
+    b = cfg.free_batches;
+    cfg.free_batches = b->next;
+    batch_free(b);
+  }
+  sink_fini(&cfg.sink);
+  for(n = 0; n < cfg.nstripes; n++) {
+    st = &cfg.stripes[n];
+    if (st->fd != -1) close(st->fd);
+    if (st->buf) munmap(st->buf, SUBBUFLEN * 2);
+  }
+  if (cfg.sub_iov) free(cfg.sub_iov);
+  if (cfg.sub_zbuf) free(cfg.sub_zbuf);
   if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
   if (cfg.format_src) free(cfg.format_src);
+  if (cfg.sub_proj) free(cfg.sub_proj);
+  if (cfg.sub_filt) free(cfg.sub_filt);
   /* module cleanup */
   if (cfg.dl && cfg.modccr.mod_fini) cfg.modccr.mod_fini(&cfg.modccr);
   if (cfg.lib) free(cfg.lib);
@@ -1116,6 +4550,7 @@ int main(int argc, char *argv[]) {
   if (cfg.dl) dlclose(cfg.dl);
 
   if (cfg.shr) shr_close(cfg.shr);
+  if (cfg.stat_ccr) ccr_close(cfg.stat_ccr);
   if (cfg.ccr) ccr_close(cfg.ccr);
   /* don't close cfg.fd - it's done in ccr_close */
   if (cfg.addr_spec) free(cfg.addr_spec);
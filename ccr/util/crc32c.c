@@ -0,0 +1,92 @@
+#include <string.h>
+#include "crc32c.h"
+
+#define POLY 0x82f63b78 /* reflected Castagnoli */
+
+static uint32_t table[8][256];
+static int table_ready;
+
+static void make_table(void) {
+  uint32_t c;
+  int n, k;
+
+  for(n = 0; n < 256; n++) {
+    c = n;
+    for(k = 0; k < 8; k++) c = (c & 1) ? ((c >> 1) ^ POLY) : (c >> 1);
+    table[0][n] = c;
+  }
+
+  for(n = 0; n < 256; n++) {
+    c = table[0][n];
+    for(k = 1; k < 8; k++) {
+      c = table[0][c & 0xff] ^ (c >> 8);
+      table[k][n] = c;
+    }
+  }
+
+  table_ready = 1;
+}
+
+/* slicing-by-8 in software */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t w;
+
+  if (table_ready == 0) make_table();
+
+  while (len && ((uintptr_t)p & 7)) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+
+  while (len >= 8) {
+    memcpy(&w, p, sizeof(w));
+    w ^= crc;
+    crc = table[7][ w        & 0xff] ^
+          table[6][(w >>  8) & 0xff] ^
+          table[5][(w >> 16) & 0xff] ^
+          table[4][(w >> 24) & 0xff] ^
+          table[3][(w >> 32) & 0xff] ^
+          table[2][(w >> 40) & 0xff] ^
+          table[1][(w >> 48) & 0xff] ^
+          table[0][ w >> 56        ];
+    p += 8;
+    len -= 8;
+  }
+
+  while (len--) crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t w, c = crc;
+
+  while (len && ((uintptr_t)p & 7)) {
+    c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+    len--;
+  }
+
+  while (len >= 8) {
+    memcpy(&w, p, sizeof(w));
+    c = __builtin_ia32_crc32di(c, w);
+    p += 8;
+    len -= 8;
+  }
+
+  while (len--) c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+
+  return (uint32_t)c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+
+  crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("sse4.2")) return ~crc32c_hw(crc, p, len);
+#endif
+  return ~crc32c_sw(crc, p, len);
+}
@@ -0,0 +1,10 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * crc32c (Castagnoli) of buf, continuing from crc.
+ * start with crc 0; feed the result back in to extend it.
+ * uses the SSE4.2 crc32 instruction where the cpu has it.
+ *
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
@@ -11,17 +11,25 @@
 
 #include "ccr.h"
 #include "sconf.h"
+#include "sink.h"
 
 #define adim(x) (sizeof(x)/sizeof(*x))
 #define NUM_IOV 100000
-#define BATCH_BUF_SZ (60*NUM_IOV)
+#define BATCH_BUF_SZ (60*NUM_IOV) /* largest batch buffer; see bufpool.h */
 #define FLUSH_TIMEOUT_MS 10000
 
+/* batches are read, encoded and recycled by the sink engine (see
+ * sink.h), driven from mod_work, and produced asynchronously, in
+ * place. a batch holds its read buffer (and json copies) until the
+ * delivery report of its last message; only when all batches= are
+ * awaiting reports does mod_work wait for one */
+#define DR_WAIT_MS 100
 struct mod_data {
   char *broker;  /* kafka broker */
   char *topic;   /* topic to publish to */
-  int json;      /* 1 to produce json not binary */
-  int pretty;    /* 1 to pretty-print json */
+  char *key;     /* message key from this field, or NULL */
+  int kf;        /* index of the key field; -1 until known */
+  int partitions;/* >0 to hash the key to one of these */
   unsigned n_pub;/* num messages published */
   unsigned n_ack;/* num messages confirmed */
   struct shr *status_ring; /* ring for kafka status */
@@ -37,8 +45,8 @@ struct mod_data {
   rd_kafka_topic_conf_t *topic_conf;
 
   /* batch read support */
-  struct iovec iov[NUM_IOV];
-  char buf[BATCH_BUF_SZ];
+  struct sink s;
+  struct sink_ring *r; /* the ring, once mod_work has it */
 };
 
 static void err_cb (rd_kafka_t *rk, int err, const char *reason, void *opaque) {
@@ -52,9 +60,12 @@ static void delivery_report_cb ( rd_kafka_t *rk, const rd_kafka_message_t *msg,
   void *opaque) {
   struct modccr *m = (struct modccr *)opaque;
   struct mod_data *md = (struct mod_data*)m->data;
+  struct sink_batch *bt = (struct sink_batch*)msg->_private;
   const char *topic;
   size_t len;
 
+  sink_ack(bt, 1); /* the last one recycles the batch */
+
   if (msg->err != 0) {
     fprintf(stderr, "librdkafka: message delivery failure: %s\n",
       rd_kafka_err2str(msg->err));
@@ -142,6 +153,8 @@ static int mod_periodic(struct modccr *m) {
   /* invoke callbacks, draining */
   do { n = rd_kafka_poll(md->k, 0); } while (n > 0);
 
+  sink_period(&md->s);
+
   /* periodiclly report kafka offset */
   if (md->status_ring && (md->n_pub > 0)) {
 
@@ -151,13 +164,15 @@ static int mod_periodic(struct modccr *m) {
                 "\"partition\": %u,\n"
                 "\"offset\": %zu,\n"
                 "\"published\": %u,\n"
-                "\"confirmed\": %u\n"
+                "\"confirmed\": %u,\n"
+                "\"buffer_hwm\": %zu\n"
               "}\n",
               md->topic,
               (unsigned)md->partition,
               (size_t)md->offset,
               md->n_pub,
-              md->n_ack);
+              md->n_ack,
+              md->r ? md->r->w->pool.hwm_bytes : 0);
 
     if (sc == -1) {
       fprintf(stderr, "asprintf: failed\n");
@@ -182,100 +197,149 @@ static int mod_periodic(struct modccr *m) {
 static int mod_fini(struct modccr *m) {
   if (m->verbose) fprintf(stderr, "mod_fini\n");
   struct mod_data *md = (struct mod_data*)m->data;
+  rd_kafka_resp_err_t err;
+
+  /* deliver the batches in flight; only then are they free */
+  if (md->k && md->r && md->r->in_flight) {
+    err = rd_kafka_flush(md->k, FLUSH_TIMEOUT_MS);
+    if (err == RD_KAFKA_RESP_ERR__TIMED_OUT)
+      fprintf(stderr, "timeout rd_kafka_flush, %d batches undelivered\n",
+        md->r->in_flight);
+  }
 
+  /* batches still referenced by librdkafka are left */
+  sink_fini(&md->s);
   if (md->broker) free(md->broker);
   if (md->topic) free(md->topic);
+  if (md->key) free(md->key);
   if (md->status_ring) shr_close(md->status_ring);
   free(md);
 
   return 0;
 }
 
-static int mod_work(struct modccr *m, struct ccr *ccr) {
-  int sc, fl=0, rc = -1, msgflags=0, json_fl=0;
-  struct mod_data *md = (struct mod_data*)m->data;
-  size_t niov, i, len, oln;
-  rd_kafka_resp_err_t err;
-  const char *serr;
-  ssize_t nr;
-  char *out, *msg;
-  struct cc *cc;
-
-  cc = ccr_get_cc(ccr);
-  json_fl |= md->pretty ? CCR_PRETTY : 0;
-
-  if (md->json)
-    msgflags = RD_KAFKA_MSG_F_COPY;
-
-  niov = NUM_IOV;
-  nr = ccr_readv(ccr, fl, md->buf, BATCH_BUF_SZ, md->iov, &niov);
-  if (nr < 0) goto done;
-  if (nr == 0) {
-    rc = 0;
-    goto done;
+/*
+ * enqueue
+ *
+ * enqueue the messages with rd_kafka_produce_batch. those
+ * refused for a full queue are retried once callbacks have
+ * drained it some. with partitions=, each message has its
+ * own partition; otherwise the partitioner runs per message
+ *
+ */
+static int enqueue(struct mod_data *md, rd_kafka_message_t *msgs, size_t n) {
+  int rc = -1, nq, msgflags;
+  size_t i, left;
+
+  msgflags = md->partitions ? RD_KAFKA_MSG_F_PARTITION : 0;
+  while (n > 0) {
+    for(i = 0; i < n; i++) msgs[i].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    nq = rd_kafka_produce_batch(md->t, RD_KAFKA_PARTITION_UA, msgflags,
+                                msgs, n);
+    md->n_pub += nq;
+    if ((size_t)nq == n) break;
+
+    /* keep the refused messages, in order, for another try */
+    for(left = 0, i = 0; i < n; i++) {
+      if (msgs[i].err == RD_KAFKA_RESP_ERR_NO_ERROR) continue;
+      if (msgs[i].err != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+        fprintf(stderr, "rd_kafka_produce_batch: %s\n",
+          rd_kafka_err2str(msgs[i].err));
+        goto done;
+      }
+      msgs[left++] = msgs[i];
+    }
+    n = left;
+    rd_kafka_poll(md->k, DR_WAIT_MS);
   }
 
-  /* publish one message at a time
-   *
-   * librdkafka returns an "error" if the producer queue
-   * is full, which requires draining using rd_kafka_poll
-   * and retrying (c.f. examples/rdkafka_simple_producer.c)
-   */
-  i = 0;
-  while (i < niov) {
+  rc = 0;
 
-    /* let it invoke callbacks */
-    rd_kafka_poll(md->k, 0);
+ done:
+  return rc;
+}
 
-    msg = md->iov[i].iov_base;
-    len = md->iov[i].iov_len;
+/*
+ * send_batch
+ *
+ * queue a batch read by the sink to librdkafka without copying:
+ * a message per frame, in the read buffer's scratch, keyed from
+ * its flat frame. each delivery report acks its frame to the
+ * sink, which recycles the batch with the last
+ *
+ */
+static int send_batch(struct sink_batch *bt) {
+  struct mod_data *md = (struct mod_data*)bt->r->data;
+  rd_kafka_message_t *msgs = bt->aux;
+  int rc = -1, sc;
+  size_t i, klen;
+  struct cc *cc;
+  char *key;
 
-    if (md->json) {
-      sc = cc_to_json(cc, &out, &oln, msg, len, json_fl);
+  cc = ccr_get_cc(bt->r->ring);
+  for(i = 0; i < bt->n; i++) {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+
+    /* the key, and with partitions= its partition */
+    if (md->key) {
+      sc = frame_key(cc, md->key, &md->kf, bt->b->iov[i].iov_base,
+                     bt->b->iov[i].iov_len, &key, &klen);
       if (sc < 0) goto done;
-    } else {
-      out = msg;
-      oln = len;
+      msgs[i].key = key;
+      msgs[i].key_len = klen;
+      if (md->partitions)
+        msgs[i].partition = jump_hash(hash_bytes(key, klen), md->partitions);
     }
 
-    sc = rd_kafka_produce(md->t, RD_KAFKA_PARTITION_UA,
-         msgflags, out, oln, NULL, 0, NULL);
-    if (sc == 0) {
-      /* success */
-      md->n_pub++;
-      i++;
-      continue;
-    }
+    /* the frame as sent: flat, or its json copy */
+    msgs[i].payload = bt->iov[i].iov_base;
+    msgs[i].len = bt->iov[i].iov_len;
+    msgs[i]._private = bt;
+  }
 
-    /* error: momentary queue-full or fatal error */
-    assert(sc < 0);
+  sc = enqueue(md, msgs, bt->n);
+  if (sc < 0) goto done;
 
-#if RD_KAFKA_VERSION < 0x00090100
-    if (errno == ENOBUFS)
-      continue;
+  if (md->s.verbose) fprintf(stderr, "%zu messages sent\n", bt->n);
+  rc = 0;
 
-    serr = rd_kafka_err2str( rd_kafka_errno2err(errno) );
-    fprintf(stderr, "rd_kafka_produce: %s\n", serr);
-    goto done;
-#else
-    if (rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL)
-      continue;
+ done:
+  return rc;
+}
 
-    serr = rd_kafka_err2str( rd_kafka_last_error() );
-    fprintf(stderr, "rd_kafka_produce: %s\n", serr);
-    goto done;
-#endif
+static struct sink_ops ops = {
+  .send_batch = send_batch,
+};
+
+/*
+ * mod_work
+ *
+ * the ring is readable: have the sink read a batch and send it.
+ * the batch is recycled by the delivery reports, so the broker
+ * pipeline stays full while the ring goes on being read. if
+ * every batch is still in flight, wait for reports to free one
+ *
+ */
+static int mod_work(struct modccr *m, struct ccr *ccr) {
+  struct mod_data *md = (struct mod_data*)m->data;
+  int rc = -1, sc;
+
+  /* the ring, on first use */
+  if (md->r == NULL) {
+    sc = sink_attach(&md->s, ccr, md->topic, md);
+    if (sc < 0) goto done;
+    sc = sink_start(&md->s);
+    if (sc < 0) goto done;
+    md->r = &md->s.ringv[0];
   }
 
+  /* let callbacks recycle batches; wait if none is free */
+  rd_kafka_poll(md->k, 0);
+  while (md->r->in_flight == md->s.nbatch) rd_kafka_poll(md->k, DR_WAIT_MS);
 
-  /* flush delivery queue, only then can md->buf be reused */
-  do {
-    err = rd_kafka_flush(md->k, FLUSH_TIMEOUT_MS);
-    if (err == RD_KAFKA_RESP_ERR__TIMED_OUT)
-      fprintf(stderr, "timeout rd_kafka_flush, retrying\n");
-  } while (err != RD_KAFKA_RESP_ERR_NO_ERROR);
+  sc = sink_step(md->r);
+  if (sc < 0) goto done;
 
-  fprintf(stderr, "%zu messages sent\n", niov);
   rc = 0;
 
  done:
@@ -283,7 +347,7 @@ static int mod_work(struct modccr *m, struct ccr *ccr) {
 }
 
 void mod_usage(void) {
-  fprintf(stderr, "broker=<broker>,topic=<topic>,json=[0|1],pretty=[0|1],status-ring=<file>\n");
+  fprintf(stderr, "broker=<broker>,topic=<topic>,json=[0|1],pretty=[0|1],status-ring=<file>,batches=<n>,key=<field>,partitions=<n>\n");
 }
 
 int ccr_module_init(struct modccr *m) {
@@ -299,6 +363,11 @@ int ccr_module_init(struct modccr *m) {
   if (md == NULL) goto done;
 
   m->data = md;
+  sink_init(&md->s, &ops, md);
+  md->s.verbose = m->verbose;
+  md->s.max_len = BATCH_BUF_SZ;
+  md->s.max_niov = NUM_IOV;
+  md->s.aux_per = sizeof(rd_kafka_message_t);
 
   /* parse options */
   char *broker = NULL;
@@ -310,12 +379,24 @@ int ccr_module_init(struct modccr *m) {
   int pretty, json;
   size_t pretty_opt=0;
   size_t json_opt=0;
+  int batches;
+  size_t batches_opt=0;
+  char *key = NULL;
+  size_t key_len=0;
+  int partitions;
+  size_t partitions_opt=0;
 
   struct sconf sc[] = {
     {.name = "broker", .type = sconf_str, .value = &broker,.vlen = &broker_len},
     {.name = "topic",  .type = sconf_str, .value = &topic, .vlen = &topic_len },
     {.name = "pretty", .type = sconf_int, .value = &pretty,.vlen = &pretty_opt},
     {.name = "json",   .type = sconf_int, .value = &json,  .vlen = &json_opt},
+    {.name = "batches",.type = sconf_int, .value = &batches,.vlen = &batches_opt},
+    {.name = "key",    .type = sconf_str, .value = &key,   .vlen = &key_len},
+    {.name = "partitions",
+       .type = sconf_int,
+       .value = &partitions,
+       .vlen = &partitions_opt},
     {.name = "status-ring",  
        .type = sconf_str,
        .value = &status_ring_name, 
@@ -328,8 +409,15 @@ int ccr_module_init(struct modccr *m) {
   if (broker == NULL) goto done;
   if ( (md->topic = strndup(topic, topic_len)) == NULL) goto done;
   if ( (md->broker = strndup(broker, broker_len)) == NULL) goto done;
-  md->pretty = pretty_opt ? pretty : 0;
-  md->json = json_opt ? json : 0;
+  md->s.json = json_opt ? json : 0;
+  md->s.json_flags = (pretty_opt && pretty) ? CC_PRETTY : 0;
+  md->s.nbatch = batches_opt ? batches : SINK_DEFAULT_BATCHES;
+  if ((md->s.nbatch < 1) || (md->s.nbatch > SINK_MAX_BATCHES)) goto done;
+  md->kf = -1;
+  if (key && ((md->key = strndup(key, key_len)) == NULL)) goto done;
+  md->partitions = partitions_opt ? partitions : 0;
+  if (md->partitions < 0) goto done;
+  if (md->partitions && (md->key == NULL)) goto done;
   if (status_ring_name) {
     status_ring_name = strndup(status_ring_name, status_ring_len);
     if (status_ring_name == NULL) goto done;
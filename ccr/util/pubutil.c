@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "pubutil.h"
+
+/* fnv-1a */
+uint64_t hash_bytes(char *b, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for(i = 0; i < len; i++) {
+    h ^= (unsigned char)b[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* jump consistent hash (Lamping and Veach): a bucket in [0,n)
+ * that moves for only 1/n of the keys when a bucket is added */
+int jump_hash(uint64_t key, int n) {
+  int64_t b = -1, j = 0;
+
+  while (j < n) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+  }
+  return (int)b;
+}
+
+/*
+ * frame_key
+ *
+ * locate the key field in the flat frame, and return its value
+ * in place (see pubutil.h). *kf caches the field's index; the
+ * caller sets it to -1 until it is known
+ *
+ */
+int frame_key(struct cc *cc, char *field, int *kf, char *b, size_t len,
+              char **key, size_t *klen) {
+  struct cc_map *map;
+  int rc = -1, sc, count, k;
+  char *a, *end;
+
+  sc = cc_dissect(cc, &map, &count, b, len, 0);
+  if (sc < 0) {
+    fprintf(stderr, "frame does not match cast\n");
+    goto done;
+  }
+
+  if (*kf < 0) {
+    for(k = 0; k < count; k++)
+      if (!strcmp(map[k].name, field)) break;
+    if (k == count) {
+      fprintf(stderr, "no field %s\n", field);
+      goto done;
+    }
+    *kf = k;
+  }
+
+  /* the field extends to the next one, or the frame end */
+  k = *kf;
+  a = map[k].addr;
+  end = (k + 1 < count) ? (char*)map[k+1].addr : (b + len);
+  switch (map[k].type) {
+    case CC_str:
+    case CC_blob:  a += sizeof(uint32_t); break;
+    case CC_str8:
+    case CC_ipv46: a += sizeof(uint8_t); break;
+    default: break;
+  }
+
+  *key = a;
+  *klen = end - a;
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* keep a copy of a json frame. the buffer starts at len plus hint,
+ * the size of the read it comes from, and doubles as need be */
+int keep_json(struct json_buf *jb, char *out, size_t len, size_t hint) {
+  size_t size;
+  char *tmp;
+
+  if (jb->size - jb->used < len) {
+    size = jb->size ? jb->size : (len + hint);
+    while (size - jb->used < len) size *= 2;
+    tmp = realloc(jb->buf, size);
+    if (tmp == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return -1;
+    }
+    jb->buf = tmp;
+    jb->size = size;
+  }
+
+  memcpy(jb->buf + jb->used, out, len);
+  jb->used += len;
+  return 0;
+}
+
+/* let go a copy buffer much larger than reads of len now need */
+void json_trim(struct json_buf *jb, size_t len) {
+  if (jb->size <= 8 * len) return;
+  free(jb->buf);
+  jb->buf = NULL;
+  jb->size = 0;
+}
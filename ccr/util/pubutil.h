@@ -0,0 +1,29 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "cc.h"
+
+/*
+ * helpers shared by the ring publishers.
+ *
+ * frames are spread over shards or partitions by a consistent hash
+ * of a key field (-k). the key is the field's value in place in the
+ * flat frame: the bytes of a string or blob, without their length,
+ * or a fixed width value as is. every publisher takes the key this
+ * way, so a key hashes alike whichever publisher carries it.
+ *
+ * json frames are kept in a copy buffer per batch, as cc_to_json
+ * reuses its own.
+ *
+ */
+struct json_buf {
+  char *buf;
+  size_t size;
+  size_t used;
+};
+
+uint64_t hash_bytes(char *b, size_t len);
+int jump_hash(uint64_t key, int n);
+int frame_key(struct cc *cc, char *field, int *kf, char *b, size_t len,
+              char **key, size_t *klen);
+int keep_json(struct json_buf *jb, char *out, size_t len, size_t hint);
+void json_trim(struct json_buf *jb, size_t len);
@@ -0,0 +1,834 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include "sink.h"
+
+/* ring reads come from a buffer pool per thread (see bufpool.h),
+ * sized to the reads, up to these by default */
+#define NUM_IOV 100000
+#define BUF_LEN (NUM_IOV * 1000)
+
+/* signals that we'll accept via signalfd in epoll */
+static int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT,SIGALRM};
+
+static int new_epoll(int epoll_fd, int events, int fd) {
+  int rc;
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events = events;
+  ev.data.fd= fd;
+  rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  if (rc == -1) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
+  }
+  return rc;
+}
+
+static int mod_epoll(int epoll_fd, int events, int fd) {
+  int rc;
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events = events;
+  ev.data.fd= fd;
+  rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  if (rc == -1) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
+  }
+  return rc;
+}
+
+/*
+ * sink_init
+ *
+ * defaults: one thread, four batches in flight per ring, binary
+ * frames. the caller may set the fields of s before sink_run
+ *
+ */
+void sink_init(struct sink *s, struct sink_ops *ops, void *data) {
+  memset(s, 0, sizeof(*s));
+  s->ops = ops;
+  s->data = data;
+  s->nbatch = SINK_DEFAULT_BATCHES;
+  s->max_len = BUF_LEN;
+  s->max_niov = NUM_IOV;
+  s->nthread = 1;
+  s->signal_fd = -1;
+  s->epoll_fd = -1;
+  s->done_fd = -1;
+}
+
+/* parse <cpu>[,<cpu>...]; the threads are pinned to them in turn */
+int sink_cpus(struct sink *s, char *list) {
+  char *c, *save = NULL;
+
+  for(c = strtok_r(list, ",", &save); c; c = strtok_r(NULL, ",", &save)) {
+    if (s->ncpu == SINK_MAX_THREADS) return -1;
+    s->cpus[s->ncpu] = atoi(c);
+    if (s->cpus[s->ncpu] < 0) return -1;
+    s->ncpu++;
+  }
+
+  return s->ncpu ? 0 : -1;
+}
+
+/* a new entry in the sink's rings, yet to be opened */
+static struct sink_ring *new_ring(struct sink *s, char *name, void *data) {
+  struct sink_ring *r, *tmp;
+
+  tmp = realloc(s->ringv, (s->num_ring + 1) * sizeof(*r));
+  if (tmp == NULL) goto oom;
+  s->ringv = tmp;
+  r = &s->ringv[s->num_ring];
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  r->data = data;
+  r->name = strdup(name);
+  if (r->name == NULL) goto oom;
+  s->num_ring++;
+  return r;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+  return NULL;
+}
+
+/* open a ring, to be read once the sink runs. data is the
+ * destination's, for its sink_ops */
+int sink_add(struct sink *s, char *name, void *data) {
+  struct sink_ring *r;
+  int rc = -1;
+
+  r = new_ring(s, name, data);
+  if (r == NULL) goto done;
+
+  if (s->verbose) fprintf(stderr, "opening %s\n", name);
+  r->ring = ccr_open(name, CCR_RDONLY|CCR_NONBLOCK);
+  if (r->ring == NULL) goto done;
+  r->own = 1;
+
+  r->fd = ccr_get_selectable_fd(r->ring);
+  if (r->fd < 0) goto done;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* add a ring the caller has opened (CCR_RDONLY|CCR_NONBLOCK).
+ * it stays the caller's to close */
+int sink_attach(struct sink *s, struct ccr *ring, char *name, void *data) {
+  struct sink_ring *r;
+  int rc = -1;
+
+  r = new_ring(s, name, data);
+  if (r == NULL) goto done;
+  r->ring = ring;
+
+  r->fd = ccr_get_selectable_fd(r->ring);
+  if (r->fd < 0) goto done;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* a ring's batches, once nbatch is final */
+static int ring_batches(struct sink *s, struct sink_ring *r) {
+  r->bt = calloc(s->nbatch, sizeof(struct sink_batch));
+  if (r->bt == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* a batch is no longer in flight. its buffer goes back to the
+ * pool; if every batch was in flight, the ring is polled again,
+ * unless the caller runs the loop (see sink_start) */
+static int batch_done(struct sink_batch *bt) {
+  struct sink_ring *r = bt->r;
+  struct sink_worker *w = r->w;
+
+  bufpool_put(&w->pool, bt->b);
+  bt->b = NULL;
+  w->in_flight--;
+  if ((r->in_flight-- == w->s->nbatch) && (w->epoll_fd != -1))
+    return mod_epoll(w->epoll_fd, EPOLLIN, r->fd);
+
+  return 0;
+}
+
+/*
+ * sink_ack
+ *
+ * the destination acknowledges n frames of the batch. with the
+ * last of them, the batch is done. call it on the ring's thread
+ *
+ */
+int sink_ack(struct sink_batch *bt, size_t n) {
+  assert(bt->b && (bt->pending >= n));
+  bt->r->w->now.acked += n;
+  bt->pending -= n;
+  if (bt->pending) return 0;
+  return batch_done(bt);
+}
+
+/* add a descriptor of the destination to the thread's loop. when
+ * it is ready, on_event gets it; sink_rewatch changes its events */
+int sink_watch(struct sink_worker *w, int fd, int events) {
+  return new_epoll(w->epoll_fd, events, fd);
+}
+
+int sink_rewatch(struct sink_worker *w, int fd, int events) {
+  return mod_epoll(w->epoll_fd, events, fd);
+}
+
+/* encode the frames of the batch as json, into bt->json, with
+ * their iovecs carved from the read buffer's scratch */
+static int encode(struct sink_batch *bt) {
+  struct sink_ring *r = bt->r;
+  struct pbuf *b = bt->b;
+  int rc = -1, sc;
+  size_t i, len;
+  struct cc *cc;
+  char *out;
+
+  cc = ccr_get_cc(r->ring);
+  bt->iov = b->aux;
+  bt->json.used = 0;
+  for(i = 0; i < bt->n; i++) {
+    sc = cc_to_json(cc, &out, &len, b->iov[i].iov_base, b->iov[i].iov_len,
+                    r->w->s->json_flags);
+    if (sc < 0) {
+      fprintf(stderr, "%s: json conversion failed\n", r->name);
+      goto done;
+    }
+    bt->iov[i].iov_base = (char*)bt->json.used; /* offset, until final */
+    bt->iov[i].iov_len = len;
+    if (keep_json(&bt->json, out, len, b->len) < 0) goto done;
+  }
+
+  for(i = 0; i < bt->n; i++)
+    bt->iov[i].iov_base = bt->json.buf + (size_t)bt->iov[i].iov_base;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * sink_step
+ *
+ * read the ring's frames in bulk into a pool buffer, encode them
+ * if need be, and send the batch. fewer than nbatch batches of
+ * the ring may be in flight. returns 1 if a batch was sent, 0 if
+ * the ring was empty, -1 on error
+ *
+ */
+int sink_step(struct sink_ring *r) {
+  struct sink_worker *w = r->w;
+  struct bufpool *pool = &w->pool;
+  struct sink *s = w->s;
+  struct sink_batch *bt;
+  int rc = -1, sc, n;
+  size_t niov, flen;
+  ssize_t nr;
+  char *f;
+
+  assert(r->in_flight < s->nbatch);
+  for(n = 0; r->bt[n].b; n++) assert(n < s->nbatch);
+  bt = &r->bt[n];
+  bt->r = r;
+  bt->pending = 1; /* held while sending; acks may come meanwhile */
+
+  bt->b = bufpool_get(pool);
+  if (bt->b == NULL) goto done;
+  r->in_flight++;
+  w->in_flight++;
+
+  /* let go json copies much larger than reads now need */
+  json_trim(&bt->json, pool->len);
+
+ again:
+  niov = bt->b->niov;
+  if (w->read_max && (w->read_max < niov)) niov = w->read_max;
+  nr = ccr_readv(r->ring, 0, bt->b->buf, bt->b->len, bt->b->iov, &niov);
+
+  /* a frame larger than the buffer. past max_len, pass over
+   * it if skip_big, rather than fail */
+  if (nr == -2) {
+    if (s->skip_big && (bt->b->len >= pool->max_len)) {
+      sc = ccr_getnext(r->ring, CCR_BUFFER, &f, &flen);
+      if (sc < 0) goto done;
+      fprintf(stderr, "%s: skipped a %zu byte frame (limit %zu)\n",
+        r->name, flen, pool->max_len);
+      goto again;
+    }
+    if (bufpool_grow(pool, bt->b) < 0) goto done;
+    goto again;
+  }
+
+  if (nr <= 0) {
+    if (nr) fprintf(stderr, "%s: ccr_readv: error %zd\n", r->name, nr);
+    else rc = 0; /* spurious wakeup */
+    goto done;
+  }
+
+  assert( niov > 0 );
+  bufpool_read(pool, bt->b, nr, niov);
+  bt->n = niov;
+  bt->aux = bt->b->aux;
+  if (s->json) bt->aux = (char*)bt->aux + bt->b->niov * sizeof(struct iovec);
+  w->now.reads++;
+  w->now.frames += niov;
+  w->now.bytes += nr;
+  if (r->in_flight == s->nbatch) w->now.stalls++;
+
+  if (s->json) {
+    sc = encode(bt);
+    if (sc < 0) goto done;
+  }
+  else bt->iov = bt->b->iov;
+
+  bt->pending += niov;
+  sc = s->ops->send_batch(bt);
+  if (sc < 0) goto done;
+
+  rc = 1;
+
+ done:
+  /* drop the hold; if nothing was sent, or all of it is
+   * already acknowledged, the batch is done */
+  if (bt->b && (--bt->pending == 0)) {
+    sc = batch_done(bt);
+    if (sc < 0) rc = -1;
+  }
+  return rc;
+}
+
+/* called when ring is readable. the ring stays polled while
+ * its batch is in flight, unless all nbatch batches are */
+static int handle_ring(struct sink_ring *r) {
+  struct sink_worker *w = r->w;
+  int sc;
+
+  sc = sink_step(r);
+  if (sc < 0) return -1;
+
+  /* suspend ring epoll while every batch is in flight */
+  if (r->in_flight == w->s->nbatch)
+    return mod_epoll(w->epoll_fd, 0, r->fd);
+
+  return 0;
+}
+
+/* test if fd belongs to a ring of the thread.
+ * if so, return 1 and store its sink_ring* */
+static int is_ring(struct sink_worker *w, int fd, struct sink_ring **r) {
+  struct sink *s = w->s;
+  int i;
+
+  for(i=0; i < s->num_ring; i++) {
+    if ((s->ringv[i].w != w) || (s->ringv[i].fd != fd))
+      continue;
+
+    *r = &s->ringv[i];
+    return 1;
+  }
+
+  return 0;
+}
+
+/* collect the acknowledgements for the thread's rings: those
+ * with batches in flight, or all of them */
+static int collect(struct sink_worker *w, int all) {
+  struct sink *s = w->s;
+  struct sink_ring *r;
+  int i;
+
+  if (s->ops->on_ack == NULL) return 0;
+
+  for(i=0; i < s->num_ring; i++) {
+    r = &s->ringv[i];
+    if (r->w != w) continue;
+    if ((all == 0) && (r->in_flight == 0)) continue;
+    if (s->ops->on_ack(r) < 0) return -1;
+  }
+
+  return 0;
+}
+
+static void report(struct sink_worker *w, char *what, struct sink_stats *st) {
+  fprintf(stderr, "%s: %s%zu frames (%zu bytes) in %zu reads, "
+                  "%zu acknowledged; ring unpolled %zu times; "
+                  "%d batches in flight\n", w->name, what,
+    st->frames, st->bytes, st->reads, st->acked, st->stalls, w->in_flight);
+}
+
+static void add_stats(struct sink_stats *t, struct sink_stats *a) {
+  t->reads += a->reads;
+  t->frames += a->frames;
+  t->bytes += a->bytes;
+  t->acked += a->acked;
+  t->stalls += a->stalls;
+}
+
+/* once a second: collect acks, count the period, size the pool */
+static int periodic_work(struct sink_worker *w) {
+  struct sink *s = w->s;
+  int rc = -1, sc;
+
+  sc = collect(w, 1);
+  if (sc < 0) goto done;
+
+  if (s->verbose && (w->now.reads || w->now.acked))
+    report(w, "", &w->now);
+  add_stats(&w->total, &w->now);
+  memset(&w->now, 0, sizeof(w->now));
+
+  bufpool_period(&w->pool);
+  if (s->verbose) bufpool_report(&w->pool, w->name, 0);
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * worker_loop
+ *
+ * the event loop of a thread: its rings, the descriptors the
+ * destination watches, and its eventfd, by which the main thread
+ * ticks or stops it. while its batches are in flight it wakes
+ * often to collect their acks, if the destination has on_ack
+ *
+ */
+static int worker_loop(struct sink_worker *w) {
+  int rc = -1, sc, timeout;
+  struct sink *s = w->s;
+  struct epoll_event ev;
+  struct sink_ring *r;
+  uint64_t u;
+  ssize_t nr;
+
+  for (;;) {
+
+    /* acks may come only as we collect them; do so often */
+    timeout = (w->in_flight && s->ops->on_ack) ? SINK_ACK_MS : -1;
+    sc = epoll_wait(w->epoll_fd, &ev, 1, timeout);
+    if (sc < 0) {
+      fprintf(stderr,"epoll: %s\n", strerror(errno));
+      goto done;
+    }
+
+    if (sc == 0) {
+      if (collect(w, 0) < 0) goto done;
+      continue;
+    }
+
+    if (ev.data.fd == w->event_fd) {
+      nr = read(w->event_fd, &u, sizeof(u));
+      if (nr != sizeof(u)) {
+        fprintf(stderr, "eventfd: %s\n", strerror(errno));
+        goto done;
+      }
+      if (s->stop) break;
+      sc = periodic_work(w);
+      if (sc < 0) goto done;
+    }
+    else if (is_ring(w, ev.data.fd, &r)) {
+      sc = handle_ring(r);
+      if (sc < 0) goto done;
+      if (w->in_flight && (collect(w, 0) < 0)) goto done;
+    }
+    else if (s->ops->on_event) {
+      sc = s->ops->on_event(w, ev.data.fd, ev.events);
+      if (sc < 0) goto done;
+    }
+    else {
+      fprintf(stderr, "unknown fd\n");
+      assert(0);
+    }
+
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* thread start: pin to the cpu, if any, and run the loop.
+ * on the way out, tell the main thread */
+static void *worker(void *arg) {
+  struct sink_worker *w = (struct sink_worker*)arg;
+  uint64_t one = 1;
+  cpu_set_t set;
+  int sc;
+
+  w->rc = -1;
+  if (w->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    sc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (sc) {
+      fprintf(stderr, "%s: cpu %d: %s\n", w->name, w->cpu, strerror(sc));
+      goto done;
+    }
+  }
+
+  w->rc = worker_loop(w);
+
+ done:
+  if (write(w->s->done_fd, &one, sizeof(one)) != sizeof(one))
+    fprintf(stderr, "eventfd: %s\n", strerror(errno));
+  return NULL;
+}
+
+/* the thread's read buffer pool */
+static void worker_pool(struct sink_worker *w) {
+  struct sink *s = w->s;
+  size_t aux;
+
+  /* json frames are sent from iovecs of their own, ahead
+   * of the destination's scratch */
+  aux = s->json ? sizeof(struct iovec) : 0;
+  bufpool_init(&w->pool, s->max_len, s->max_niov, aux + s->aux_per,
+               s->aux_fixed);
+}
+
+/* the thread's epoll, eventfd and read buffer pool */
+static int setup_worker(struct sink_worker *w) {
+  struct sink *s = w->s;
+  int rc = -1, sc;
+
+  snprintf(w->name, sizeof(w->name), "thread %d", w->n);
+  w->cpu = s->ncpu ? s->cpus[w->n % s->ncpu] : -1;
+  worker_pool(w);
+
+  w->epoll_fd = epoll_create(1);
+  if (w->epoll_fd == -1) {
+    fprintf(stderr,"epoll: %s\n", strerror(errno));
+    goto done;
+  }
+
+  w->event_fd = eventfd(0, 0);
+  if (w->event_fd == -1) {
+    fprintf(stderr,"eventfd: %s\n", strerror(errno));
+    goto done;
+  }
+
+  sc = new_epoll(w->epoll_fd, EPOLLIN, w->event_fd);
+  if (sc < 0) goto done;
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* wake each thread: for its periodic work, or to stop */
+static int tick_workers(struct sink *s) {
+  uint64_t one = 1;
+  ssize_t nr;
+  int i;
+
+  for(i = 0; i < s->nthread; i++) {
+    nr = write(s->workv[i].event_fd, &one, sizeof(one));
+    if (nr != sizeof(one)) {
+      fprintf(stderr, "eventfd: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* stop the threads that were started, and join them */
+static void stop_workers(struct sink *s) {
+  uint64_t one = 1;
+  struct sink_worker *w;
+  int i;
+
+  s->stop = 1;
+  for(i=0; s->workv && (i < s->nthread); i++) {
+    w = &s->workv[i];
+    if (w->started == 0) continue;
+    if (write(w->event_fd, &one, sizeof(one)) != sizeof(one))
+      fprintf(stderr, "eventfd: %s\n", strerror(errno));
+    pthread_join(w->th, NULL);
+  }
+}
+
+/* returns 1 on a signal to end, 0 to go on, -1 on error */
+static int handle_signal(struct sink *s) {
+  struct signalfd_siginfo info;
+  int sc, rc=-1;
+  ssize_t nr;
+  char *n;
+
+  nr = read(s->signal_fd, &info, sizeof(info));
+  if (nr != sizeof(info)) {
+    fprintf(stderr,"failed to read signal fd buffer\n");
+    goto done;
+  }
+
+  switch(info.ssi_signo) {
+    case SIGALRM:
+      sc = tick_workers(s);
+      if (sc < 0) goto done;
+      alarm(1);
+      rc = 0;
+      break;
+    default:
+      n = strsignal(info.ssi_signo);
+      fprintf(stderr,"got signal %d (%s)\n", info.ssi_signo, n);
+      rc = 1;
+      break;
+  }
+
+ done:
+  return rc;
+}
+
+/*
+ * sink_run
+ *
+ * deal the rings out over the threads, open them to their
+ * destination, and run until a signal to end, or until a thread
+ * ends on error. returns -1 on error
+ *
+ */
+int sink_run(struct sink *s) {
+  struct epoll_event ev;
+  struct sink_worker *w;
+  struct sink_ring *r;
+  int rc = -1, sc, i;
+  sigset_t all, sw;
+  unsigned n;
+
+  assert(s->ops->send_batch);
+  assert((s->nbatch >= 1) && (s->nbatch <= SINK_MAX_BATCHES));
+  assert((s->nthread >= 1) && (s->nthread <= SINK_MAX_THREADS));
+  if (s->num_ring == 0) {
+    fprintf(stderr, "no rings\n");
+    goto done;
+  }
+
+  /* block all signals. we take signals synchronously via signalfd.
+   * the threads inherit the mask, so signals come only to main */
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK,&all,NULL);
+
+  /* a few signals we'll accept via our signalfd */
+  sigemptyset(&sw);
+  for(n=0; n < sizeof(sigs)/sizeof(*sigs); n++) sigaddset(&sw, sigs[n]);
+
+  s->signal_fd = signalfd(-1, &sw, 0);
+  if (s->signal_fd == -1) {
+    fprintf(stderr,"signalfd: %s\n", strerror(errno));
+    goto done;
+  }
+
+  s->epoll_fd = epoll_create(1);
+  if (s->epoll_fd == -1) {
+    fprintf(stderr,"epoll: %s\n", strerror(errno));
+    goto done;
+  }
+
+  s->done_fd = eventfd(0, 0);
+  if (s->done_fd == -1) {
+    fprintf(stderr,"eventfd: %s\n", strerror(errno));
+    goto done;
+  }
+
+  if (new_epoll(s->epoll_fd, EPOLLIN, s->signal_fd)) goto done;
+  if (new_epoll(s->epoll_fd, EPOLLIN, s->done_fd))   goto done;
+
+  /* the threads; the rings are dealt out over them in turn */
+  if (s->nthread > s->num_ring) s->nthread = s->num_ring;
+  s->workv = calloc(s->nthread, sizeof(struct sink_worker));
+  if (s->workv == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
+  for(i=0; i < s->nthread; i++) {
+    w = &s->workv[i];
+    w->s = s;
+    w->n = i;
+    w->epoll_fd = -1;
+    w->event_fd = -1;
+  }
+
+  for(i=0; i < s->nthread; i++) {
+    sc = setup_worker(&s->workv[i]);
+    if (sc < 0) goto done;
+  }
+
+  for(i=0; i < s->num_ring; i++) {
+    r = &s->ringv[i];
+    r->w = &s->workv[i % s->nthread];
+    r->w->num_ring++;
+    if (ring_batches(s, r) < 0) goto done;
+  }
+
+  for(i=0; i < s->num_ring; i++) {
+    r = &s->ringv[i];
+    sc = new_epoll(r->w->epoll_fd, EPOLLIN, r->fd);
+    if (sc < 0) goto done;
+    if (s->ops->open && (s->ops->open(r) < 0)) goto done;
+  }
+
+  for(i=0; i < s->nthread; i++) {
+    w = &s->workv[i];
+    sc = pthread_create(&w->th, NULL, worker, w);
+    if (sc) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(sc));
+      goto done;
+    }
+    w->started = 1;
+  }
+
+  /* the main thread takes signals, until one or a thread ends */
+  alarm(1);
+  for (;;) {
+
+    sc = epoll_wait(s->epoll_fd, &ev, 1, -1);
+    if (sc < 0) {
+      fprintf(stderr,"epoll: %s\n", strerror(errno));
+      goto done;
+    }
+
+    if (ev.data.fd == s->signal_fd) {
+      sc = handle_signal(s);
+      if (sc < 0) goto done;
+      if (sc > 0) break;
+    }
+    else if (ev.data.fd == s->done_fd) {
+      break;
+    }
+    else {
+      fprintf(stderr, "unknown fd\n");
+      assert(0);
+    }
+
+  }
+
+  rc = 0;
+
+ done:
+  stop_workers(s);
+  for(i=0; s->workv && (i < s->nthread); i++)
+    if (s->workv[i].started && (s->workv[i].rc < 0)) rc = -1;
+  return rc;
+}
+
+/*
+ * sink_start
+ *
+ * ready the rings to be read by sink_step from a loop of the
+ * caller's own, on its thread: one worker, with no thread, epoll
+ * or eventfd, named after the first ring. then open the rings to
+ * their destination. returns -1 on error
+ *
+ */
+int sink_start(struct sink *s) {
+  struct sink_worker *w;
+  struct sink_ring *r;
+  int rc = -1, i;
+
+  assert(s->ops->send_batch);
+  assert(s->nbatch >= 1);
+  if (s->num_ring == 0) {
+    fprintf(stderr, "no rings\n");
+    goto done;
+  }
+
+  s->nthread = 1;
+  s->workv = calloc(1, sizeof(struct sink_worker));
+  if (s->workv == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
+  }
+  w = &s->workv[0];
+  w->s = s;
+  w->cpu = -1;
+  w->epoll_fd = -1;
+  w->event_fd = -1;
+  snprintf(w->name, sizeof(w->name), "%s", s->ringv[0].name);
+  worker_pool(w);
+
+  for(i=0; i < s->num_ring; i++) {
+    r = &s->ringv[i];
+    r->w = w;
+    w->num_ring++;
+    if (ring_batches(s, r) < 0) goto done;
+  }
+
+  for(i=0; i < s->num_ring; i++) {
+    r = &s->ringv[i];
+    if (s->ops->open && (s->ops->open(r) < 0)) goto done;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* the periodic work of sink_start's worker, to be called once a
+ * second from the caller's loop. returns -1 on error */
+int sink_period(struct sink *s) {
+  if (s->workv == NULL) return 0;
+  return periodic_work(&s->workv[0]);
+}
+
+/* close the rings and free the sink. buffers of batches still
+ * in flight are left to the destination */
+void sink_fini(struct sink *s) {
+  struct sink_worker *w;
+  struct sink_ring *r;
+  int i, n;
+
+  for(i=0; i < s->num_ring; i++) {
+    r = &s->ringv[i];
+    if (r->ring && r->own) ccr_close(r->ring);
+    /* do not close r->fd */
+    for(n=0; r->bt && (n < s->nbatch); n++)
+      if ((r->bt[n].b == NULL) && r->bt[n].json.buf) free(r->bt[n].json.buf);
+    if (r->bt) free(r->bt);
+    free(r->name);
+  }
+  if (s->ringv) free(s->ringv);
+
+  for(i=0; s->workv && (i < s->nthread); i++) {
+    w = &s->workv[i];
+    if (s->verbose) {
+      add_stats(&w->total, &w->now);
+      report(w, "total ", &w->total);
+      bufpool_report(&w->pool, w->name, 1);
+    }
+    bufpool_fini(&w->pool);
+    if (w->epoll_fd != -1) close(w->epoll_fd);
+    if (w->event_fd != -1) close(w->event_fd);
+  }
+  if (s->workv) free(s->workv);
+
+  if (s->epoll_fd != -1) close(s->epoll_fd);
+  if (s->signal_fd != -1) close(s->signal_fd);
+  if (s->done_fd != -1) close(s->done_fd);
+}
@@ -0,0 +1,152 @@
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "ccr.h"
+#include "bufpool.h"
+#include "pubutil.h"
+
+/*
+ * the sink engine: the event loop of a ring publisher, less the
+ * destination. it reads each ring in bulk into a pool buffer (see
+ * bufpool.h), encodes the frames as json if asked, and hands the
+ * batch to the destination, which may deliver it later. up to
+ * nbatch batches of a ring are in flight at once, so the ring is
+ * read on while earlier batches are delivered; the ring is unpolled
+ * only while all are. the rings are dealt out over nthread threads,
+ * each with its own event loop, buffer pool and counters. the main
+ * thread takes the signals and ticks the threads once a second.
+ *
+ * a destination supplies its sink_ops; all but send_batch may be
+ * NULL. each runs on the thread of its ring, except open, which
+ * runs before the threads start. each returns -1 on error, which
+ * ends the run.
+ *
+ *   open        connect the ring to its destination
+ *   send_batch  deliver a batch. its frames are reported with
+ *               sink_ack as they are acknowledged, during the
+ *               call or after it
+ *   on_ack      collect the acknowledgements waiting for the ring.
+ *               called while it has batches in flight, after each
+ *               read on its thread and every SINK_ACK_MS between;
+ *               and on each tick
+ *   on_event    a descriptor the destination added to the thread's
+ *               loop with sink_watch is ready (epoll events). this
+ *               suits a destination with sockets of its own, which
+ *               it writes as they drain and acknowledges from
+ *               their replies
+ *
+ * the core of the engine, which reads a ring, encodes the batch,
+ * sends it and recycles it on its acks, can also be driven from
+ * a loop of the caller's own. sink_attach (or sink_add) the ring,
+ * sink_start it, then call sink_step when the ring is readable
+ * and fewer than nbatch of its batches are in flight, and
+ * sink_period once a second. it all runs on the caller's thread;
+ * open is called from sink_start, and on_ack from sink_period.
+ * pausing the ring while every batch is in flight is up to the
+ * caller, as is waking it when one is done.
+ *
+ */
+#define SINK_DEFAULT_BATCHES 4
+#define SINK_MAX_BATCHES 16 /* under sink_run */
+#define SINK_MAX_THREADS 64
+#define SINK_ACK_MS 10
+
+struct sink;
+struct sink_ring;
+struct sink_worker;
+
+/* a ring read, in flight until every frame is acknowledged */
+struct sink_batch {
+  struct sink_ring *r;
+  struct pbuf *b;        /* the frames as read; NULL while free */
+  size_t n;              /* frames */
+  struct iovec *iov;     /* the frames as sent: b->iov, or their json */
+  void *aux;             /* the destination's scratch (aux_per) in b */
+  struct json_buf json;  /* json copies (see pubutil.h) */
+  size_t pending;        /* frames not acknowledged, +1 while sending */
+};
+
+struct sink_ring {
+  struct sink_worker *w; /* its thread */
+  char *name;
+  struct ccr *ring;
+  int own;               /* opened by sink_add */
+  int fd;
+  void *data;            /* the destination's */
+  struct sink_batch *bt; /* nbatch of them */
+  int in_flight;
+};
+
+struct sink_stats {
+  size_t reads;
+  size_t frames;
+  size_t bytes;          /* as read */
+  size_t acked;          /* frames */
+  size_t stalls;         /* times the ring was unpolled */
+};
+
+struct sink_worker {
+  struct sink *s;
+  int n;
+  char name[32];
+  pthread_t th;
+  int started;
+  int cpu;               /* pinned to this cpu; -1 if not */
+  int epoll_fd;
+  int event_fd;
+  int num_ring;          /* rings it reads */
+  size_t read_max;       /* frames per read; 0 = as many as fit */
+  struct bufpool pool;   /* read buffers */
+  int in_flight;         /* batches, over its rings */
+  struct sink_stats now; /* this period */
+  struct sink_stats total;
+  int rc;
+};
+
+struct sink_ops {
+  int (*open)(struct sink_ring *r);
+  int (*send_batch)(struct sink_batch *bt);
+  int (*on_ack)(struct sink_ring *r);
+  int (*on_event)(struct sink_worker *w, int fd, int events);
+};
+
+struct sink {
+  struct sink_ops *ops;
+  void *data;            /* the destination's */
+  int verbose;
+  int json;              /* encode the frames as json */
+  unsigned json_flags;   /* CC_PRETTY, CC_NEWLINE */
+  int nbatch;            /* batches in flight per ring */
+  size_t max_len;        /* of a read buffer */
+  size_t max_niov;       /* frames per read */
+  size_t aux_per;        /* destination scratch per frame of a read */
+  size_t aux_fixed;      /* and per read (see bufpool.h) */
+  int skip_big;          /* pass over frames over max_len; else fail */
+
+  /* threads, and the cpus they are pinned to */
+  int nthread;
+  int cpus[SINK_MAX_THREADS];
+  int ncpu;
+  struct sink_worker *workv;
+
+  int num_ring;
+  struct sink_ring *ringv;
+
+  int signal_fd;
+  int epoll_fd;
+  int done_fd;           /* a thread has ended */
+  volatile int stop;
+};
+
+void sink_init(struct sink *s, struct sink_ops *ops, void *data);
+int sink_cpus(struct sink *s, char *list);
+int sink_add(struct sink *s, char *name, void *data);
+int sink_attach(struct sink *s, struct ccr *ring, char *name, void *data);
+int sink_run(struct sink *s);
+int sink_start(struct sink *s);
+int sink_step(struct sink_ring *r);
+int sink_period(struct sink *s);
+int sink_ack(struct sink_batch *bt, size_t n);
+int sink_watch(struct sink_worker *w, int fd, int events);
+int sink_rewatch(struct sink_worker *w, int fd, int events);
+void sink_fini(struct sink *s);